@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "arena.h"
+
+/* most files fit in one chunk: the sections and the EXIF entries take a
+ * few KB, the file contents themselves are mapped */
+#define ARENA_CHUNK_SIZE 65536
+/* released arenas kept for reuse */
+#define ARENA_POOL_MAX 64
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+};
+
+/* in front of every block, for realloc and free */
+union arena_block {
+    struct {
+        size_t size;
+        /* NULL if it comes from malloc(3) */
+        struct arena *owner;
+    };
+    max_align_t align;
+};
+
+#define ARENA_ROUND(n) \
+    (((n) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+static struct arena *pool;
+static unsigned int pool_size;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local struct arena *current;
+
+static void *exif_mem_alloc_func(ExifLong size);
+static void *exif_mem_realloc_func(void *p, ExifLong size);
+static void exif_mem_free_func(void *p);
+
+static struct arena_chunk *chunk_new(size_t size)
+{
+    struct arena_chunk *c = malloc(sizeof(struct arena_chunk) + size);
+
+    if (c == NULL)
+        return NULL;
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+struct arena *arena_new(void)
+{
+    struct arena *a, *prev;
+
+    pthread_mutex_lock(&pool_lock);
+    if ((a = pool) != NULL) {
+        pool = a->next;
+        pool_size--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (a == NULL && (a = calloc(1, sizeof(struct arena))) != NULL) {
+        /* exif_mem_new() allocates the ExifMem through our own callbacks.
+         * it outlives every file, so it mustn't land in the arena of the
+         * job the calling thread is in, which is reset once it's done */
+        prev = arena_enter(NULL);
+        a->mem = exif_mem_new(exif_mem_alloc_func, exif_mem_realloc_func,
+                exif_mem_free_func);
+        arena_enter(prev);
+        if (a->mem == NULL) {
+            free(a);
+            a = NULL;
+        }
+    }
+    return a;
+}
+
+void arena_release(struct arena *a)
+{
+    struct arena_chunk *c, *next, *keep = NULL;
+
+    if (a == NULL)
+        return;
+
+    /* keep a single chunk of the usual size */
+    for (c = a->chunk; c != NULL; c = next) {
+        next = c->next;
+        if (keep == NULL && c->size == ARENA_CHUNK_SIZE) {
+            keep = c;
+            continue;
+        }
+        free(c);
+    }
+    if (keep != NULL) {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    a->chunk = keep;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_size < ARENA_POOL_MAX) {
+        a->next = pool;
+        pool = a;
+        pool_size++;
+        a = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (a != NULL) {
+        free(a->chunk);
+        exif_mem_unref(a->mem);
+        free(a);
+    }
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    struct arena_chunk *c = a->chunk;
+    union arena_block *b;
+    size_t n = sizeof(union arena_block) + ARENA_ROUND(size);
+
+    if (c == NULL || c->size - c->used < n) {
+        /* big blocks get room to grow in place as well: libexif saves
+         * EXIF data reallocating it a few bytes at a time */
+        if ((c = chunk_new(2 * n > ARENA_CHUNK_SIZE ? 2 * n :
+                        ARENA_CHUNK_SIZE)) == NULL)
+            return NULL;
+        c->next = a->chunk;
+        a->chunk = c;
+    }
+
+    b = (union arena_block *)((unsigned char *)c->data + c->used);
+    c->used += n;
+    b->size = size;
+    b->owner = a;
+    memset(b + 1, 0, size);
+    return b + 1;
+}
+
+void *arena_realloc(struct arena *a, void *p, size_t size)
+{
+    struct arena_chunk *c = a->chunk;
+    union arena_block *b;
+    unsigned char *end;
+    void *q;
+
+    if (p == NULL)
+        return arena_alloc(a, size);
+
+    b = (union arena_block *)p - 1;
+    if (size <= b->size) {
+        b->size = size;
+        return p;
+    }
+
+    /* the last block of the current chunk grows in place */
+    end = (unsigned char *)p + ARENA_ROUND(b->size);
+    if (c != NULL && end == (unsigned char *)c->data + c->used &&
+            ARENA_ROUND(size) - ARENA_ROUND(b->size) <= c->size - c->used) {
+        c->used += ARENA_ROUND(size) - ARENA_ROUND(b->size);
+        b->size = size;
+        return p;
+    }
+
+    if ((q = arena_alloc(a, size)) == NULL)
+        return NULL;
+    memcpy(q, p, b->size);
+    return q;
+}
+
+struct arena *arena_enter(struct arena *a)
+{
+    struct arena *prev = current;
+
+    current = a;
+    return prev;
+}
+
+static void *exif_mem_alloc_func(ExifLong size)
+{
+    union arena_block *b;
+
+    if (current != NULL)
+        return arena_alloc(current, size);
+    if ((b = calloc(1, sizeof(union arena_block) + size)) == NULL)
+        return NULL;
+    b->size = size;
+    return b + 1;
+}
+
+static void *exif_mem_realloc_func(void *p, ExifLong size)
+{
+    union arena_block *b;
+
+    if (p == NULL)
+        return exif_mem_alloc_func(size);
+    b = (union arena_block *)p - 1;
+    if (b->owner != NULL)
+        return arena_realloc(b->owner, p, size);
+    if ((b = realloc(b, sizeof(union arena_block) + size)) == NULL)
+        return NULL;
+    b->size = size;
+    return b + 1;
+}
+
+static void exif_mem_free_func(void *p)
+{
+    union arena_block *b = (union arena_block *)p - 1;
+
+    /* arena blocks go with their arena */
+    if (p != NULL && b->owner == NULL)
+        free(b);
+}
+
+ExifMem *arena_exif_mem(struct arena *a)
+{
+    return a->mem;
+}
@@ -0,0 +1,50 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+#include <libexif/exif-mem.h>
+
+/* per-file bump allocator
+ *
+ * everything loaded for a file (JPEG sections, libexif entries) is carved
+ * out of a few big chunks, and dropped all at once when the file is done.
+ * freeing a block on its own does nothing. released arenas keep their
+ * first chunk and go back to a pool for the next files.
+ *
+ * every arena has its own ExifMem for libexif and libjpeg, so that its
+ * reference count is only touched by the thread working on the arena's
+ * file. libexif's allocator callbacks take no context though: new blocks
+ * come from the arena the calling thread entered last, or from malloc(3)
+ * if none. blocks are reallocated and freed by whatever they came from.
+ * a job has to be entered by whatever thread works on it before touching
+ * its data, and left once done with it.
+ */
+
+struct arena_chunk;
+
+struct arena {
+    /* the chunk being filled, the full ones behind it */
+    struct arena_chunk *chunk;
+    /* allocating from the entered arena, see above */
+    ExifMem *mem;
+    /* next free arena in the pool */
+    struct arena *next;
+};
+
+/* a reset arena from the pool, or a new one. NULL on failure */
+struct arena *arena_new(void);
+/* drop everything allocated from a and put it back in the pool */
+void  arena_release(struct arena *a);
+
+/* zeroed memory, aligned for any type */
+void *arena_alloc(struct arena *a, size_t size);
+void *arena_realloc(struct arena *a, void *p, size_t size);
+
+/* make a the arena of the calling thread, NULL to go back to malloc(3).
+ * returns the one entered before, to go back to it */
+struct arena *arena_enter(struct arena *a);
+/* allocator for libexif and libjpeg, for the data of a's file */
+ExifMem *arena_exif_mem(struct arena *a);
+
+#endif
@@ -0,0 +1,453 @@
+/* throughput benchmarks
+ *
+ * every benchmark runs over the whole corpus a number of rounds and the
+ * median round is reported, along with the spread between the fastest and
+ * the slowest one. the output is one line per benchmark, always in the
+ * same order and format, so that two runs can be diffed or parsed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <libexif/exif-data.h>
+#include "libjpeg/jpeg-data.h"
+#include "libjpeg/jpeg-gps.h"
+
+#include "rng.h"
+
+#define MAX_ROUNDS 64
+/* rounds run first and thrown away, for the caches and the allocator */
+#define WARMUP 1
+#define MAX_THREADS 16
+/* files drawn at once by the batched randomizer */
+#define RANDOMIZE_BATCH 64
+
+struct file {
+    char *name;
+    unsigned char *d;
+    unsigned int size;
+};
+
+struct corpus {
+    const char *dir;
+    struct file *files;
+    unsigned int count;
+    uint64_t bytes;
+};
+
+static unsigned int rounds = 5;
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_file(const void *a, const void *b)
+{
+    return strcmp(((const struct file *)a)->name,
+            ((const struct file *)b)->name);
+}
+
+/* the median of the rounds and how far apart the fastest and the slowest
+ * ones were. bytes is 0 when MB/s makes no sense. */
+static void report(const char *name, uint64_t *ns, uint64_t files,
+        uint64_t bytes)
+{
+    uint64_t median;
+
+    qsort(ns, rounds, sizeof(uint64_t), cmp_u64);
+    median = ns[rounds / 2];
+    if (median == 0)
+        median = 1;
+    printf("%-18s files/s=%12.1f MB/s=%9.1f ns/file=%10.0f spread=%5.1f%%\n",
+            name, files * 1e9 / median, bytes * 1e9 / median / 1048576,
+            (double)median / files, 100.0 * (ns[rounds - 1] - ns[0]) / median);
+    fflush(stdout);
+}
+
+static bool load_corpus(struct corpus *c)
+{
+    struct dirent *e;
+    struct stat st;
+    struct file *f;
+    DIR *dir;
+    char *path;
+    size_t size;
+    int fd;
+
+    if ((dir = opendir(c->dir)) == NULL) {
+        perror(c->dir);
+        return false;
+    }
+    while ((e = readdir(dir)) != NULL) {
+        if (e->d_name[0] == '.')
+            continue;
+        if ((c->files = realloc(c->files,
+                        (c->count + 1) * sizeof(struct file))) == NULL)
+            return false;
+        f = &c->files[c->count];
+        size = strlen(c->dir) + strlen(e->d_name) + 2;
+        if ((path = malloc(size)) == NULL)
+            return false;
+        snprintf(path, size, "%s/%s", c->dir, e->d_name);
+        if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1 ||
+                !S_ISREG(st.st_mode)) {
+            if (fd != -1)
+                close(fd);
+            free(path);
+            continue;
+        }
+        f->size = st.st_size;
+        if ((f->d = malloc(f->size)) == NULL ||
+                read(fd, f->d, f->size) != (ssize_t)f->size) {
+            perror(path);
+            return false;
+        }
+        close(fd);
+        free(path);
+        f->name = strdup(e->d_name);
+        c->bytes += f->size;
+        c->count++;
+    }
+    closedir(dir);
+    /* the same order, whatever readdir(3) says */
+    qsort(c->files, c->count, sizeof(struct file), cmp_file);
+    return c->count > 0;
+}
+
+/* the marker level parse, APP1 left as it is */
+static void bench_load_data(struct corpus *c)
+{
+    uint64_t ns[WARMUP + MAX_ROUNDS], start;
+    unsigned int r, i;
+    JPEGData *j;
+
+    for (r = 0; r < WARMUP + rounds; r++) {
+        start = now();
+        for (i = 0; i < c->count; i++) {
+            j = jpeg_data_new();
+            jpeg_data_load_data(j, c->files[i].d, c->files[i].size);
+            jpeg_data_unref(j);
+        }
+        ns[r] = now() - start;
+    }
+    report("load_data", ns + WARMUP, c->count, c->bytes);
+}
+
+/* the full rewrite path: loading plus building the libexif tree */
+static void bench_load_exif(struct corpus *c)
+{
+    uint64_t ns[WARMUP + MAX_ROUNDS], start;
+    unsigned int r, i;
+    ExifData *e;
+    JPEGData *j;
+
+    for (r = 0; r < WARMUP + rounds; r++) {
+        start = now();
+        for (i = 0; i < c->count; i++) {
+            j = jpeg_data_new();
+            jpeg_data_load_data(j, c->files[i].d, c->files[i].size);
+            if ((e = jpeg_data_get_exif_data(j)) != NULL)
+                exif_data_unref(e);
+            jpeg_data_unref(j);
+        }
+        ns[r] = now() - start;
+    }
+    report("load_exif", ns + WARMUP, c->count, c->bytes);
+}
+
+/* serializing files whose EXIF data was parsed, as they are rewritten */
+static void bench_save_data(struct corpus *c)
+{
+    uint64_t ns[WARMUP + MAX_ROUNDS], start;
+    JPEGData **js;
+    unsigned char *d;
+    unsigned int r, i, size;
+    ExifData *e;
+
+    if ((js = calloc(c->count, sizeof(JPEGData *))) == NULL)
+        return;
+    for (i = 0; i < c->count; i++) {
+        js[i] = jpeg_data_new();
+        jpeg_data_load_data(js[i], c->files[i].d, c->files[i].size);
+        if ((e = jpeg_data_get_exif_data(js[i])) != NULL)
+            exif_data_unref(e);
+    }
+
+    for (r = 0; r < WARMUP + rounds; r++) {
+        start = now();
+        for (i = 0; i < c->count; i++) {
+            d = NULL;
+            jpeg_data_save_data(js[i], &d, &size);
+            free(d);
+        }
+        ns[r] = now() - start;
+    }
+    report("save_data", ns + WARMUP, c->count, c->bytes);
+
+    for (i = 0; i < c->count; i++)
+        jpeg_data_unref(js[i]);
+    free(js);
+}
+
+/* the in place path: finding APP1 and the GPS entries in it */
+static void bench_gps_parse(struct corpus *c)
+{
+    uint64_t ns[WARMUP + MAX_ROUNDS], start;
+    unsigned int r, i, o, len, found = 0;
+    JPEGGpsInfo info;
+
+    for (r = 0; r < WARMUP + rounds; r++) {
+        start = now();
+        for (i = 0; i < c->count; i++)
+            if (jpeg_gps_find_app1_data(c->files[i].d, c->files[i].size,
+                        &o, &len) == 1 &&
+                    jpeg_gps_parse(&info, c->files[i].d + o, len))
+                found += info.count;
+        ns[r] = now() - start;
+    }
+    /* keep the loop from going away */
+    if (found == 0)
+        fprintf(stderr, "No GPS data in the corpus\n");
+    report("gps_parse", ns + WARMUP, c->count, c->bytes);
+}
+
+/* drawing the values of a file, on their own or many files at once */
+static void bench_randomize(struct corpus *c, unsigned int batch)
+{
+    uint64_t ns[WARMUP + MAX_ROUNDS], start, *streams;
+    struct gps_values *v;
+    unsigned int r, i, k, n;
+    uint32_t sum = 0;
+
+    streams = malloc(c->count * sizeof(uint64_t));
+    v = malloc(batch * sizeof(struct gps_values));
+    if (streams == NULL || v == NULL)
+        return;
+
+    for (r = 0; r < WARMUP + rounds; r++) {
+        start = now();
+        for (i = 0; i < c->count; i += n) {
+            n = c->count - i < batch ? c->count - i : batch;
+            for (k = i; k < i + n; k++)
+                streams[k] = rng_hash(c->files[k].name);
+            gps_values_fill(v, &streams[i], n, 1, 1577836800);
+            sum += v[0].latitude[2];
+        }
+        ns[r] = now() - start;
+    }
+    if (sum == 0xffffffff)
+        fprintf(stderr, "%u\n", sum);
+    report(batch == 1 ? "randomize" : "randomize_batch", ns + WARMUP,
+            c->count, 0);
+    free(streams);
+    free(v);
+}
+
+static bool copy_file(const char *from, const char *to)
+{
+    char buf[65536];
+    ssize_t n;
+    int in, out;
+    bool ok = true;
+
+    if ((in = open(from, O_RDONLY)) == -1)
+        return false;
+    if ((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        close(in);
+        return false;
+    }
+    while (ok && (n = read(in, buf, sizeof(buf))) > 0)
+        ok = write(out, buf, n) == n;
+    close(in);
+    return close(out) == 0 && ok;
+}
+
+/* a fresh copy of the corpus for every run, the tool changes the files */
+static bool copy_corpus(struct corpus *c, const char *dir)
+{
+    char from[4096], to[4096];
+    unsigned int i;
+
+    for (i = 0; i < c->count; i++) {
+        snprintf(from, sizeof(from), "%s/%s", c->dir, c->files[i].name);
+        snprintf(to, sizeof(to), "%s/%s", dir, c->files[i].name);
+        if (!copy_file(from, to)) {
+            perror(to);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void remove_corpus(struct corpus *c, const char *dir)
+{
+    char path[4096];
+    unsigned int i;
+
+    for (i = 0; i < c->count; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, c->files[i].name);
+        unlink(path);
+    }
+}
+
+/* the time rand_gps_exif takes over a copy of the corpus, or 0 */
+static uint64_t run_tool(const char *binary, const char *dir,
+        unsigned int threads, bool uring)
+{
+    char jobs[16];
+    uint64_t start;
+    pid_t pid;
+    int status, null;
+
+    snprintf(jobs, sizeof(jobs), "%u", threads);
+    start = now();
+    if ((pid = fork()) == -1)
+        return 0;
+    if (pid == 0) {
+        if ((null = open("/dev/null", O_WRONLY)) != -1) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        /* seeded, every run writes the same values */
+        if (uring)
+            execl(binary, binary, "-R", "-u", "-s", "1", "-j", jobs, dir,
+                    (char *)NULL);
+        else
+            execl(binary, binary, "-R", "-s", "1", "-j", jobs, dir,
+                    (char *)NULL);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0)
+        return 0;
+    return now() - start;
+}
+
+static void bench_end_to_end(struct corpus *c, const char *binary,
+        const unsigned int *threads, unsigned int n_threads, bool uring)
+{
+    uint64_t ns[WARMUP + MAX_ROUNDS];
+    const char *tmp = getenv("TMPDIR");
+    char dir[4096], name[32];
+    unsigned int r, t;
+
+    snprintf(dir, sizeof(dir), "%s/rand_gps_exif-bench.XXXXXX",
+            tmp != NULL ? tmp : "/tmp");
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return;
+    }
+    for (t = 0; t < n_threads; t++) {
+        for (r = 0; r < WARMUP + rounds; r++) {
+            if (!copy_corpus(c, dir))
+                goto out;
+            if ((ns[r] = run_tool(binary, dir, threads[t], uring)) == 0) {
+                fprintf(stderr, "%s failed\n", binary);
+                goto out;
+            }
+            remove_corpus(c, dir);
+        }
+        snprintf(name, sizeof(name), "end_to_end%s_j%u", uring ? "_u" : "",
+                threads[t]);
+        report(name, ns + WARMUP, c->count, c->bytes);
+    }
+out:
+    remove_corpus(c, dir);
+    rmdir(dir);
+}
+
+static unsigned int parse_threads(char *s, unsigned int *threads)
+{
+    unsigned int n = 0;
+    char *tok, *save;
+
+    for (tok = strtok_r(s, ",", &save); tok != NULL && n < MAX_THREADS;
+            tok = strtok_r(NULL, ",", &save))
+        if ((threads[n] = strtoul(tok, NULL, 10)) > 0)
+            n++;
+    return n;
+}
+
+static void usage(const char *p)
+{
+    fprintf(stderr,
+            "usage: %s [-r rounds] [-j threads,...] [-b binary] [-u] corpus\n" \
+            "\t-r\tRounds of every benchmark, the median is kept " \
+            "(default: 5)\n" \
+            "\t-j\tThread counts of the end to end runs (default: 1,2,4,8)\n" \
+            "\t-b\trand_gps_exif binary for the end to end runs, none if " \
+            "not given\n" \
+            "\t-u\tAlso run end to end with io_uring\n",
+            p);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct corpus c = { NULL, NULL, 0, 0 };
+    unsigned int threads[MAX_THREADS] = { 1, 2, 4, 8 }, n_threads = 4;
+    const char *binary = NULL;
+    bool uring = false;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "r:j:b:uh")) != -1) {
+        switch (ch) {
+            case 'r':
+                rounds = strtoul(optarg, NULL, 10);
+                if (rounds == 0 || rounds > MAX_ROUNDS)
+                    usage(argv[0]);
+                break;
+            case 'j':
+                if ((n_threads = parse_threads(optarg, threads)) == 0)
+                    usage(argv[0]);
+                break;
+            case 'b': binary = optarg; break;
+            case 'u': uring = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc)
+        usage(argv[0]);
+
+    c.dir = argv[optind];
+    if (!load_corpus(&c)) {
+        fprintf(stderr, "Couldn't load a corpus from '%s'\n", c.dir);
+        return 1;
+    }
+    printf("# corpus=%s files=%u bytes=%llu rounds=%u\n", c.dir, c.count,
+            (unsigned long long)c.bytes, rounds);
+
+    bench_load_data(&c);
+    bench_load_exif(&c);
+    bench_save_data(&c);
+    bench_gps_parse(&c);
+    bench_randomize(&c, 1);
+    bench_randomize(&c, RANDOMIZE_BATCH);
+    if (binary != NULL) {
+        bench_end_to_end(&c, binary, threads, n_threads, false);
+        if (uring)
+            bench_end_to_end(&c, binary, threads, n_threads, true);
+    }
+    return 0;
+}
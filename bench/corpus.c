@@ -0,0 +1,155 @@
+/* synthetic JPEG corpus for the benchmarks
+ *
+ * the images are laid out by synth.c. everything is drawn from the seed,
+ * the same arguments always give the same bytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "synth.h"
+
+enum order { ORDER_MIXED = 0, ORDER_MM, ORDER_II };
+
+struct options {
+    unsigned int count;
+    size_t size;
+    enum order order;
+    /* percentage of files with a GPS IFD */
+    unsigned int gps;
+    /* -1 for the mix */
+    long makernote;
+    long thumbnail;
+    long segments;
+    uint64_t seed;
+};
+
+/* the n-th file of the corpus */
+static void layout_of(struct layout *l, const struct options *o,
+        struct rng *r, unsigned int n)
+{
+    size_t room;
+
+    l->mm = o->order == ORDER_MIXED ? n % 2 == 0 : o->order == ORDER_MM;
+    l->gps = rng_uniform(r, 100) < o->gps;
+    l->makernote = o->makernote >= 0 ? (size_t)o->makernote :
+        (n % 3 == 0 ? 1024 + rng_uniform(r, 30 * 1024) : 0);
+    l->thumbnail = o->thumbnail >= 0 ? (size_t)o->thumbnail :
+        (n % 2 == 0 ? 4096 + rng_uniform(r, 12 * 1024) : 0);
+    l->segments = o->segments >= 0 ? (unsigned int)o->segments :
+        rng_uniform(r, 16);
+    /* +-25% around the size asked for */
+    l->size = o->size - o->size / 4 + rng_uniform(r, o->size / 2 + 1);
+
+    /* it all has to fit in a single APP1 segment */
+    room = APP1_MAX - APP1_OVERHEAD;
+    if (l->makernote > room)
+        l->makernote = room;
+    if (l->thumbnail > room - l->makernote)
+        l->thumbnail = room - l->makernote;
+}
+
+static size_t parse_size(const char *s)
+{
+    char *end;
+    size_t v = strtoull(s, &end, 10);
+
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+    }
+    if (end == s || *end != '\0') {
+        fprintf(stderr, "Bad size '%s'\n", s);
+        exit(1);
+    }
+    return v;
+}
+
+static void usage(const char *p)
+{
+    fprintf(stderr,
+            "usage: %s [-n count] [-s size] [-o MM|II|mixed] [-g percent] " \
+            "[-m makernote] [-t thumbnail] [-a segments] [-S seed] dir\n" \
+            "\t-n\tNumber of files (default: 1000)\n" \
+            "\t-s\tAverage file size, K and M suffixes (default: 256K)\n" \
+            "\t-o\tTIFF byte order (default: mixed)\n" \
+            "\t-g\tPercentage of files with GPS data (default: 75)\n" \
+            "\t-m\tMakerNote bytes (default: 0 to 31K, every 3rd file)\n" \
+            "\t-t\tThumbnail bytes (default: 4K to 16K, every 2nd file)\n" \
+            "\t-a\tExtra APPn/COM segments (default: 0 to 15)\n" \
+            "\t-S\tSeed (default: 1)\n",
+            p);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct options o = { 1000, 256 * 1024, ORDER_MIXED, 75, -1, -1, -1, 1 };
+    struct layout l;
+    struct buf b = { NULL, 0, 0, false };
+    struct rng r;
+    char *path;
+    size_t size, total = 0;
+    unsigned int i;
+    FILE *f;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "n:s:o:g:m:t:a:S:h")) != -1) {
+        switch (ch) {
+            case 'n': o.count = strtoul(optarg, NULL, 10); break;
+            case 's': o.size = parse_size(optarg); break;
+            case 'o':
+                if (strcmp(optarg, "MM") == 0)
+                    o.order = ORDER_MM;
+                else if (strcmp(optarg, "II") == 0)
+                    o.order = ORDER_II;
+                else if (strcmp(optarg, "mixed") == 0)
+                    o.order = ORDER_MIXED;
+                else
+                    usage(argv[0]);
+                break;
+            case 'g': o.gps = strtoul(optarg, NULL, 10); break;
+            case 'm': o.makernote = parse_size(optarg); break;
+            case 't': o.thumbnail = parse_size(optarg); break;
+            case 'a': o.segments = strtol(optarg, NULL, 10); break;
+            case 'S': o.seed = strtoull(optarg, NULL, 0); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc)
+        usage(argv[0]);
+
+    if (mkdir(argv[optind], 0777) == -1 && errno != EEXIST) {
+        perror(argv[optind]);
+        return 1;
+    }
+    size = strlen(argv[optind]) + 32;
+    if ((path = malloc(size)) == NULL)
+        return 1;
+
+    for (i = 0; i < o.count; i++) {
+        rng_init(&r, o.seed, i);
+        layout_of(&l, &o, &r, i);
+        b.len = 0;
+        b.mm = l.mm;
+        synth_jpeg(&b, &l, &r);
+
+        snprintf(path, size, "%s/img%06u.jpg", argv[optind], i);
+        if ((f = fopen(path, "wb")) == NULL ||
+                fwrite(b.d, 1, b.len, f) != b.len || fclose(f) != 0) {
+            perror(path);
+            return 1;
+        }
+        total += b.len;
+    }
+    printf("%u files, %zu bytes in %s\n", o.count, total, argv[optind]);
+    free(path);
+    free(b.d);
+    return 0;
+}
@@ -0,0 +1,319 @@
+/* the synthetic JPEG images of the benchmark corpus, see synth.h */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "synth.h"
+
+static void buf_grow(struct buf *b, size_t n)
+{
+    if (b->len + n <= b->cap)
+        return;
+    while (b->len + n > b->cap)
+        b->cap = b->cap ? 2 * b->cap : 65536;
+    if ((b->d = realloc(b->d, b->cap)) == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+}
+
+static void put(struct buf *b, const void *p, size_t n)
+{
+    buf_grow(b, n);
+    memcpy(b->d + b->len, p, n);
+    b->len += n;
+}
+
+static void put8(struct buf *b, unsigned int v)
+{
+    unsigned char c = v;
+
+    put(b, &c, 1);
+}
+
+/* JPEG markers are always big endian */
+static void put16be(struct buf *b, unsigned int v)
+{
+    put8(b, v >> 8);
+    put8(b, v);
+}
+
+/* TIFF values, in the byte order of the file */
+static void enc16(bool mm, unsigned char *p, unsigned int v)
+{
+    p[mm ? 0 : 1] = v >> 8;
+    p[mm ? 1 : 0] = v;
+}
+
+static void enc32(bool mm, unsigned char *p, uint32_t v)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+        p[mm ? i : 3 - i] = v >> (24 - 8 * i);
+}
+
+static void set32(struct buf *b, size_t o, uint32_t v)
+{
+    enc32(b->mm, b->d + o, v);
+}
+
+static void put16(struct buf *b, unsigned int v)
+{
+    buf_grow(b, 2);
+    enc16(b->mm, b->d + b->len, v);
+    b->len += 2;
+}
+
+static void put32(struct buf *b, uint32_t v)
+{
+    buf_grow(b, 4);
+    enc32(b->mm, b->d + b->len, v);
+    b->len += 4;
+}
+
+static void put_filler(struct buf *b, struct rng *r, size_t n)
+{
+    buf_grow(b, n);
+    /* no 0xff, there's no marker to find in there */
+    while (n--)
+        b->d[b->len++] = rng_uniform(r, 255);
+}
+
+struct ifd_entry {
+    uint16_t tag;
+    uint16_t format;
+    uint32_t components;
+    /* already in the byte order of the file, NULL for a LONG offset to
+     * be set later */
+    const unsigned char *value;
+    size_t size;
+};
+
+#define FMT_BYTE 1
+#define FMT_ASCII 2
+#define FMT_SHORT 3
+#define FMT_LONG 4
+#define FMT_RATIONAL 5
+#define FMT_UNDEFINED 7
+
+/* where the value of entry i, and the offset of the IFD after one of n
+ * entries, are */
+#define IFD_VALUE(ifd, i) ((ifd) + 2 + 12 * (i) + 8)
+#define IFD_NEXT(ifd, n) ((ifd) + 2 + 12 * (n))
+
+/* an IFD at the end of b, its values behind it. returns where it starts */
+static size_t put_ifd(struct buf *b, size_t tiff, const struct ifd_entry *e,
+        unsigned int n)
+{
+    size_t start = b->len, data;
+    unsigned int i;
+
+    put16(b, n);
+    data = b->len + 12 * n + 4;
+    for (i = 0; i < n; i++) {
+        put16(b, e[i].tag);
+        put16(b, e[i].format);
+        put32(b, e[i].components);
+        if (e[i].value == NULL || e[i].size <= 4) {
+            buf_grow(b, 4);
+            memset(b->d + b->len, 0, 4);
+            if (e[i].value != NULL)
+                memcpy(b->d + b->len, e[i].value, e[i].size);
+            b->len += 4;
+        } else {
+            put32(b, data - tiff);
+            data += e[i].size + (e[i].size & 1);
+        }
+    }
+    put32(b, 0);
+    for (i = 0; i < n; i++)
+        if (e[i].value != NULL && e[i].size > 4) {
+            put(b, e[i].value, e[i].size);
+            if (e[i].size & 1)
+                put8(b, 0);
+        }
+    return start;
+}
+
+/* n rationals into v */
+static void rationals(bool mm, unsigned char *v, const uint32_t *r,
+        unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < 2 * n; i++)
+        enc32(mm, v + 4 * i, r[i]);
+}
+
+static void put_exif(struct buf *b, const struct layout *l, struct rng *r)
+{
+    static const unsigned char version[4] = { '0', '2', '3', '0' };
+    static const unsigned char gps_version[4] = { 2, 3, 0, 0 };
+    unsigned char orientation[2], compression[2], lat[24], lon[24], alt[8],
+                  ts[24], *makernote, *thumbnail;
+    uint32_t v[6];
+    char date[20], datestamp[11];
+    size_t len_at, tiff, ifd0, ifd1, thumb;
+    unsigned int n;
+
+    makernote = malloc(l->makernote + 1);
+    thumbnail = malloc(l->thumbnail + 4);
+    if (makernote == NULL || thumbnail == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (n = 0; n < l->makernote; n++)
+        makernote[n] = rng_next(r);
+    /* a JPEG of its own, as far as anyone can tell */
+    memset(thumbnail, 0, l->thumbnail + 4);
+    thumbnail[0] = 0xff;
+    thumbnail[1] = 0xd8;
+    thumbnail[l->thumbnail + 2] = 0xff;
+    thumbnail[l->thumbnail + 3] = 0xd9;
+
+    snprintf(date, sizeof(date), "%04u:%02u:%02u %02u:%02u:%02u",
+            2000 + rng_uniform(r, 20), 1 + rng_uniform(r, 12),
+            1 + rng_uniform(r, 28), rng_uniform(r, 24), rng_uniform(r, 60),
+            rng_uniform(r, 60));
+    memcpy(datestamp, date, 10);
+    datestamp[10] = '\0';
+
+    put16be(b, 0xffe1);
+    len_at = b->len;
+    put16be(b, 0);
+    put(b, "Exif\0\0", 6);
+    tiff = b->len;
+    put(b, l->mm ? "MM" : "II", 2);
+    put16(b, 42);
+    put32(b, 8);
+
+    enc16(l->mm, orientation, 1);
+    struct ifd_entry ifd0_entries[] = {
+        { 0x010f, FMT_ASCII, 10, (const unsigned char *)"Synthetic", 10 },
+        { 0x0110, FMT_ASCII, 7, (const unsigned char *)"Bench1", 7 },
+        { 0x0112, FMT_SHORT, 1, orientation, 2 },
+        { 0x8769, FMT_LONG, 1, NULL, 4 },
+        { 0x8825, FMT_LONG, 1, NULL, 4 },
+    };
+    n = l->gps ? 5 : 4;
+    ifd0 = put_ifd(b, tiff, ifd0_entries, n);
+
+    struct ifd_entry exif_entries[] = {
+        { 0x9000, FMT_UNDEFINED, 4, version, 4 },
+        { 0x9003, FMT_ASCII, 20, (const unsigned char *)date, 20 },
+        { 0x927c, FMT_UNDEFINED, l->makernote, makernote, l->makernote },
+    };
+    set32(b, IFD_VALUE(ifd0, 3), b->len - tiff);
+    put_ifd(b, tiff, exif_entries, l->makernote ? 3 : 2);
+
+    if (l->gps) {
+        v[0] = rng_uniform(r, 90); v[1] = 1;
+        v[2] = rng_uniform(r, 60); v[3] = 1;
+        v[4] = rng_uniform(r, 600); v[5] = 10;
+        rationals(l->mm, lat, v, 3);
+        v[0] = rng_uniform(r, 180);
+        v[2] = rng_uniform(r, 60);
+        v[4] = rng_uniform(r, 600);
+        rationals(l->mm, lon, v, 3);
+        v[0] = rng_uniform(r, 4000); v[1] = 1;
+        rationals(l->mm, alt, v, 1);
+        v[0] = rng_uniform(r, 24); v[1] = 1;
+        v[2] = rng_uniform(r, 60); v[3] = 1;
+        v[4] = rng_uniform(r, 60); v[5] = 1;
+        rationals(l->mm, ts, v, 3);
+
+        struct ifd_entry gps_entries[] = {
+            { 0x0000, FMT_BYTE, 4, gps_version, 4 },
+            { 0x0001, FMT_ASCII, 2,
+                (const unsigned char *)(rng_uniform(r, 2) ? "S" : "N"), 2 },
+            { 0x0002, FMT_RATIONAL, 3, lat, 24 },
+            { 0x0003, FMT_ASCII, 2,
+                (const unsigned char *)(rng_uniform(r, 2) ? "W" : "E"), 2 },
+            { 0x0004, FMT_RATIONAL, 3, lon, 24 },
+            { 0x0005, FMT_BYTE, 1, (const unsigned char *)"\0", 1 },
+            { 0x0006, FMT_RATIONAL, 1, alt, 8 },
+            { 0x0007, FMT_RATIONAL, 3, ts, 24 },
+            { 0x001d, FMT_ASCII, 11, (const unsigned char *)datestamp, 11 },
+        };
+        set32(b, IFD_VALUE(ifd0, 4), b->len - tiff);
+        put_ifd(b, tiff, gps_entries, 9);
+    }
+
+    if (l->thumbnail) {
+        enc16(l->mm, compression, 6);
+        struct ifd_entry ifd1_entries[] = {
+            { 0x0103, FMT_SHORT, 1, compression, 2 },
+            { 0x0201, FMT_LONG, 1, NULL, 4 },
+            { 0x0202, FMT_LONG, 1, NULL, 4 },
+        };
+        set32(b, IFD_NEXT(ifd0, n), b->len - tiff);
+        ifd1 = put_ifd(b, tiff, ifd1_entries, 3);
+        thumb = b->len;
+        put(b, thumbnail, l->thumbnail + 4);
+        set32(b, IFD_VALUE(ifd1, 1), thumb - tiff);
+        set32(b, IFD_VALUE(ifd1, 2), l->thumbnail + 4);
+    }
+
+    b->d[len_at] = (b->len - len_at) >> 8;
+    b->d[len_at + 1] = b->len - len_at;
+    free(makernote);
+    free(thumbnail);
+}
+
+void synth_jpeg(struct buf *b, const struct layout *l, struct rng *r)
+{
+    unsigned int i, n;
+    size_t end;
+
+    put16be(b, 0xffd8);
+    put16be(b, 0xffe0);
+    put16be(b, 16);
+    put(b, "JFIF\0\1\1\0\0\1\0\1\0\0", 14);
+    put_exif(b, l, r);
+
+    /* ICC profiles, XMP, vendor segments... */
+    for (i = 0; i < l->segments; i++) {
+        n = 64 + rng_uniform(r, 2048);
+        put16be(b, i % 8 == 7 ? 0xfffe : 0xffe2 + i % 14);
+        put16be(b, n + 2);
+        put_filler(b, r, n);
+    }
+
+    /* DQT, SOF0, DHT, SOS */
+    put16be(b, 0xffdb);
+    put16be(b, 67);
+    put8(b, 0);
+    put_filler(b, r, 64);
+    put16be(b, 0xffc0);
+    put16be(b, 17);
+    put8(b, 8);
+    put16be(b, 480);
+    put16be(b, 640);
+    put8(b, 3);
+    for (i = 1; i <= 3; i++) {
+        put8(b, i);
+        put8(b, i == 1 ? 0x22 : 0x11);
+        put8(b, 0);
+    }
+    put16be(b, 0xffc4);
+    put16be(b, 31);
+    put8(b, 0);
+    put_filler(b, r, 28);
+    put16be(b, 0xffda);
+    put16be(b, 12);
+    put8(b, 3);
+    for (i = 1; i <= 3; i++) {
+        put8(b, i);
+        put8(b, 0);
+    }
+    put8(b, 0);
+    put8(b, 63);
+    put8(b, 0);
+
+    end = l->size > b->len + 2 ? l->size - 2 : b->len + 1024;
+    put_filler(b, r, end - b->len);
+    put16be(b, 0xffd9);
+}
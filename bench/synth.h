@@ -0,0 +1,41 @@
+#ifndef __SYNTH_H__
+#define __SYNTH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "rng.h"
+
+/* synthetic JPEG images, for the benchmark corpus and the tests
+ *
+ * the images are only valid at the marker level: the scan data is filler,
+ * which is all rand_gps_exif and libexif ever look at. everything is drawn
+ * from r, the same layout and stream always give the same bytes.
+ */
+
+/* room for the TIFF structure around the MakerNote and the thumbnail */
+#define APP1_MAX 65533
+#define APP1_OVERHEAD 512
+
+/* what a single file looks like */
+struct layout {
+    bool mm;
+    bool gps;
+    size_t makernote;
+    size_t thumbnail;
+    unsigned int segments;
+    size_t size;
+};
+
+/* grows as needed, exits if it can't */
+struct buf {
+    unsigned char *d;
+    size_t len;
+    size_t cap;
+    bool mm;
+};
+
+/* an image laid out as l appended to b, whose mm must be l's */
+void synth_jpeg(struct buf *b, const struct layout *l, struct rng *r);
+
+#endif
@@ -4,6 +4,11 @@ echo "Building libjpeg..."
 cmake . && make
 
 echo "Building rand_gps_exif..."
-gcc -Wall -I. -I./libjpeg -o rand_gps_exif libjpeg.a -lexif rand_gps_exif.c \
+gcc -Wall -I. -I./libjpeg -o rand_gps_exif rand_gps_exif.c randgps.c arena.c cache.c proto.c queue.c rng.c server.c stats.c tar.c uring.c walk.c watch.c libjpeg.a -lexif \
+    -lpthread \
     && file rand_gps_exif
 
+echo "Building rand_gps_client..."
+gcc -Wall -I. -o rand_gps_client client.c proto.c -lpthread \
+    && file rand_gps_client
+
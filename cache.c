@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+#define CACHE_MAGIC "RGPSC\0\0\1"
+#define CACHE_SHARDS 64
+/* next to the index, the entries put since it was saved */
+#define CACHE_JOURNAL_SUFFIX ".journal"
+
+/* open addressing on (dev, ino), grown at 3/4 */
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry *entries;
+    size_t mask;
+    size_t count;
+};
+
+struct cache {
+    char *path;
+    /* appended to by cache_put(), -1 without a path */
+    int journal;
+    atomic_bool dirty;
+    struct cache_shard shards[CACHE_SHARDS];
+};
+
+/* on disk: the magic, the size of an entry and how many follow */
+struct cache_header {
+    char magic[8];
+    uint32_t entry_size;
+    uint32_t reserved;
+    uint64_t count;
+};
+
+static uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static uint64_t key_hash(uint64_t dev, uint64_t ino)
+{
+    return mix64(ino ^ mix64(dev + 0x9e3779b97f4a7c15ull));
+}
+
+/* 8 bytes at a time, good enough to tell whether a segment changed */
+uint64_t cache_hash(const unsigned char *d, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325ull ^ size, w;
+
+    for (; size >= 8; d += 8, size -= 8) {
+        memcpy(&w, d, 8);
+        h = mix64(h ^ w);
+    }
+    w = 0;
+    memcpy(&w, d, size);
+    h = mix64(h ^ w);
+    /* 0 means no hash */
+    return h ? h : 1;
+}
+
+/* the slot of (dev, ino), or the empty one it would go to */
+static struct cache_entry *shard_find(struct cache_shard *s, uint64_t h,
+        uint64_t dev, uint64_t ino)
+{
+    struct cache_entry *e;
+    size_t i;
+
+    for (i = h & s->mask;; i = (i + 1) & s->mask) {
+        e = &s->entries[i];
+        if (e->state == 0 || (e->dev == dev && e->ino == ino))
+            return e;
+    }
+}
+
+static int shard_grow(struct cache_shard *s)
+{
+    struct cache_entry *old = s->entries, *e;
+    size_t i, n = s->mask + 1, size = old ? 2 * n : 1024;
+
+    if ((s->entries = calloc(size, sizeof(struct cache_entry))) == NULL) {
+        s->entries = old;
+        return -1;
+    }
+    s->mask = size - 1;
+    for (i = 0; old != NULL && i < n; i++)
+        if (old[i].state != 0) {
+            e = shard_find(s, key_hash(old[i].dev, old[i].ino),
+                    old[i].dev, old[i].ino);
+            *e = old[i];
+        }
+    free(old);
+    return 0;
+}
+
+static struct cache_shard *shard_of(struct cache *c, uint64_t h)
+{
+    /* the low bits pick the slot in the shard */
+    return &c->shards[(h >> 58) % CACHE_SHARDS];
+}
+
+static void shard_insert(struct cache *c, const struct cache_entry *e)
+{
+    uint64_t h = key_hash(e->dev, e->ino);
+    struct cache_shard *s = shard_of(c, h);
+    struct cache_entry *slot;
+
+    pthread_mutex_lock(&s->lock);
+    if ((s->count + 1) * 4 > (s->mask + 1) * 3 && shard_grow(s) == -1) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    slot = shard_find(s, h, e->dev, e->ino);
+    if (slot->state == 0)
+        s->count++;
+    *slot = *e;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void header_init(struct cache_header *hdr, uint64_t count)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+    hdr->entry_size = sizeof(struct cache_entry);
+    hdr->count = count;
+}
+
+static int cache_load(struct cache *c, FILE *f)
+{
+    struct cache_header hdr;
+    struct cache_entry e;
+    uint64_t i;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+            memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) ||
+            hdr.entry_size != sizeof(struct cache_entry))
+        return -1;
+    for (i = 0; i < hdr.count; i++) {
+        if (fread(&e, sizeof(e), 1, f) != 1)
+            return -1;
+        if (e.state != 0)
+            shard_insert(c, &e);
+    }
+    return 0;
+}
+
+/* the entries of a run that didn't get to save the index, then the
+ * journal is kept appending to. a run killed in the middle of writing an
+ * entry leaves a partial one at the end, it's dropped */
+static int journal_open(struct cache *c)
+{
+    struct cache_header hdr;
+    struct cache_entry e;
+    char *path;
+    size_t size = strlen(c->path) + sizeof(CACHE_JOURNAL_SUFFIX);
+    off_t end = sizeof(hdr);
+    ssize_t r;
+
+    if ((path = malloc(size)) == NULL)
+        return -1;
+    snprintf(path, size, "%s%s", c->path, CACHE_JOURNAL_SUFFIX);
+    c->journal = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    free(path);
+    if (c->journal == -1)
+        return -1;
+
+    if ((r = pread(c->journal, &hdr, sizeof(hdr), 0)) == sizeof(hdr)) {
+        if (memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) ||
+                hdr.entry_size != sizeof(struct cache_entry)) {
+            errno = EINVAL;
+            return -1;
+        }
+        while (pread(c->journal, &e, sizeof(e), end) == sizeof(e)) {
+            if (e.state != 0)
+                shard_insert(c, &e);
+            end += sizeof(e);
+        }
+        if (end > (off_t)sizeof(hdr))
+            atomic_store(&c->dirty, true);
+    } else {
+        header_init(&hdr, 0);
+        if (ftruncate(c->journal, 0) == -1 ||
+                write(c->journal, &hdr, sizeof(hdr)) != sizeof(hdr))
+            return -1;
+    }
+    /* appends go after the last whole entry */
+    return ftruncate(c->journal, end);
+}
+
+struct cache *cache_open(const char *path)
+{
+    struct cache *c;
+    FILE *f;
+    int i, err;
+
+    if ((c = calloc(1, sizeof(struct cache))) == NULL)
+        return NULL;
+    if (path != NULL && (c->path = strdup(path)) == NULL) {
+        free(c);
+        return NULL;
+    }
+    for (i = 0; i < CACHE_SHARDS; i++)
+        pthread_mutex_init(&c->shards[i].lock, NULL);
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        if (shard_grow(&c->shards[i]) == -1) {
+            cache_free(c);
+            return NULL;
+        }
+    }
+    atomic_init(&c->dirty, false);
+    c->journal = -1;
+
+    if (path == NULL)
+        return c;
+    if ((f = fopen(path, "rb")) == NULL) {
+        if (errno != ENOENT) {
+            cache_free(c);
+            return NULL;
+        }
+    } else if (cache_load(c, f) == -1) {
+        fclose(f);
+        cache_free(c);
+        errno = EINVAL;
+        return NULL;
+    } else
+        fclose(f);
+
+    if (journal_open(c) == -1) {
+        err = errno;
+        cache_free(c);
+        errno = err;
+        return NULL;
+    }
+    return c;
+}
+
+/* the directory of path, for a rename in it to last */
+static int sync_dir(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir;
+    int fd, r;
+
+    if (slash == NULL)
+        dir = strdup(".");
+    else if (slash == path)
+        dir = strdup("/");
+    else
+        dir = strndup(path, slash - path);
+    if (dir == NULL)
+        return -1;
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (fd == -1)
+        return -1;
+    r = fsync(fd);
+    close(fd);
+    return r;
+}
+
+int cache_save(struct cache *c)
+{
+    struct cache_header hdr;
+    struct cache_shard *s;
+    char *tmp;
+    size_t size, k;
+    FILE *f;
+    int i, ok;
+
+    if (c->path == NULL || !atomic_load(&c->dirty))
+        return 0;
+
+    /* written aside and renamed over, a crash leaves the old index */
+    size = strlen(c->path) + 32;
+    if ((tmp = malloc(size)) == NULL)
+        return -1;
+    snprintf(tmp, size, "%s.%ld.tmp", c->path, (long)getpid());
+    if ((f = fopen(tmp, "wb")) == NULL) {
+        free(tmp);
+        return -1;
+    }
+
+    header_init(&hdr, 0);
+    for (i = 0; i < CACHE_SHARDS; i++)
+        hdr.count += c->shards[i].count;
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+
+    for (i = 0; ok && i < CACHE_SHARDS; i++) {
+        s = &c->shards[i];
+        pthread_mutex_lock(&s->lock);
+        for (k = 0; ok && k <= s->mask; k++)
+            if (s->entries[k].state != 0)
+                ok = fwrite(&s->entries[k], sizeof(struct cache_entry),
+                        1, f) == 1;
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    if (ok && rename(tmp, c->path) == -1)
+        ok = 0;
+    if (!ok)
+        unlink(tmp);
+    else
+        atomic_store(&c->dirty, false);
+    free(tmp);
+
+    /* all in the index now, once the rename is. a crash before this
+     * replays the journal over it, which changes nothing */
+    if (ok && c->journal != -1 && (sync_dir(c->path) == -1 ||
+                ftruncate(c->journal, sizeof(hdr)) == -1))
+        ok = 0;
+    return ok ? 0 : -1;
+}
+
+void cache_free(struct cache *c)
+{
+    int i;
+
+    if (c == NULL)
+        return;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        free(c->shards[i].entries);
+        pthread_mutex_destroy(&c->shards[i].lock);
+    }
+    if (c->journal != -1)
+        close(c->journal);
+    free(c->path);
+    free(c);
+}
+
+bool cache_get(struct cache *c, const struct stat *st,
+        struct cache_entry *e)
+{
+    uint64_t h = key_hash(st->st_dev, st->st_ino);
+    struct cache_shard *s = shard_of(c, h);
+    struct cache_entry *slot;
+    bool found;
+
+    pthread_mutex_lock(&s->lock);
+    slot = shard_find(s, h, st->st_dev, st->st_ino);
+    if ((found = slot->state != 0))
+        *e = *slot;
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+bool cache_fresh(const struct cache_entry *e, const struct stat *st)
+{
+    return e->size == (uint64_t)st->st_size &&
+        e->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+        e->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec;
+}
+
+void cache_put(struct cache *c, const struct stat *st, uint64_t hash,
+        enum cache_state state)
+{
+    struct cache_entry e;
+    ssize_t r;
+
+    memset(&e, 0, sizeof(e));
+    e.dev = st->st_dev;
+    e.ino = st->st_ino;
+    e.size = st->st_size;
+    e.mtime_sec = st->st_mtim.tv_sec;
+    e.mtime_nsec = st->st_mtim.tv_nsec;
+    e.state = state;
+    e.hash = hash;
+    shard_insert(c, &e);
+    atomic_store(&c->dirty, true);
+
+    /* a single write(2) in append mode, so entries from different threads
+     * don't interleave. once it returns the entry is out of the process,
+     * and a run killed after that resumes from there. if it fails, the
+     * index saved at the end still has the entry */
+    if (c->journal != -1) {
+        r = write(c->journal, &e, sizeof(e));
+        (void)r;
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* persistent state of the files already processed
+ *
+ * files are known by (device, inode) and considered unchanged while their
+ * size and mtime are the same. a hash of their EXIF APP1 segment, as it
+ * was left, also tells when only the mtime moved. the whole index is kept
+ * in memory, split in shards with a lock each, and saved at the end of
+ * the run by replacing the file with rename(2). every entry put is also
+ * appended to a journal next to it (FILE.journal), replayed by the next
+ * cache_open() if the run never got to save the index.
+ */
+
+enum cache_state {
+    /* nothing to remove or randomize left in there */
+    CACHE_CLEAN = 1,
+    /* GPS data randomized */
+    CACHE_RANDOMIZED
+};
+
+struct cache_entry {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t state;
+    /* of the APP1 payload, 0 if unknown */
+    uint64_t hash;
+};
+
+struct cache;
+
+/* loads path if it exists, a NULL path keeps the index in memory only.
+ * NULL on failure */
+struct cache *cache_open(const char *path);
+/* writes the index back if anything changed, and empties the journal.
+ * -1 on failure */
+int   cache_save(struct cache *c);
+void  cache_free(struct cache *c);
+
+/* the entry of the file st is about, if any */
+bool  cache_get(struct cache *c, const struct stat *st,
+        struct cache_entry *e);
+/* whether st still matches e */
+bool  cache_fresh(const struct cache_entry *e, const struct stat *st);
+void  cache_put(struct cache *c, const struct stat *st, uint64_t hash,
+        enum cache_state state);
+
+uint64_t cache_hash(const unsigned char *d, size_t size);
+
+#endif
@@ -0,0 +1,518 @@
+/* rand_gps_client: talks to rand_gps_exif --listen */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libjpeg/jpeg-gps.h"
+#include "proto.h"
+
+/* -l: requests in flight on each connection (default) */
+#define LOAD_WINDOW 8
+
+/* a file read in memory */
+struct image {
+    const char *path;
+    unsigned char *data;
+    size_t size;
+    /* its GPS IFD, for -l to check the replies against */
+    bool gps;
+    JPEGGpsInfo info;
+    unsigned int app1;
+};
+
+/* one connection of -l */
+struct load {
+    pthread_t thread;
+    const char *socket;
+    struct image *images;
+    unsigned int n_images;
+    unsigned int window;
+    unsigned long requests;
+    /* the server removes the GPS data instead of randomizing it */
+    bool deleted;
+
+    /* nanoseconds from request to reply, by request */
+    uint64_t *latency;
+    unsigned long errors;
+    uint64_t bytes;
+    bool failed;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int connect_to(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_request(int fd, enum proto_type type, uint32_t id,
+        const void *data, size_t size)
+{
+    struct proto_header h;
+    struct iovec iov[2];
+
+    h.magic = PROTO_MAGIC;
+    h.version = PROTO_VERSION;
+    h.type = type;
+    h.id = id;
+    h.length = size;
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = size;
+    return proto_send(fd, iov, 2);
+}
+
+/* the whole of fd, NULL on failure */
+static unsigned char *read_all(int fd, size_t *size)
+{
+    unsigned char *d = NULL, *p;
+    size_t cap = 0;
+    ssize_t n;
+
+    *size = 0;
+    for (;;) {
+        if (*size == cap) {
+            cap = cap ? 2 * cap : 65536;
+            if (cap > PROTO_MAX_PAYLOAD + 1 ||
+                    (p = realloc(d, cap)) == NULL) {
+                free(d);
+                return NULL;
+            }
+            d = p;
+        }
+        if ((n = read(fd, d + *size, cap - *size)) == -1) {
+            if (errno == EINTR)
+                continue;
+            free(d);
+            return NULL;
+        }
+        if (n == 0)
+            return d;
+        *size += n;
+    }
+}
+
+static bool load_image(struct image *img, const char *path)
+{
+    int fd = STDIN_FILENO;
+
+    img->path = path;
+    if (strcmp(path, "-") != 0 && (fd = open(path, O_RDONLY)) == -1)
+        return false;
+    img->data = read_all(fd, &img->size);
+    if (fd != STDIN_FILENO)
+        close(fd);
+    if (img->data != NULL && img->size > PROTO_MAX_PAYLOAD) {
+        free(img->data);
+        img->data = NULL;
+        errno = EFBIG;
+    }
+    return img->data != NULL;
+}
+
+static bool write_image(const char *path, const unsigned char *d,
+        size_t size)
+{
+    int fd = STDOUT_FILENO;
+    bool ok = true;
+    ssize_t n;
+
+    if (path != NULL &&
+            (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        return false;
+    while (ok && size > 0) {
+        if ((n = write(fd, d, size)) == -1) {
+            ok = errno == EINTR;
+            continue;
+        }
+        d += n;
+        size -= n;
+    }
+    if (fd != STDOUT_FILENO && close(fd) == -1)
+        ok = false;
+    return ok;
+}
+
+/* each file processed in place by the server, by its absolute path */
+static int run_paths(int fd, char **files, int n)
+{
+    char path[PATH_MAX];
+    struct proto_header h;
+    unsigned char *payload;
+    int i, ret = 0;
+
+    for (i = 0; i < n; i++) {
+        if (realpath(files[i], path) == NULL) {
+            fprintf(stderr, "%s: %s\n", files[i], strerror(errno));
+            ret = 1;
+            continue;
+        }
+        if (send_request(fd, PROTO_PATH, i, path, strlen(path)) == -1 ||
+                proto_read(fd, &h, &payload) != 1) {
+            perror("request");
+            return 1;
+        }
+        free(payload);
+        if (h.type != PROTO_OK) {
+            fprintf(stderr, "%s: %s\n", files[i], proto_strstatus(h.type));
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+/* each image sent over and written back to dir, or stdout */
+static int run_images(int fd, char **files, int n, const char *dir)
+{
+    struct image img;
+    struct proto_header h;
+    unsigned char *payload;
+    const char *name;
+    char *out = NULL;
+    int i, ret = 0;
+
+    for (i = 0; i < n; i++) {
+        if (!load_image(&img, files[i])) {
+            fprintf(stderr, "%s: %s\n", files[i], strerror(errno));
+            ret = 1;
+            continue;
+        }
+        if (send_request(fd, PROTO_IMAGE, i, img.data, img.size) == -1 ||
+                proto_read(fd, &h, &payload) != 1) {
+            perror("request");
+            free(img.data);
+            return 1;
+        }
+        free(img.data);
+
+        if (h.type != PROTO_OK) {
+            fprintf(stderr, "%s: %s\n", files[i], proto_strstatus(h.type));
+            ret = 1;
+        } else {
+            if (dir != NULL) {
+                name = strrchr(files[i], '/');
+                name = (name != NULL ? name + 1 : files[i]);
+                if ((out = malloc(strlen(dir) + strlen(name) + 2)) == NULL) {
+                    free(payload);
+                    return 1;
+                }
+                sprintf(out, "%s/%s", dir, name);
+            }
+            if (!write_image(out, payload, h.length)) {
+                fprintf(stderr, "%s: %s\n", out ? out : "stdout",
+                        strerror(errno));
+                ret = 1;
+            }
+            free(out);
+            out = NULL;
+        }
+        free(payload);
+    }
+    return ret;
+}
+
+/* the GPS IFD of the APP1 payload of d, false if there's none */
+static bool parse_gps(const unsigned char *d, size_t size, JPEGGpsInfo *info,
+        unsigned int *app1)
+{
+    unsigned int len;
+
+    if (size > UINT32_MAX ||
+            jpeg_gps_find_app1_data(d, size, app1, &len) != 1)
+        return false;
+    return jpeg_gps_parse(info, d + *app1, len);
+}
+
+/* the reply to img must be a JPEG image of the same size or that parses
+ * back, whose position is gone or differs from the request's. the
+ * timestamp isn't compared, randomizing can draw the same one. */
+static bool check_reply(struct image *img, const unsigned char *d,
+        size_t size, bool deleted)
+{
+    static const ExifTag tags[] = {
+        EXIF_TAG_GPS_LATITUDE, EXIF_TAG_GPS_LONGITUDE
+    };
+    JPEGGpsInfo info;
+    JPEGGpsEntry *before, *after;
+    unsigned int app1, i;
+    bool parsed;
+
+    if (size < 2 || d[0] != 0xff || d[1] != 0xd8)
+        return false;
+    parsed = parse_gps(d, size, &info, &app1);
+    if (!parsed && size != img->size)
+        return false;
+    if (!img->gps)
+        return true;
+    /* removing can take the whole IFD */
+    if (deleted && !parsed)
+        return true;
+    if (!parsed)
+        return false;
+
+    for (i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+        before = jpeg_gps_get_entry(&img->info, tags[i]);
+        after = jpeg_gps_get_entry(&info, tags[i]);
+        if (deleted) {
+            if (after != NULL)
+                return false;
+        } else if (before != NULL) {
+            if (after == NULL || after->size != before->size ||
+                    memcmp(d + app1 + after->offset,
+                        img->data + img->app1 + before->offset,
+                        before->size) == 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+/* keep window requests in flight until all are answered */
+static void *load_main(void *arg)
+{
+    struct load *l = arg;
+    struct proto_header h;
+    unsigned char *payload;
+    uint64_t *sent;
+    unsigned long next = 0, done = 0;
+    struct image *img;
+    int fd;
+
+    if (l->requests == 0)
+        return NULL;
+    if ((sent = calloc(l->requests, sizeof(uint64_t))) == NULL ||
+            (fd = connect_to(l->socket)) == -1) {
+        free(sent);
+        l->failed = true;
+        return NULL;
+    }
+    while (done < l->requests) {
+        while (next < l->requests && next - done < l->window) {
+            img = &l->images[next % l->n_images];
+            sent[next] = now_ns();
+            if (send_request(fd, PROTO_IMAGE, next, img->data,
+                        img->size) == -1)
+                goto fail;
+            next++;
+        }
+        if (proto_read(fd, &h, &payload) != 1 || h.id >= next)
+            goto fail;
+        l->latency[done++] = now_ns() - sent[h.id];
+        l->bytes += l->images[h.id % l->n_images].size;
+        if (h.type != PROTO_OK ||
+                !check_reply(&l->images[h.id % l->n_images], payload,
+                    h.length, l->deleted))
+            l->errors++;
+        free(payload);
+    }
+    close(fd);
+    free(sent);
+    return NULL;
+
+fail:
+    l->failed = true;
+    close(fd);
+    free(sent);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* the same images over and over through conns connections */
+static int run_load(const char *sock, char **files, int n,
+        unsigned long requests, unsigned int conns, unsigned int window,
+        bool deleted)
+{
+    struct image *images = calloc(n, sizeof(struct image));
+    struct load *loads = calloc(conns, sizeof(struct load));
+    uint64_t *latency = calloc(requests, sizeof(uint64_t));
+    uint64_t start, elapsed, bytes = 0;
+    unsigned long errors = 0, k = 0;
+    unsigned int i;
+    int ret = 1;
+
+    if (images == NULL || loads == NULL || latency == NULL)
+        goto out;
+    for (i = 0; i < (unsigned int)n; i++)
+        if (!load_image(&images[i], files[i])) {
+            fprintf(stderr, "%s: %s\n", files[i], strerror(errno));
+            goto out;
+        }
+    for (i = 0; i < (unsigned int)n; i++)
+        images[i].gps = parse_gps(images[i].data, images[i].size,
+                &images[i].info, &images[i].app1);
+
+    start = now_ns();
+    for (i = 0; i < conns; i++) {
+        loads[i].socket = sock;
+        loads[i].images = images;
+        loads[i].n_images = n;
+        loads[i].window = window;
+        loads[i].deleted = deleted;
+        loads[i].requests = requests / conns + (i < requests % conns);
+        loads[i].latency = latency + k;
+        k += loads[i].requests;
+        if (pthread_create(&loads[i].thread, NULL, load_main,
+                    &loads[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < conns; i++) {
+        pthread_join(loads[i].thread, NULL);
+        if (loads[i].failed)
+            fprintf(stderr, "connection %u failed\n", i);
+        errors += loads[i].errors;
+        bytes += loads[i].bytes;
+    }
+    elapsed = now_ns() - start;
+
+    qsort(latency, requests, sizeof(uint64_t), cmp_u64);
+    printf("requests     %lu\n", requests);
+    printf("errors       %lu\n", errors);
+    printf("elapsed      %.3fs\n", elapsed / 1e9);
+    printf("throughput   %.0f req/s, %.1f MB/s\n",
+            requests * 1e9 / elapsed, bytes * 1e3 / elapsed);
+    printf("latency      p50 %.1fus  p99 %.1fus  max %.1fus\n",
+            latency[requests / 2] / 1e3, latency[requests * 99 / 100] / 1e3,
+            latency[requests - 1] / 1e3);
+    ret = errors > 0;
+    for (i = 0; i < conns; i++)
+        if (loads[i].failed)
+            ret = 1;
+out:
+    for (i = 0; images != NULL && i < (unsigned int)n; i++)
+        free(images[i].data);
+    free(images);
+    free(loads);
+    free(latency);
+    return ret;
+}
+
+static void usage(const char *p)
+{
+    (void)fprintf(stderr,
+            "usage: %s -S socket [-m [-o dir]] [-l requests [-c conns] " \
+            "[-w window] [-d]] file ...\n" \
+            "\t-S\tSocket of rand_gps_exif --listen\n" \
+            "\t-m\tSend the images instead of their paths, the results " \
+            "go to stdout\n" \
+            "\t-o\tWrite the results of -m to DIR instead\n" \
+            "\t-l\tLoad test: send the images that many times and " \
+            "report throughput and latency\n" \
+            "\t-c\tConnections of -l (default: 1)\n" \
+            "\t-w\tRequests in flight per connection of -l (default: %d)\n" \
+            "\t-d\tThe server runs with -d, the replies of -l must have " \
+            "no GPS data left\n" \
+            "\n",
+            p, LOAD_WINDOW);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *prog = argv[0], *sock = NULL, *dir = NULL;
+    unsigned long requests = 0;
+    unsigned int conns = 1, window = LOAD_WINDOW;
+    bool images = false, deleted = false;
+    char *end;
+    int ch, fd, ret;
+
+    while ((ch = getopt(argc, argv, "S:mo:l:c:w:dh")) != -1) {
+        switch (ch) {
+            case 'S':
+                sock = optarg;
+                break;
+            case 'm':
+                images = true;
+                break;
+            case 'o':
+                dir = optarg;
+                break;
+            case 'l':
+                requests = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || requests == 0)
+                    usage(prog);
+                break;
+            case 'c':
+                conns = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || conns == 0)
+                    usage(prog);
+                break;
+            case 'w':
+                window = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || window == 0)
+                    usage(prog);
+                break;
+            case 'd':
+                deleted = true;
+                break;
+            case 'h':
+            default:
+                usage(prog);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (sock == NULL || argc == 0)
+        usage(prog);
+
+    if (requests > 0)
+        return run_load(sock, argv, argc, requests, conns, window,
+                deleted);
+
+    /* the images would all go to stdout */
+    if (images && dir == NULL && argc > 1)
+        usage(prog);
+    if ((fd = connect_to(sock)) == -1) {
+        fprintf(stderr, "%s: %s\n", sock, strerror(errno));
+        return 1;
+    }
+    ret = images ? run_images(fd, argv, argc, dir) :
+        run_paths(fd, argv, argc);
+    close(fd);
+    return ret;
+}
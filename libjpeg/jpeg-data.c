@@ -18,47 +18,96 @@
  * Boston, MA  02110-1301  USA.
  */
 
+/* O_TMPFILE */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "jpeg-data.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 /* exif-i18n.h used to be imported here.
  */
 #define _(String) (String)
 
-/* realloc that cleans up on memory failure and returns to caller */
-#define CLEANUP_REALLOC(p,s) { \
-	unsigned char *cleanup_ptr = realloc((p),(s)); \
-	if (!cleanup_ptr) { free(p); (p) = NULL; return; } \
-	(p) = cleanup_ptr; \
-}
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 struct _JPEGDataPrivate
 {
 	unsigned int ref_count;
 
 	ExifLog *log;
+	ExifMem *mem;
+
+	/* Room in sections */
+	unsigned int alloc;
+
+	/* File contents the sections and the scan data may point into,
+	 * mapped or read into a buffer of ours */
+	unsigned char *map;
+	size_t map_size;
+	int mapped;
 };
 
+/* Whether p was allocated by us or is a view into the file contents */
+static int
+jpeg_data_owns (JPEGData *data, const unsigned char *p)
+{
+	JPEGDataPrivate *priv = data->priv;
+
+	return !(priv && priv->map && p >= priv->map &&
+		 p < priv->map + priv->map_size);
+}
+
+static void jpeg_data_load (JPEGData *data, const unsigned char *d,
+			    unsigned int size, int borrow);
+
 JPEGData *
 jpeg_data_new (void)
+{
+	ExifMem *mem = exif_mem_new_default ();
+	JPEGData *data = jpeg_data_new_mem (mem);
+
+	exif_mem_unref (mem);
+
+	return (data);
+}
+
+JPEGData *
+jpeg_data_new_mem (ExifMem *mem)
 {
 	JPEGData *data;
 
-	data = malloc (sizeof (JPEGData));
+	if (!mem)
+		return (NULL);
+
+	data = exif_mem_alloc (mem, sizeof (JPEGData));
 	if (!data)
 		return (NULL);
 	memset (data, 0, sizeof (JPEGData));
-	data->priv = malloc (sizeof (JPEGDataPrivate));
+	data->priv = exif_mem_alloc (mem, sizeof (JPEGDataPrivate));
 	if (!data->priv) {
-		free (data);
+		exif_mem_free (mem, data);
 		return (NULL);
 	}
 	memset (data->priv, 0, sizeof (JPEGDataPrivate));
 	data->priv->ref_count = 1;
 
+	data->priv->mem = mem;
+	exif_mem_ref (mem);
+
 	return (data);
 }
 
@@ -66,110 +115,404 @@ void
 jpeg_data_append_section (JPEGData *data)
 {
 	JPEGSection *s;
+	unsigned int alloc;
 
 	if (!data) return;
 
-	if (!data->count)
-		s = malloc (sizeof (JPEGSection));
-	else
-		s = realloc (data->sections,
-			     sizeof (JPEGSection) * (data->count + 1));
-	if (!s) {
-		EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data",
-				sizeof (JPEGSection) * (data->count + 1));
-		return;
+	/* Grow geometrically, a JPEG file usually has around ten sections */
+	if (data->count == data->priv->alloc) {
+		alloc = data->priv->alloc ? 2 * data->priv->alloc : 16;
+		s = exif_mem_realloc (data->priv->mem, data->sections,
+				      sizeof (JPEGSection) * alloc);
+		if (!s) {
+			EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data",
+					sizeof (JPEGSection) * alloc);
+			return;
+		}
+		data->sections = s;
+		data->priv->alloc = alloc;
 	}
-	memset(s + data->count, 0, sizeof (JPEGSection));
-	data->sections = s;
+	memset(data->sections + data->count, 0, sizeof (JPEGSection));
 	data->count++;
 }
 
-/*! jpeg_data_save_file returns 1 on success, 0 on failure */
-int
-jpeg_data_save_file (JPEGData *data, const char *path)
+/*
+ * The sections to write, as a list of buffers. The marker and length
+ * bytes live in heads, the EXIF data is serialized into buffers of its
+ * own and everything else points to the buffers of the JPEGData.
+ */
+typedef struct _JPEGDataIOV JPEGDataIOV;
+struct _JPEGDataIOV
 {
-	FILE *f;
-	unsigned char *d = NULL;
-	unsigned int size = 0, written;
+	ExifMem *mem;
 
-	jpeg_data_save_data (data, &d, &size);
-	if (!d)
-		return 0;
+	struct iovec *iov;
+	unsigned int count;
 
-	remove (path);
-	f = fopen (path, "wb");
-	if (!f) {
-		free (d);
-		return 0;
-	}
-	written = fwrite (d, 1, size, f);
-	fclose (f);
-	free (d);
-	if (written == size)  {
-		return 1;
-	}
-	remove(path);
-	return 0;
+	unsigned char *heads;
+	unsigned char **exif;
+	unsigned int exif_count;
+
+	size_t size;
+};
+
+static void
+jpeg_data_iov_free (JPEGDataIOV *v)
+{
+	unsigned int i;
+
+	for (i = 0; i < v->exif_count; i++)
+		exif_mem_free (v->mem, v->exif[i]);
+	exif_mem_free (v->mem, v->exif);
+	exif_mem_free (v->mem, v->heads);
+	exif_mem_free (v->mem, v->iov);
+	memset (v, 0, sizeof (JPEGDataIOV));
 }
 
-void
-jpeg_data_save_data (JPEGData *data, unsigned char **d, unsigned int *ds)
+static void
+jpeg_data_iov_add (JPEGDataIOV *v, const unsigned char *d, size_t size)
+{
+	if (!size)
+		return;
+	v->iov[v->count].iov_base = (void *) d;
+	v->iov[v->count].iov_len = size;
+	v->count++;
+	v->size += size;
+}
+
+/* jpeg_data_iov_build returns 1 on success, 0 on failure */
+static int
+jpeg_data_iov_build (JPEGData *data, JPEGDataIOV *v)
 {
 	unsigned int i, eds = 0;
+	unsigned char *h, *ed = NULL;
 	JPEGSection s;
-	unsigned char *ed = NULL;
 
-	if (!data)
-		return;
-	if (!d)
-		return;
-	if (!ds)
-		return;
+	memset (v, 0, sizeof (JPEGDataIOV));
+	v->mem = data->priv->mem;
 
-	for (*ds = i = 0; i < data->count; i++) {
+	/* At most the head and the payload of each section plus the scan */
+	v->iov = exif_mem_alloc (v->mem,
+				 sizeof (struct iovec) * (2 * data->count + 1));
+	v->heads = exif_mem_alloc (v->mem, 4 * data->count + 1);
+	v->exif = exif_mem_alloc (v->mem,
+				  sizeof (unsigned char *) * (data->count + 1));
+	if (!v->iov || !v->heads || !v->exif) {
+		EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data",
+				sizeof (struct iovec) * (2 * data->count + 1));
+		jpeg_data_iov_free (v);
+		return 0;
+	}
+
+	for (i = 0; i < data->count; i++) {
 		s = data->sections[i];
+		h = v->heads + 4 * i;
 
-		/* Write the marker */
-		CLEANUP_REALLOC (*d, sizeof (char) * (*ds + 2));
-		(*d)[*ds + 0] = 0xff;
-		(*d)[*ds + 1] = s.marker;
-		*ds += 2;
+		/* The marker */
+		h[0] = 0xff;
+		h[1] = s.marker;
 
 		switch (s.marker) {
 		case JPEG_MARKER_SOI:
 		case JPEG_MARKER_EOI:
+			jpeg_data_iov_add (v, h, 2);
 			break;
 		case JPEG_MARKER_APP1:
+			if (!s.parsed)
+				goto generic;
 			exif_data_save_data (s.content.app1, &ed, &eds);
-			if (!ed) break;
-			CLEANUP_REALLOC (*d, sizeof (char) * (*ds + 2));
-			(*d)[*ds + 0] = (eds + 2) >> 8;
-			(*d)[*ds + 1] = (eds + 2) >> 0;
-			*ds += 2;
-			CLEANUP_REALLOC (*d, sizeof (char) * (*ds + eds));
-			memcpy (*d + *ds, ed, eds);
-			*ds += eds;
-			free (ed);
+			if (!ed) {
+				jpeg_data_iov_add (v, h, 2);
+				break;
+			}
+			v->exif[v->exif_count++] = ed;
+			h[2] = (eds + 2) >> 8;
+			h[3] = (eds + 2) >> 0;
+			jpeg_data_iov_add (v, h, 4);
+			jpeg_data_iov_add (v, ed, eds);
+			ed = NULL;
 			break;
 		default:
-			CLEANUP_REALLOC (*d, sizeof (char) *
-					(*ds + s.content.generic.size + 2));
-			(*d)[*ds + 0] = (s.content.generic.size + 2) >> 8;
-			(*d)[*ds + 1] = (s.content.generic.size + 2) >> 0;
-			*ds += 2;
-			memcpy (*d + *ds, s.content.generic.data,
-				s.content.generic.size);
-			*ds += s.content.generic.size;
+		generic:
+			h[2] = (s.content.generic.size + 2) >> 8;
+			h[3] = (s.content.generic.size + 2) >> 0;
+			jpeg_data_iov_add (v, h, 4);
+			jpeg_data_iov_add (v, s.content.generic.data,
+					   s.content.generic.size);
 
 			/* In case of SOS, we need to write the data. */
-			if (s.marker == JPEG_MARKER_SOS) {
-				CLEANUP_REALLOC (*d, *ds + data->size);
-				memcpy (*d + *ds, data->data, data->size);
-				*ds += data->size;
-			}
+			if (s.marker == JPEG_MARKER_SOS)
+				jpeg_data_iov_add (v, data->data, data->size);
 			break;
 		}
 	}
+
+	return 1;
+}
+
+/* writev(2) the whole list, coping with IOV_MAX and short writes */
+static int
+jpeg_data_iov_write (JPEGDataIOV *v, int fd)
+{
+	struct iovec *iov = v->iov;
+	unsigned int n = v->count;
+	ssize_t w;
+
+	while (n) {
+		w = writev (fd, iov, MIN (n, IOV_MAX));
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		while (n && (size_t) w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base = (unsigned char *) iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return 1;
+}
+
+/*
+ * A new file in the directory of path, to be renamed over it once
+ * written. If O_TMPFILE works it has no name until it is complete (*linked
+ * is 0), otherwise it is created as tmp right away.
+ */
+static int
+jpeg_data_open_temp (const char *dir, const char *tmp, int *linked)
+{
+	int fd = -1;
+
+#ifdef O_TMPFILE
+	/* Readable, in case it has to be copied to tmp in the end */
+	fd = open (dir, O_TMPFILE | O_RDWR, 0666);
+#endif
+	*linked = (fd == -1);
+	if (fd == -1)
+		fd = open (tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	return fd;
+}
+
+/* Same permissions and owner as the file it replaces */
+static void
+jpeg_data_match_file (int fd, const char *path)
+{
+	struct stat st;
+
+	if (stat (path, &st) != -1) {
+		fchmod (fd, st.st_mode & 07777);
+		if (fchown (fd, st.st_uid, st.st_gid) == -1)
+			fchmod (fd, st.st_mode & 0777);
+	}
+}
+
+/* Gives the O_TMPFILE fd the name tmp */
+static int
+jpeg_data_link_temp (int fd, const char *tmp)
+{
+	char proc[32];
+
+	/* Needs CAP_DAC_READ_SEARCH, but no /proc */
+	if (!linkat (fd, "", AT_FDCWD, tmp, AT_EMPTY_PATH))
+		return 0;
+	snprintf (proc, sizeof (proc), "/proc/self/fd/%d", fd);
+	return linkat (AT_FDCWD, proc, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW);
+}
+
+#define JPEG_DATA_COPY_CHUNK 65536
+
+/*
+ * When the O_TMPFILE fd can't be linked (no /proc, as in some chroots
+ * and containers), what was written to it is copied to a new file named
+ * tmp instead. Returns the fd of that one, or -1.
+ */
+static int
+jpeg_data_copy_temp (int fd, const char *tmp, const char *path, int sync)
+{
+	unsigned char *b;
+	off_t o = 0;
+	ssize_t r = -1;
+	int out;
+
+	b = malloc (JPEG_DATA_COPY_CHUNK);
+	if (!b)
+		return -1;
+	out = open (tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (out != -1) {
+		jpeg_data_match_file (out, path);
+		while ((r = pread (fd, b, JPEG_DATA_COPY_CHUNK, o)) > 0) {
+			if (write (out, b, r) != r) {
+				r = -1;
+				break;
+			}
+			o += r;
+		}
+		if (!r && sync && fsync (out) == -1)
+			r = -1;
+		if (r) {
+			close (out);
+			unlink (tmp);
+			out = -1;
+		}
+	}
+	free (b);
+	return out;
+}
+
+int
+jpeg_data_temp_open (JPEGDataTemp *t, const char *path)
+{
+	const char *base;
+	size_t dir_len, size;
+
+	t->fd = -1;
+	t->linked = 0;
+	t->tmp = NULL;
+
+	/*
+	 * The file is written aside and renamed over path once complete,
+	 * so that the old one stays whole until then, whatever happens.
+	 */
+	base = strrchr (path, '/');
+	dir_len = base ? (size_t) (base - path) : 0;
+	base = base ? base + 1 : path;
+	size = dir_len + strlen (base) + sizeof (JPEG_DATA_TMP_SUFFIX) + 64;
+	t->dir = malloc (dir_len + 2);
+	t->tmp = malloc (size);
+	if (!t->dir || !t->tmp)
+		return 0;
+	if (base == path)
+		strcpy (t->dir, ".");
+	else if (!dir_len)
+		strcpy (t->dir, "/");
+	else {
+		memcpy (t->dir, path, dir_len);
+		t->dir[dir_len] = '\0';
+	}
+	snprintf (t->tmp, size, "%s/.%s.%ld.%lx%s", t->dir, base,
+		  (long) getpid (), (unsigned long) t, JPEG_DATA_TMP_SUFFIX);
+
+	t->fd = jpeg_data_open_temp (t->dir, t->tmp, &t->linked);
+	if (t->fd == -1)
+		return 0;
+	jpeg_data_match_file (t->fd, path);
+	return 1;
+}
+
+int
+jpeg_data_temp_commit (JPEGDataTemp *t, const char *path, int sync)
+{
+	int copy, dir_fd, ok = 1;
+
+	if (sync && fsync (t->fd) == -1)
+		return 0;
+	if (!t->linked) {
+		if (jpeg_data_link_temp (t->fd, t->tmp) == -1) {
+			copy = jpeg_data_copy_temp (t->fd, t->tmp, path, sync);
+			if (copy == -1)
+				return 0;
+			close (t->fd);
+			t->fd = copy;
+		}
+		t->linked = 1;
+	}
+	if (rename (t->tmp, path) == -1)
+		return 0;
+	t->linked = 0;
+
+	/* The rename itself is only durable once the directory is synced */
+	if (sync) {
+		dir_fd = open (t->dir, O_RDONLY | O_DIRECTORY);
+		if (dir_fd == -1 || fsync (dir_fd) == -1)
+			ok = 0;
+		if (dir_fd != -1)
+			close (dir_fd);
+	}
+	return ok;
+}
+
+int
+jpeg_data_temp_free (JPEGDataTemp *t)
+{
+	int ok = 1;
+
+	if (t->fd != -1 && close (t->fd) == -1)
+		ok = 0;
+	if (t->linked)
+		unlink (t->tmp);
+	free (t->dir);
+	free (t->tmp);
+	t->fd = -1;
+	t->linked = 0;
+	t->dir = t->tmp = NULL;
+	return ok;
+}
+
+/*! jpeg_data_save_file returns 1 on success, 0 on failure */
+int
+jpeg_data_save_file (JPEGData *data, const char *path)
+{
+	return jpeg_data_save_file_sync (data, path, 0);
+}
+
+int
+jpeg_data_save_file_sync (JPEGData *data, const char *path, int sync)
+{
+	JPEGDataIOV v;
+	JPEGDataTemp t;
+	int ok = 0;
+
+	if (!data || !path)
+		return 0;
+	if (!jpeg_data_iov_build (data, &v))
+		return 0;
+
+	if (!jpeg_data_temp_open (&t, path)) {
+		if (!t.dir || !t.tmp)
+			EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data",
+					    strlen (path) + 64);
+	} else if (jpeg_data_iov_write (&v, t.fd))
+		ok = jpeg_data_temp_commit (&t, path, sync);
+	if (!jpeg_data_temp_free (&t))
+		ok = 0;
+	jpeg_data_iov_free (&v);
+	return ok;
+}
+
+void
+jpeg_data_save_data (JPEGData *data, unsigned char **d, unsigned int *ds)
+{
+	JPEGDataIOV v;
+	unsigned int i;
+
+	if (!data)
+		return;
+	if (!d)
+		return;
+	if (!ds)
+		return;
+
+	*ds = 0;
+	if (!jpeg_data_iov_build (data, &v))
+		return;
+
+	/* The size is known up front, allocate once */
+	*d = malloc (v.size);
+	if (!*d) {
+		EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", v.size);
+		jpeg_data_iov_free (&v);
+		return;
+	}
+	for (i = 0; i < v.count; i++) {
+		memcpy (*d + *ds, v.iov[i].iov_base, v.iov[i].iov_len);
+		*ds += v.iov[i].iov_len;
+	}
+	jpeg_data_iov_free (&v);
 }
 
 JPEGData *
@@ -186,6 +529,18 @@ jpeg_data_new_from_data (const unsigned char *d,
 void
 jpeg_data_load_data (JPEGData *data, const unsigned char *d,
 		     unsigned int size)
+{
+	jpeg_data_load (data, d, size, 0);
+}
+
+/*
+ * If borrow is set, d outlives data (it is the file mapping) and the
+ * generic sections and the scan data point into it instead of being
+ * copied.
+ */
+static void
+jpeg_data_load (JPEGData *data, const unsigned char *d,
+		unsigned int size, int borrow)
 {
 	unsigned int i, o, len;
 	JPEGSection *s;
@@ -230,20 +585,23 @@ jpeg_data_load_data (JPEGData *data, const unsigned char *d,
 			o += 2;
 			if (len > size - o) { o = size; break; }
 
+			/* APP1 is parsed on demand by jpeg_data_get_exif_data */
 			switch (s->marker) {
-			case JPEG_MARKER_APP1:
-				s->content.app1 = exif_data_new_from_data (
-							d + o - 4, len + 4);
-				break;
 			default:
-				s->content.generic.data =
-						malloc (sizeof (char) * len);
-				if (!s->content.generic.data) {
-					EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", sizeof (char) * len);
-					return;
+				if (borrow)
+					s->content.generic.data =
+						(unsigned char *) &d[o];
+				else {
+					s->content.generic.data =
+						exif_mem_alloc (data->priv->mem,
+								sizeof (char) * len);
+					if (!s->content.generic.data) {
+						EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", sizeof (char) * len);
+						return;
+					}
+					memcpy (s->content.generic.data, &d[o], len);
 				}
 				s->content.generic.size = len;
-				memcpy (s->content.generic.data, &d[o], len);
 
 				/* In case of SOS, image data will follow. */
 				if (s->marker == JPEG_MARKER_SOS) {
@@ -260,7 +618,14 @@ jpeg_data_load_data (JPEGData *data, const unsigned char *d,
 							data->size += 2;
 						}
 					}
-					data->data = malloc (
+					if (borrow) {
+						data->data = (unsigned char *)
+							d + o + len;
+						o += data->size;
+						break;
+					}
+					data->data = exif_mem_alloc (
+						data->priv->mem,
 						sizeof (char) * data->size);
 					if (!data->data) {
 						EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", sizeof (char) * data->size);
@@ -289,44 +654,83 @@ jpeg_data_new_from_file (const char *path)
 	return (data);
 }
 
+/* Fallback for files that can't be mapped: read them into a buffer the
+ * sections point into, just like the mapping */
+static void
+jpeg_data_read_file (JPEGData *data, int fd, unsigned int size,
+		     const char *path)
+{
+	unsigned char *d;
+	unsigned int o;
+	ssize_t r;
+
+	if (!size || data->priv->map)
+		return;
+	d = exif_mem_alloc (data->priv->mem, size);
+	if (!d) {
+		EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", size);
+		return;
+	}
+	for (o = 0; o < size; o += r) {
+		r = read (fd, d + o, size - o);
+		if (r <= 0) {
+			exif_mem_free (data->priv->mem, d);
+			exif_log (data->priv->log, EXIF_LOG_CODE_CORRUPT_DATA, "jpeg-data",
+					_("Could not read '%s'."), path);
+			return;
+		}
+	}
+
+	data->priv->map = d;
+	data->priv->map_size = size;
+	jpeg_data_load (data, d, size, 1);
+}
+
 void
 jpeg_data_load_file (JPEGData *data, const char *path)
 {
-	FILE *f;
+	struct stat st;
 	unsigned char *d;
-	unsigned int size;
+	int fd;
 
 	if (!data) return;
 	if (!path) return;
 
-	f = fopen (path, "rb");
-	if (!f) {
+	fd = open (path, O_RDONLY);
+	if (fd == -1 || fstat (fd, &st) == -1) {
 		exif_log (data->priv->log, EXIF_LOG_CODE_CORRUPT_DATA, "jpeg-data",
 				_("Path '%s' invalid."), path);
+		if (fd != -1) close (fd);
 		return;
 	}
-
-	/* For now, we read the data into memory. Patches welcome... */
-	fseek (f, 0, SEEK_END);
-	size = ftell (f);
-	fseek (f, 0, SEEK_SET);
-	d = malloc (size);
-	if (!d) {
-		EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", size);
-		fclose (f);
+	if (st.st_size > (off_t) (unsigned int) -1) {
+		exif_log (data->priv->log, EXIF_LOG_CODE_CORRUPT_DATA, "jpeg-data",
+				_("'%s' is too big."), path);
+		close (fd);
 		return;
 	}
-	if (fread (d, 1, size, f) != size) {
-		free (d);
-		fclose (f);
-		exif_log (data->priv->log, EXIF_LOG_CODE_CORRUPT_DATA, "jpeg-data",
-				_("Could not read '%s'."), path);
+
+	/*
+	 * Map the file and let the sections and the scan data point into
+	 * the mapping instead of copying them. The mapping stays valid after
+	 * jpeg_data_save_file replaces the file, as that renames a new inode
+	 * over the old one instead of truncating it.
+	 */
+	d = MAP_FAILED;
+	if (S_ISREG (st.st_mode) && st.st_size > 0 && !data->priv->map)
+		d = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (d == MAP_FAILED) {
+		jpeg_data_read_file (data, fd, st.st_size, path);
+		close (fd);
 		return;
 	}
-	fclose (f);
+	close (fd);
+	madvise (d, st.st_size, MADV_SEQUENTIAL);
 
-	jpeg_data_load_data (data, d, size);
-	free (d);
+	data->priv->map = d;
+	data->priv->map_size = st.st_size;
+	data->priv->mapped = 1;
+	jpeg_data_load (data, d, st.st_size, 1);
 }
 
 void
@@ -356,9 +760,11 @@ jpeg_data_free (JPEGData *data)
 {
 	unsigned int i;
 	JPEGSection s;
+	ExifMem *mem;
 
 	if (!data)
 		return;
+	mem = data->priv ? data->priv->mem : NULL;
 
 	if (data->count) {
 		for (i = 0; i < data->count; i++) {
@@ -368,28 +774,37 @@ jpeg_data_free (JPEGData *data)
 			case JPEG_MARKER_EOI:
 				break;
 			case JPEG_MARKER_APP1:
-				exif_data_unref (s.content.app1);
-				break;
+				if (s.parsed) {
+					exif_data_unref (s.content.app1);
+					break;
+				}
+				/* Fall through */
 			default:
-				free (s.content.generic.data);
+				if (jpeg_data_owns (data, s.content.generic.data))
+					exif_mem_free (mem, s.content.generic.data);
 				break;
 			}
 		}
-		free (data->sections);
 	}
+	exif_mem_free (mem, data->sections);
 
-	if (data->data)
-		free (data->data);
+	if (data->data && jpeg_data_owns (data, data->data))
+		exif_mem_free (mem, data->data);
 
 	if (data->priv) {
+		if (data->priv->mapped)
+			munmap (data->priv->map, data->priv->map_size);
+		else
+			exif_mem_free (mem, data->priv->map);
 		if (data->priv->log) {
 			exif_log_unref (data->priv->log);
 			data->priv->log = NULL;
 		}
-		free (data->priv);
+		exif_mem_free (mem, data->priv);
 	}
 
-	free (data);
+	exif_mem_free (mem, data);
+	exif_mem_unref (mem);
 }
 
 void
@@ -415,8 +830,11 @@ jpeg_data_dump (JPEGData *data)
                 case JPEG_MARKER_EOI:
 			break;
                 case JPEG_MARKER_APP1:
-			exif_data_dump (content.app1);
-			break;
+			if (data->sections[i].parsed) {
+				exif_data_dump (content.app1);
+				break;
+			}
+			/* Fall through */
                 default:
 			printf ("  Size: %i\n", content.generic.size);
                         printf ("  Unknown content.\n");
@@ -425,35 +843,68 @@ jpeg_data_dump (JPEGData *data)
         }
 }
 
+/* The first APP1 section holding EXIF data, parsed or not */
 static JPEGSection *
-jpeg_data_get_section (JPEGData *data, JPEGMarker marker)
+jpeg_data_get_exif_section (JPEGData *data)
 {
+	static const unsigned char ExifHeader[] = {0x45, 0x78, 0x69, 0x66, 0x00, 0x00};
+	JPEGSection *s;
 	unsigned int i;
 
 	if (!data)
 		return (NULL);
 
-	for (i = 0; i < data->count; i++)
-		if (data->sections[i].marker == marker)
-			return (&data->sections[i]);
+	for (i = 0; i < data->count; i++) {
+		s = &data->sections[i];
+		if (s->marker != JPEG_MARKER_APP1)
+			continue;
+		if (s->parsed)
+			return (s);
+		if (s->content.generic.size >= sizeof (ExifHeader) &&
+		    !memcmp (s->content.generic.data, ExifHeader,
+			     sizeof (ExifHeader)))
+			return (s);
+	}
 	return (NULL);
 }
 
+/* Drop the raw bytes of an APP1 section that is not parsed yet */
+static void
+jpeg_data_section_free_raw (JPEGData *data, JPEGSection *section)
+{
+	if (!section->parsed &&
+	    jpeg_data_owns (data, section->content.generic.data))
+		exif_mem_free (data->priv->mem, section->content.generic.data);
+	memset (&section->content, 0, sizeof (JPEGContent));
+}
+
 ExifData *
 jpeg_data_get_exif_data (JPEGData *data)
 {
 	JPEGSection *section;
+	ExifData *exif_data;
 
 	if (!data)
 		return NULL;
 
-	section = jpeg_data_get_section (data, JPEG_MARKER_APP1);
-	if (section) {
-		exif_data_ref (section->content.app1);
-		return (section->content.app1);
+	section = jpeg_data_get_exif_section (data);
+	if (!section)
+		return (NULL);
+
+	/* Only now build the libexif tree, with our allocator */
+	if (!section->parsed) {
+		exif_data = exif_data_new_mem (data->priv->mem);
+		if (!exif_data)
+			return (NULL);
+		exif_data_load_data (exif_data, section->content.generic.data,
+				     section->content.generic.size);
+		jpeg_data_section_free_raw (data, section);
+		section->content.app1 = exif_data;
+		section->parsed = 1;
 	}
 
-	return (NULL);
+	exif_data_ref (section->content.app1);
+	return (section->content.app1);
 }
 
 void
@@ -463,21 +914,50 @@ jpeg_data_set_exif_data (JPEGData *data, ExifData *exif_data)
 
 	if (!data) return;
 
-	section = jpeg_data_get_section (data, JPEG_MARKER_APP1);
+	section = jpeg_data_get_exif_section (data);
 	if (!section) {
 		jpeg_data_append_section (data);
 		if (data->count < 2) return;
 		memmove (&data->sections[2], &data->sections[1],
 			 sizeof (JPEGSection) * (data->count - 2));
 		section = &data->sections[1];
-	} else {
+		memset (section, 0, sizeof (JPEGSection));
+	} else if (section->parsed) {
 		exif_data_unref (section->content.app1);
+	} else {
+		jpeg_data_section_free_raw (data, section);
 	}
 	section->marker = JPEG_MARKER_APP1;
 	section->content.app1 = exif_data;
+	section->parsed = 1;
 	exif_data_ref (exif_data);
 }
 
+int
+jpeg_data_save_exif_data (JPEGData *data)
+{
+	JPEGSection *section;
+	unsigned char *ed = NULL;
+	unsigned int eds = 0;
+
+	if (!data)
+		return 0;
+
+	section = jpeg_data_get_exif_section (data);
+	if (!section || !section->parsed)
+		return 1;
+	exif_data_save_data (section->content.app1, &ed, &eds);
+	if (!ed) {
+		EXIF_LOG_NO_MEMORY (data->priv->log, "jpeg-data", eds);
+		return 0;
+	}
+	exif_data_unref (section->content.app1);
+	section->content.generic.data = ed;
+	section->content.generic.size = eds;
+	section->parsed = 0;
+	return 1;
+}
+
 void
 jpeg_data_log (JPEGData *data, ExifLog *log)
 {
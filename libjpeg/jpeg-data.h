@@ -25,6 +25,7 @@
 
 #include <libexif/exif-data.h>
 #include <libexif/exif-log.h>
+#include <libexif/exif-mem.h>
 
 typedef ExifData * JPEGContentAPP1;
 
@@ -47,6 +48,10 @@ struct _JPEGSection
 {
 	JPEGMarker marker;
 	JPEGContent content;
+
+	/* APP1 sections are kept as raw bytes (content.generic) until
+	 * their EXIF data is asked for, then content.app1 is used. */
+	int parsed;
 };
 
 typedef struct _JPEGData        JPEGData;
@@ -64,6 +69,9 @@ struct _JPEGData
 };
 
 JPEGData *jpeg_data_new           (void);
+/* Everything, including the EXIF data parsed out of APP1, is allocated
+ * through mem */
+JPEGData *jpeg_data_new_mem       (ExifMem *mem);
 JPEGData *jpeg_data_new_from_file (const char *path);
 JPEGData *jpeg_data_new_from_data (const unsigned char *data,
 				   unsigned int size);
@@ -78,10 +86,43 @@ void      jpeg_data_save_data     (JPEGData *data, unsigned char **d,
 				   unsigned int *size);
 
 void      jpeg_data_load_file     (JPEGData *data, const char *path);
+/* Files are written aside, then renamed over path. With sync, the file and
+ * its directory are fsync'ed before returning. */
 int       jpeg_data_save_file     (JPEGData *data, const char *path);
+int       jpeg_data_save_file_sync (JPEGData *data, const char *path,
+				    int sync);
+
+/* Name ending of the temporary files written by jpeg_data_save_file */
+#define JPEG_DATA_TMP_SUFFIX ".jpeg-data.tmp"
+
+/* The temporary file jpeg_data_save_file writes to, for new versions of
+ * a file written some other way. jpeg_data_temp_open creates it next to
+ * path, with the permissions and owner of path. jpeg_data_temp_commit
+ * renames it over path, fsync'ing it and its directory first with sync.
+ * jpeg_data_temp_free closes it, and removes it unless it was committed.
+ * The ones returning int return 1 on success, 0 on failure. */
+typedef struct _JPEGDataTemp JPEGDataTemp;
+struct _JPEGDataTemp
+{
+	/* to write the new file to, it can change on commit */
+	int fd;
+	int linked;
+	char *dir;
+	char *tmp;
+};
+
+int       jpeg_data_temp_open     (JPEGDataTemp *t, const char *path);
+int       jpeg_data_temp_commit   (JPEGDataTemp *t, const char *path,
+				   int sync);
+int       jpeg_data_temp_free     (JPEGDataTemp *t);
 
 void      jpeg_data_set_exif_data (JPEGData *data, ExifData *exif_data);
 ExifData *jpeg_data_get_exif_data (JPEGData *data);
+/* Saves the parsed EXIF data into the raw bytes of its section, so that
+ * saving the file only writes them. Changes made to the ExifData after
+ * that aren't saved, jpeg_data_get_exif_data loads it again. Returns 1 on
+ * success, 0 on failure. */
+int       jpeg_data_save_exif_data (JPEGData *data);
 
 void      jpeg_data_dump (JPEGData *data);
 
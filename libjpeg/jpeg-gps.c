@@ -0,0 +1,583 @@
+/* jpeg-gps.c
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA.
+ */
+
+#include "jpeg-gps.h"
+#include "jpeg-marker.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libexif/exif-utils.h>
+
+static const unsigned char ExifHeader[] = {0x45, 0x78, 0x69, 0x66, 0x00, 0x00};
+
+#define JPEG_GPS_IFD_POINTER 0x8825
+
+/* Finds the EXIF APP1 payload, stopping at the first SOS */
+static int
+jpeg_gps_find_app1 (int fd, off_t *offset, unsigned int *size)
+{
+	unsigned char h[4 + sizeof (ExifHeader)];
+	unsigned int len;
+	ssize_t r;
+	off_t o;
+
+	if (pread (fd, h, 2, 0) != 2)
+		return 0;
+	if (h[0] != 0xff || h[1] != JPEG_MARKER_SOI)
+		return 0;
+
+	for (o = 2;;) {
+		r = pread (fd, h, sizeof (h), o);
+		if (r < 4)
+			return 0;
+		if (h[0] != 0xff)
+			return 0;
+		/* fill bytes */
+		if (h[1] == 0xff) {
+			o++;
+			continue;
+		}
+		if (h[1] == JPEG_MARKER_SOS || h[1] == JPEG_MARKER_EOI)
+			return 0;
+
+		len = (h[2] << 8) | h[3];
+		if (len < 2)
+			return 0;
+		len -= 2;
+
+		/* there could be other APP1s before, e.g. XMP */
+		if (h[1] == JPEG_MARKER_APP1 && len >= sizeof (ExifHeader) &&
+		    r == sizeof (h) &&
+		    !memcmp (h + 4, ExifHeader, sizeof (ExifHeader))) {
+			*offset = o + 4;
+			*size = len;
+			return 1;
+		}
+		o += 4 + len;
+	}
+}
+
+int
+jpeg_gps_find_app1_data (const unsigned char *d, unsigned int size,
+			 unsigned int *offset, unsigned int *len)
+{
+	unsigned int o, l;
+
+	if (size < 2 || d[0] != 0xff || d[1] != JPEG_MARKER_SOI)
+		return 0;
+
+	for (o = 2;;) {
+		if (4 > size - o)
+			return -1;
+		if (d[o] != 0xff)
+			return 0;
+		/* fill bytes */
+		if (d[o + 1] == 0xff) {
+			o++;
+			continue;
+		}
+		if (d[o + 1] == JPEG_MARKER_SOS || d[o + 1] == JPEG_MARKER_EOI)
+			return 0;
+
+		l = (d[o + 2] << 8) | d[o + 3];
+		if (l < 2)
+			return 0;
+		l -= 2;
+
+		if (d[o + 1] == JPEG_MARKER_APP1 && l >= sizeof (ExifHeader)) {
+			if (4 + sizeof (ExifHeader) > size - o)
+				return -1;
+			/* there could be other APP1s before, e.g. XMP */
+			if (!memcmp (d + o + 4, ExifHeader, sizeof (ExifHeader))) {
+				if (l > size - o - 4)
+					return -1;
+				*offset = o + 4;
+				*len = l;
+				return 1;
+			}
+		}
+		if (4 + l > size - o)
+			return -1;
+		o += 4 + l;
+	}
+}
+
+int
+jpeg_gps_read_app1 (int fd, unsigned char **d, unsigned int *size,
+		    off_t *offset)
+{
+	unsigned int len;
+	off_t o;
+
+	if (!d || !size || !offset)
+		return 0;
+	*d = NULL;
+	*size = 0;
+
+	if (!jpeg_gps_find_app1 (fd, &o, &len))
+		return 0;
+	*d = malloc (len);
+	if (!*d)
+		return 0;
+	if (pread (fd, *d, len, o) != (ssize_t) len) {
+		free (*d);
+		*d = NULL;
+		return 0;
+	}
+	*size = len;
+	*offset = o;
+	return 1;
+}
+
+/* Pipes are read and written in order, a segment or a chunk at a time */
+#define JPEG_GPS_STREAM_CHUNK 65536
+
+static int
+jpeg_gps_read_full (int fd, unsigned char *d, unsigned int n)
+{
+	ssize_t r;
+
+	while (n) {
+		r = read (fd, d, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return 0;
+		d += r;
+		n -= r;
+	}
+	return 1;
+}
+
+static int
+jpeg_gps_write_full (int fd, const unsigned char *d, unsigned int n)
+{
+	ssize_t r;
+
+	while (n) {
+		r = write (fd, d, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return 0;
+		d += r;
+		n -= r;
+	}
+	return 1;
+}
+
+/* Copies n bytes, or everything up to the end if n is 0 */
+static int
+jpeg_gps_copy (int in, int out, unsigned int n)
+{
+	unsigned char *b;
+	unsigned int l;
+	ssize_t r;
+	int ok = 1;
+
+	b = malloc (JPEG_GPS_STREAM_CHUNK);
+	if (!b)
+		return 0;
+	for (;;) {
+		l = JPEG_GPS_STREAM_CHUNK;
+		if (n && n < l)
+			l = n;
+		r = read (in, b, l);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			/* only the rest of the file may end early */
+			ok = (r == 0 && !n);
+			break;
+		}
+		if (!jpeg_gps_write_full (out, b, r)) {
+			ok = 0;
+			break;
+		}
+		if (n && !(n -= r))
+			break;
+	}
+	free (b);
+	return ok;
+}
+
+int
+jpeg_gps_stream_app1 (int in, int out, unsigned char **d, unsigned int *size)
+{
+	unsigned char h[4], *p;
+	unsigned int len;
+
+	if (!d || !size)
+		return -1;
+	*d = NULL;
+	*size = 0;
+
+	if (!jpeg_gps_read_full (in, h, 2) ||
+	    h[0] != 0xff || h[1] != JPEG_MARKER_SOI ||
+	    !jpeg_gps_write_full (out, h, 2))
+		return -1;
+
+	for (;;) {
+		if (!jpeg_gps_read_full (in, h, 2) || h[0] != 0xff)
+			return -1;
+		/* fill bytes, passed through as they are */
+		while (h[1] == 0xff) {
+			if (!jpeg_gps_write_full (out, h, 1) ||
+			    !jpeg_gps_read_full (in, h + 1, 1))
+				return -1;
+		}
+		if (h[1] == JPEG_MARKER_SOS || h[1] == JPEG_MARKER_EOI)
+			return jpeg_gps_write_full (out, h, 2) ? 0 : -1;
+
+		if (!jpeg_gps_read_full (in, h + 2, 2))
+			return -1;
+		len = (h[2] << 8) | h[3];
+		if (len < 2)
+			return -1;
+		len -= 2;
+
+		/* there could be other APP1s before, e.g. XMP */
+		if (h[1] == JPEG_MARKER_APP1 && len >= sizeof (ExifHeader)) {
+			p = malloc (len);
+			if (!p)
+				return -1;
+			if (!jpeg_gps_read_full (in, p, len)) {
+				free (p);
+				return -1;
+			}
+			if (!memcmp (p, ExifHeader, sizeof (ExifHeader))) {
+				*d = p;
+				*size = len;
+				return 1;
+			}
+			if (!jpeg_gps_write_full (out, h, 4) ||
+			    !jpeg_gps_write_full (out, p, len)) {
+				free (p);
+				return -1;
+			}
+			free (p);
+			continue;
+		}
+
+		if (!jpeg_gps_write_full (out, h, 4) ||
+		    (len && !jpeg_gps_copy (in, out, len)))
+			return -1;
+	}
+}
+
+int
+jpeg_gps_stream_rest (int in, int out, const unsigned char *d,
+		      unsigned int size)
+{
+	unsigned char h[4];
+
+	if (d) {
+		if (size > 0xffff - 2)
+			return 0;
+		h[0] = 0xff;
+		h[1] = JPEG_MARKER_APP1;
+		h[2] = (size + 2) >> 8;
+		h[3] = (size + 2) >> 0;
+		if (!jpeg_gps_write_full (out, h, 4) ||
+		    !jpeg_gps_write_full (out, d, size))
+			return 0;
+	}
+	return jpeg_gps_copy (in, out, 0);
+}
+
+/* A small window over the APP1 payload, used by jpeg_gps_probe */
+#define JPEG_GPS_WINDOW 4096
+
+typedef struct _JPEGGpsWindow JPEGGpsWindow;
+struct _JPEGGpsWindow
+{
+	int fd;
+	off_t base;
+	unsigned int size;
+
+	unsigned int o, n;
+	unsigned char d[JPEG_GPS_WINDOW];
+};
+
+static const unsigned char *
+jpeg_gps_window_get (JPEGGpsWindow *w, unsigned int o, unsigned int n)
+{
+	ssize_t r;
+
+	if (o > w->size || n > w->size - o)
+		return (NULL);
+	if (o < w->o || o + n > w->o + w->n) {
+		r = pread (w->fd, w->d, MIN (JPEG_GPS_WINDOW, w->size - o),
+			   w->base + o);
+		if (r < (ssize_t) n)
+			return (NULL);
+		w->o = o;
+		w->n = r;
+	}
+	return (w->d + (o - w->o));
+}
+
+int
+jpeg_gps_probe (int fd)
+{
+	JPEGGpsWindow w;
+	ExifByteOrder order;
+	const unsigned char *d;
+	unsigned int i, n, o, t, found = 0;
+	ExifLong ifd, gps = 0;
+
+	memset (&w, 0, offsetof (JPEGGpsWindow, d));
+	w.fd = fd;
+	if (!jpeg_gps_find_app1 (fd, &w.base, &w.size))
+		return 0;
+
+	/* TIFF header */
+	t = sizeof (ExifHeader);
+	if (!(d = jpeg_gps_window_get (&w, t, 8)))
+		return -1;
+	if (!memcmp (d, "II", 2))
+		order = EXIF_BYTE_ORDER_INTEL;
+	else if (!memcmp (d, "MM", 2))
+		order = EXIF_BYTE_ORDER_MOTOROLA;
+	else
+		return -1;
+	if (exif_get_short (d + 2, order) != 0x002a)
+		return -1;
+	ifd = exif_get_long (d + 4, order);
+
+	/* IFD0, only to find the GPS IFD pointer */
+	if (ifd > w.size - t || !(d = jpeg_gps_window_get (&w, t + ifd, 2)))
+		return -1;
+	o = t + ifd + 2;
+	n = exif_get_short (d, order);
+	for (i = 0; i < n; i++, o += 12) {
+		if (!(d = jpeg_gps_window_get (&w, o, 12)))
+			return -1;
+		if (exif_get_short (d, order) == JPEG_GPS_IFD_POINTER) {
+			gps = exif_get_long (d + 8, order);
+			break;
+		}
+	}
+	if (!gps)
+		return 0;
+
+	/* GPS IFD, GPSVersionID alone says nothing about the location */
+	if (gps > w.size - t || !(d = jpeg_gps_window_get (&w, t + gps, 2)))
+		return -1;
+	o = t + gps + 2;
+	n = exif_get_short (d, order);
+	for (i = 0; i < n; i++, o += 12) {
+		if (!(d = jpeg_gps_window_get (&w, o, 12)))
+			return -1;
+		if (exif_get_short (d, order) != EXIF_TAG_GPS_VERSION_ID)
+			found++;
+	}
+
+	return found;
+}
+
+/* returns the offset of an IFD with its entry count checked, 0 if not */
+static unsigned int
+jpeg_gps_check_ifd (const unsigned char *d, unsigned int size,
+		    unsigned int tiff, ExifLong ifd, ExifByteOrder order)
+{
+	unsigned int o, n;
+
+	if (ifd > size - tiff || 2 > size - tiff - ifd)
+		return 0;
+	o = tiff + ifd;
+	n = exif_get_short (d + o, order);
+	if (12 * n > size - o - 2)
+		return 0;
+	return o;
+}
+
+int
+jpeg_gps_parse (JPEGGpsInfo *info, const unsigned char *d, unsigned int size)
+{
+	unsigned int i, n, o, t, fs;
+	const unsigned char *e;
+	JPEGGpsEntry *entry;
+	ExifLong gps = 0;
+
+	if (!info || !d)
+		return 0;
+	memset (info, 0, sizeof (JPEGGpsInfo));
+
+	t = sizeof (ExifHeader);
+	if (size < t + 8 || memcmp (d, ExifHeader, t))
+		return 0;
+	if (!memcmp (d + t, "II", 2))
+		info->order = EXIF_BYTE_ORDER_INTEL;
+	else if (!memcmp (d + t, "MM", 2))
+		info->order = EXIF_BYTE_ORDER_MOTOROLA;
+	else
+		return 0;
+	if (exif_get_short (d + t + 2, info->order) != 0x002a)
+		return 0;
+	info->tiff = t;
+
+	/* IFD0, only to find the GPS IFD pointer */
+	o = jpeg_gps_check_ifd (d, size, t,
+			exif_get_long (d + t + 4, info->order), info->order);
+	if (!o)
+		return 0;
+	n = exif_get_short (d + o, info->order);
+	for (i = 0; i < n; i++) {
+		e = d + o + 2 + 12 * i;
+		if (exif_get_short (e, info->order) == JPEG_GPS_IFD_POINTER) {
+			gps = exif_get_long (e + 8, info->order);
+			break;
+		}
+	}
+	if (!gps)
+		return 1;
+
+	o = jpeg_gps_check_ifd (d, size, t, gps, info->order);
+	if (!o)
+		return 0;
+	n = exif_get_short (d + o, info->order);
+	if (n > JPEG_GPS_MAX_ENTRIES)
+		return 0;
+	info->ifd = o;
+
+	for (i = 0; i < n; i++) {
+		e = d + o + 2 + 12 * i;
+		entry = &info->entries[info->count];
+		entry->tag = exif_get_short (e, info->order);
+		entry->format = exif_get_short (e + 2, info->order);
+		entry->components = exif_get_long (e + 4, info->order);
+
+		fs = exif_format_get_size (entry->format);
+		if (!fs || entry->components > size / fs)
+			return 0;
+		entry->size = fs * entry->components;
+
+		/* values of up to 4 bytes are stored in the entry itself */
+		if (entry->size <= 4)
+			entry->offset = e + 8 - d;
+		else {
+			entry->offset = exif_get_long (e + 8, info->order);
+			if (entry->offset > size - t)
+				return 0;
+			entry->offset += t;
+		}
+		if (entry->size > size - entry->offset)
+			return 0;
+		info->count++;
+	}
+
+	return 1;
+}
+
+JPEGGpsEntry *
+jpeg_gps_get_entry (JPEGGpsInfo *info, ExifTag tag)
+{
+	unsigned int i;
+
+	if (!info)
+		return (NULL);
+
+	for (i = 0; i < info->count; i++)
+		if (info->entries[i].tag == tag)
+			return (&info->entries[i]);
+	return (NULL);
+}
+
+/* whether [o, o + n) overlaps [p, p + m) */
+#define JPEG_GPS_OVERLAP(o,n,p,m) ((o) < (p) + (m) && (p) < (o) + (n))
+
+int
+jpeg_gps_remove (JPEGGpsInfo *info, unsigned char *d, unsigned int size,
+		 uint32_t tags, unsigned int *start, unsigned int *end)
+{
+	unsigned char keep[JPEG_GPS_MAX_ENTRIES], next[4], *ifd;
+	unsigned int i, k, m, ifd_size, lo, hi;
+	JPEGGpsEntry *e;
+
+	if (!info || !d || !info->ifd)
+		return 0;
+
+	/* entry count, entries and the next IFD pointer */
+	ifd_size = 2 + 12 * info->count + 4;
+	if (ifd_size > size - info->ifd)
+		return -1;
+
+	for (i = k = 0; i < info->count; i++) {
+		keep[i] = info->entries[i].tag >= JPEG_GPS_MAX_ENTRIES ||
+			!(tags & JPEG_GPS_TAG_BIT (info->entries[i].tag));
+		k += keep[i];
+	}
+	if (k == info->count)
+		return 0;
+
+	lo = info->ifd;
+	hi = info->ifd + ifd_size;
+
+	/* zero the values stored out of the IFD, unless something that
+	 * stays points at them too */
+	for (i = 0; i < info->count; i++) {
+		e = &info->entries[i];
+		if (keep[i] || e->size <= 4 ||
+		    JPEG_GPS_OVERLAP (e->offset, e->size, info->ifd, ifd_size))
+			continue;
+		for (m = 0; m < info->count; m++)
+			if (keep[m] && info->entries[m].size > 4 &&
+			    JPEG_GPS_OVERLAP (e->offset, e->size,
+					      info->entries[m].offset,
+					      info->entries[m].size))
+				break;
+		if (m < info->count)
+			continue;
+		memset (d + e->offset, 0, e->size);
+		if (e->offset < lo)
+			lo = e->offset;
+		if (e->offset + e->size > hi)
+			hi = e->offset + e->size;
+	}
+
+	/* pack the entries that stay, the IFD keeps its size */
+	ifd = d + info->ifd;
+	memcpy (next, ifd + 2 + 12 * info->count, 4);
+	for (i = k = 0; i < info->count; i++) {
+		if (!keep[i])
+			continue;
+		if (k != i) {
+			memmove (ifd + 2 + 12 * k, ifd + 2 + 12 * i, 12);
+			info->entries[k] = info->entries[i];
+			if (info->entries[k].size <= 4)
+				info->entries[k].offset = info->ifd + 2 + 12 * k + 8;
+		}
+		k++;
+	}
+	exif_set_short (ifd, info->order, k);
+	memcpy (ifd + 2 + 12 * k, next, 4);
+	memset (ifd + 2 + 12 * k + 4, 0, 12 * (info->count - k));
+
+	m = info->count - k;
+	info->count = k;
+	if (start)
+		*start = lo;
+	if (end)
+		*end = hi;
+	return m;
+}
@@ -0,0 +1,127 @@
+/* jpeg-gps.h
+ *
+ * Locates the GPS IFD entries of the EXIF APP1 segment directly on its
+ * bytes, so that fixed-size values can be rewritten, or entries removed,
+ * in place without building the whole libexif tree.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301  USA.
+ */
+
+#ifndef __JPEG_GPS_H__
+#define __JPEG_GPS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <libexif/exif-byte-order.h>
+#include <libexif/exif-format.h>
+#include <libexif/exif-tag.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* GPS tags go from 0x0000 to 0x001f */
+#define JPEG_GPS_MAX_ENTRIES 32
+
+/* set of GPS tags, as taken by jpeg_gps_remove */
+#define JPEG_GPS_TAG_BIT(t) ((uint32_t) 1 << (t))
+
+typedef struct _JPEGGpsEntry JPEGGpsEntry;
+struct _JPEGGpsEntry
+{
+	ExifTag tag;
+	ExifFormat format;
+	unsigned int components;
+
+	/* offset of the value from the start of the APP1 payload */
+	unsigned int offset;
+	unsigned int size;
+};
+
+typedef struct _JPEGGpsInfo JPEGGpsInfo;
+struct _JPEGGpsInfo
+{
+	ExifByteOrder order;
+
+	/* offsets of the TIFF header and of the GPS IFD (0 if there is
+	 * none) from the start of the APP1 payload */
+	unsigned int tiff;
+	unsigned int ifd;
+
+	JPEGGpsEntry entries[JPEG_GPS_MAX_ENTRIES];
+	unsigned int count;
+};
+
+/*! jpeg_gps_read_app1 reads the EXIF APP1 payload (starting at the
+ *  "Exif\0\0" header) of the JPEG file behind fd with a few bounded
+ *  pread(2) calls, stopping at the first SOS. Returns 1 on success and 0
+ *  if there is none; *offset is the file offset of the payload. */
+int  jpeg_gps_read_app1 (int fd, unsigned char **d, unsigned int *size,
+			 off_t *offset);
+
+/*! jpeg_gps_find_app1_data looks for the EXIF APP1 payload in the first
+ *  size bytes of a JPEG file. Returns 1 if it is all in there, with its
+ *  offset and length, 0 if there is none and -1 if more of the file is
+ *  needed to tell. */
+int  jpeg_gps_find_app1_data (const unsigned char *d, unsigned int size,
+			      unsigned int *offset, unsigned int *len);
+
+/*! jpeg_gps_stream_app1 copies a JPEG stream from in to out (e.g. pipes)
+ *  up to its EXIF APP1 segment, whose payload is read into *d (to be
+ *  freed) instead of being copied. Returns 1 if it was found, 0 if the
+ *  scan data or the end of the image came first, and -1 on errors or if
+ *  in is not a JPEG stream. Never holds more than a segment in memory. */
+int  jpeg_gps_stream_app1 (int in, int out, unsigned char **d,
+			   unsigned int *size);
+
+/*! jpeg_gps_stream_rest writes the APP1 payload d, unless it is NULL, and
+ *  copies the rest of in to out in fixed size chunks. Returns 1 on
+ *  success and 0 on failure. */
+int  jpeg_gps_stream_rest (int in, int out, const unsigned char *d,
+			   unsigned int size);
+
+/*! jpeg_gps_probe tells whether the JPEG file behind fd has GPS data,
+ *  reading only IFD0 and the GPS IFD entries through a window of a few
+ *  KB. Returns the number of GPS entries besides GPSVersionID, 0 if there
+ *  are none or no EXIF data at all, and -1 if the EXIF data is corrupt or
+ *  not understood. */
+int  jpeg_gps_probe     (int fd);
+
+/*! jpeg_gps_parse walks IFD0 and the GPS IFD of an APP1 payload.
+ *  Returns 1 if the structure is sane (info->count is 0 when there is no
+ *  GPS IFD) and 0 if it is corrupt or not understood. */
+int  jpeg_gps_parse     (JPEGGpsInfo *info, const unsigned char *d,
+			 unsigned int size);
+
+JPEGGpsEntry *jpeg_gps_get_entry (JPEGGpsInfo *info, ExifTag tag);
+
+/*! jpeg_gps_remove removes the GPS entries whose tag is in the set tags
+ *  (JPEG_GPS_TAG_BIT) from an APP1 payload parsed by jpeg_gps_parse,
+ *  without moving anything else:
+ *  the GPS IFD is packed in place and keeps its size, and the values of
+ *  the removed entries are zeroed. [*start, *end) is set to the range of
+ *  bytes that changed. Returns the number of entries removed, and -1 if
+ *  the GPS IFD can't be rewritten in place. */
+int  jpeg_gps_remove    (JPEGGpsInfo *info, unsigned char *d,
+			 unsigned int size, uint32_t tags,
+			 unsigned int *start, unsigned int *end);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __JPEG_GPS_H__ */
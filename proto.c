@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "proto.h"
+
+/* 1 once size bytes are read, 0 on end of file before the first one */
+static int read_full(int fd, void *buf, size_t size)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < size) {
+        if ((n = read(fd, (char *)buf + done, size - done)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            if (done == 0)
+                return 0;
+            errno = EPROTO;
+            return -1;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+int proto_read(int fd, struct proto_header *h, unsigned char **payload)
+{
+    int r;
+
+    *payload = NULL;
+    if ((r = read_full(fd, h, sizeof(*h))) != 1)
+        return r;
+    if (h->magic != PROTO_MAGIC || h->version != PROTO_VERSION ||
+            h->length > PROTO_MAX_PAYLOAD) {
+        errno = EPROTO;
+        return -1;
+    }
+    /* one more byte, so that paths can be NUL terminated in place */
+    if ((*payload = malloc(h->length + 1)) == NULL)
+        return -1;
+    if ((r = read_full(fd, *payload, h->length)) != 1 && h->length > 0) {
+        if (r == 0)
+            errno = EPROTO;
+        free(*payload);
+        *payload = NULL;
+        return -1;
+    }
+    (*payload)[h->length] = '\0';
+    return 1;
+}
+
+int proto_send(int fd, struct iovec *iov, int n)
+{
+    struct msghdr msg;
+    ssize_t sent;
+
+    memset(&msg, 0, sizeof(msg));
+    while (n > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        /* a client gone is an error, not a SIGPIPE */
+        if ((sent = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (; n > 0 && (size_t)sent >= iov->iov_len; iov++, n--)
+            sent -= iov->iov_len;
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+const char *proto_strstatus(enum proto_status s)
+{
+    switch (s) {
+        case PROTO_OK:
+            return "ok";
+        case PROTO_ERR_REQUEST:
+            return "bad request";
+        case PROTO_ERR_OPEN:
+            return "can't open file";
+        case PROTO_ERR_IMAGE:
+            return "bad image";
+        case PROTO_ERR_WRITE:
+            return "can't write file";
+        case PROTO_ERR_ALLOC:
+            return "out of memory";
+    }
+    return "unknown status";
+}
@@ -0,0 +1,58 @@
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* framing of --listen requests and replies
+ *
+ * every frame is a fixed header followed by length bytes of payload. a
+ * request carries a path to process in place, or a whole JPEG image. the
+ * reply to it has the same id, and for images the rewritten image as its
+ * payload. replies of the requests of a connection can come out of order.
+ * the socket is local, the header is in host byte order.
+ */
+
+#define PROTO_MAGIC 0x53504752 /* "RGPS" */
+#define PROTO_VERSION 1
+/* larger requests are refused and the connection closed */
+#define PROTO_MAX_PAYLOAD (64u << 20)
+
+enum proto_type {
+    /* NUL-less path of a file, processed in place as on the command line */
+    PROTO_PATH = 1,
+    /* JPEG image, sent back rewritten */
+    PROTO_IMAGE
+};
+
+enum proto_status {
+    PROTO_OK = 0,
+    /* unknown type */
+    PROTO_ERR_REQUEST,
+    PROTO_ERR_OPEN,
+    /* not a JPEG image, or its EXIF data couldn't be parsed or saved */
+    PROTO_ERR_IMAGE,
+    PROTO_ERR_WRITE,
+    PROTO_ERR_ALLOC
+};
+
+struct proto_header {
+    uint32_t magic;
+    uint16_t version;
+    /* enum proto_type in requests, enum proto_status in replies */
+    uint16_t type;
+    /* chosen by the client, echoed in the reply */
+    uint32_t id;
+    uint32_t length;
+};
+
+/* a frame from fd, *payload to be freed. returns 1, 0 on end of file
+ * before a header, -1 on failure with errno set (EPROTO for a bad header) */
+int proto_read(int fd, struct proto_header *h, unsigned char **payload);
+
+/* send every byte of iov, retrying short writes. -1 on failure */
+int proto_send(int fd, struct iovec *iov, int n);
+
+const char *proto_strstatus(enum proto_status s);
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+#include <time.h>
+
+#include "queue.h"
+
+int queue_init(struct queue *q, size_t size)
+{
+    size_t i, n = 2;
+
+    while (n < size)
+        n <<= 1;
+    if ((q->cells = malloc(n * sizeof(struct queue_cell))) == NULL)
+        return -1;
+    for (i = 0; i < n; i++)
+        atomic_init(&q->cells[i].seq, i);
+    q->mask = n - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->closed, false);
+    return 0;
+}
+
+void queue_destroy(struct queue *q)
+{
+    free(q->cells);
+    q->cells = NULL;
+}
+
+bool queue_try_push(struct queue *q, void *data)
+{
+    struct queue_cell *cell;
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    intptr_t dif;
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        dif = (intptr_t)atomic_load_explicit(&cell->seq,
+                memory_order_acquire) - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos,
+                        pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            /* full */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+
+    cell->data = data;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+bool queue_try_pop(struct queue *q, void **data)
+{
+    struct queue_cell *cell;
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    intptr_t dif;
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        dif = (intptr_t)atomic_load_explicit(&cell->seq,
+                memory_order_acquire) - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos,
+                        pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            /* empty */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+
+    *data = cell->data;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return true;
+}
+
+/* yield a few times, then sleep for longer and longer, up to 1ms */
+static void queue_backoff(unsigned int *n)
+{
+    struct timespec ts = { 0, 0 };
+
+    if (*n < 16) {
+        sched_yield();
+    } else {
+        ts.tv_nsec = (*n < 26 ? 1L << (*n - 6) : 1L << 20);
+        nanosleep(&ts, NULL);
+    }
+    (*n)++;
+}
+
+void queue_push(struct queue *q, void *data)
+{
+    unsigned int n = 0;
+
+    while (!queue_try_push(q, data))
+        queue_backoff(&n);
+}
+
+void *queue_pop(struct queue *q)
+{
+    unsigned int n = 0;
+    void *data;
+
+    for (;;) {
+        if (queue_try_pop(q, &data))
+            return data;
+        /* everything pushed before closing is visible by now */
+        if (atomic_load(&q->closed))
+            return queue_try_pop(q, &data) ? data : NULL;
+        queue_backoff(&n);
+    }
+}
+
+void queue_close(struct queue *q)
+{
+    atomic_store(&q->closed, true);
+}
@@ -0,0 +1,43 @@
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* bounded lock-free multi producer/multi consumer queue
+ *
+ * a ring of cells, each with a sequence number telling whether it's ready
+ * to be written or read for the current lap (D. Vyukov's design).
+ * push and pop spin, then sleep, while the queue is full or empty.
+ */
+
+struct queue_cell {
+    atomic_size_t seq;
+    void *data;
+};
+
+struct queue {
+    struct queue_cell *cells;
+    size_t mask;
+    /* next positions to push to and pop from */
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_bool closed;
+};
+
+/* size is rounded up to a power of two. returns -1 on failure */
+int   queue_init(struct queue *q, size_t size);
+void  queue_destroy(struct queue *q);
+
+bool  queue_try_push(struct queue *q, void *data);
+bool  queue_try_pop(struct queue *q, void **data);
+
+/* block until there's room */
+void  queue_push(struct queue *q, void *data);
+/* block until there's data, NULL once the queue is closed and empty */
+void *queue_pop(struct queue *q);
+/* no more pushes will follow */
+void  queue_close(struct queue *q);
+
+#endif
@@ -1,41 +1,102 @@
+/* syncfs(2) */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <time.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 /* file/dir processing */
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 /* libexif headers */
 #include <libexif/exif-data.h>
 /* libjpeg */
 #include "libjpeg/jpeg-data.h"
+#include "libjpeg/jpeg-gps.h"
+
+#include "arena.h"
+#include "cache.h"
+#include "queue.h"
+#include "randgps.h"
+#include "rng.h"
+#include "server.h"
+#include "stats.h"
+#include "tar.h"
+#include "uring.h"
+#include "walk.h"
+#include "watch.h"
+
+/* a file on its way through the read, transform and write stages */
+struct job {
+    char *path;
+
+    /* patching in place: the EXIF APP1 payload and the bytes changed in it */
+    int fd;
+    unsigned char *app1;
+    unsigned int app1_size;
+    off_t app1_offset;
+    ExifEntry views[JPEG_GPS_MAX_ENTRIES];
+
+    /* full rewrite, allocated from the arena */
+    JPEGData *jpeg_data;
+    ExifData *exif_data;
+    struct arena *arena;
 
-/* struct used on each image */
-struct image_gps_exif {
-    ExifEntry *latitude;
-    ExifEntry *longitude;
-    ExifEntry *latitude_ref;
-    ExifEntry *longitude_ref;
-    ExifEntry *timestamp;
-    ExifEntry *datestamp;
-    int8_t n_entries;
+    /* stats_now() when it was created */
+    uint64_t start;
+    /* counter of the first error, 0 if none */
+    enum stats_counter error;
+
+    /* what's left to do */
+    enum {
+        JOB_DONE = 0,
+        JOB_PATCH,
+        JOB_REWRITE
+    } action;
 };
 
-/* lazy representation of rationale64u used by GPS EXIF tags */
-typedef struct rationale64u {
-    uint32_t data[6];
-} r64_t;
+struct worker;
+
+/* a step of the pipeline, run by its own threads between two queues */
+struct stage {
+    void (*run)(struct job *, struct worker *);
+    /* same for several jobs at once, through the worker's io_uring */
+    void (*run_batch)(struct job **, unsigned int, struct worker *);
+    struct queue *in;
+    struct queue *out;
+    /* the last thread out closes the next queue */
+    atomic_uint running;
+};
 
-typedef r64_t coords;
-typedef r64_t times;
+/* per thread state, nothing in here is shared between workers */
+struct worker {
+    pthread_t thread;
+    struct stage *stage;
+    /* NULL unless using io_uring */
+    struct uring *ring;
+};
 
+/* jobs taken at once by a worker with an io_uring */
+#define URING_BATCH 32
+/* the write stage queues a write per GPS entry of every job of a batch,
+ * they all fit without the ring having to be run halfway */
+#define URING_ENTRIES (URING_BATCH * JPEG_GPS_MAX_ENTRIES)
+/* the EXIF APP1 segment is usually in the first 64K of the file */
+#define URING_HEAD_SIZE 65536
 
 /* flags */
 bool verbose = false;
@@ -44,13 +105,62 @@ bool jpeg_create_new = false;
 bool delete_gps_data = false;
 bool identify_gps_data = false;
 bool test_file_magic = false;
+bool use_uring = false;
+
+/* randomization (-d, --seed): every file gets its own stream of values,
+ * named by its path */
+struct randgps_options options;
+/* dates of reproducible runs can't depend on the current time */
+#define SEEDED_TIME_MAX 1577836800 /* 2020-01-01 */
+
+/* number of workers of each stage (-j) */
+enum {
+    STAGE_READ = 0,
+    STAGE_TRANSFORM,
+    STAGE_WRITE,
+    STAGE_COUNT
+};
+unsigned int jobs[STAGE_COUNT] = { 1, 1, 1 };
+/* NULL unless running more than one worker */
+struct queue *queue = NULL;
+
+/* files already processed (--cache), NULL if not asked for */
+struct cache *cache = NULL;
+
+/* socket to answer requests on (--listen), NULL if not asked for */
+char *listen_path = NULL;
+/* images received, each gets its own stream of values */
+static atomic_ulong images_served;
+
+/* tree to process new files of as they land (--watch) */
+char *watch_dir = NULL;
+/* files are processed once nothing happened to them for that long */
+#define WATCH_DELAY_MS 200
+
+/* archive whose JPEG members go to stdout rewritten (--tar), "-" for
+ * stdin */
+char *tar_path = NULL;
+
+/* durability of the writes (--sync) */
+enum {
+    SYNC_NONE = 0,
+    /* fsync(2) every file */
+    SYNC_FILE,
+    /* syncfs(2) the filesystems written to every SYNC_BATCH_FILES files,
+     * and at the end */
+    SYNC_BATCH
+} sync_mode = SYNC_NONE;
+#define SYNC_BATCH_FILES 1024
+#define SYNC_MAX_FS 16
 
-/* Latitude references */
-#define LATITUDE_REF_N "N"
-#define LATITUDE_REF_S "S"
-/* Longitude references */
-#define LONGITUDE_REF_E "E"
-#define LONGITUDE_REF_W "W"
+static struct {
+    dev_t dev;
+    int fd;
+} sync_fs[SYNC_MAX_FS];
+static unsigned int sync_n_fs, sync_pending;
+/* written to more filesystems than that, sync(2) them all */
+static bool sync_everything;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* magics
  * this is used to identify files by file magic.
@@ -64,13 +174,6 @@ static const char magics[4][4] = {
     { 0x00, 0x00, 0x00, 0x00 }
 };
 
-/* little -> big endian */
-uint32_t __bswap_32( uint32_t val )
-{
-    val = ((val << 8) & 0xFF00FF00 ) | ((val >> 8) & 0xFF00FF ); 
-    return (val << 16) | (val >> 16);
-}
-
 /* error reporting */
 enum {
     INFO = 0,
@@ -82,6 +185,8 @@ static void _perror(uint8_t t, char *f, ...)
 {
     va_list va_m;
 
+    /* workers report concurrently, keep each message in one piece */
+    flockfile(stderr);
     switch (t) {
         case (ERROR):
             fprintf(stderr, "[ERROR] ");
@@ -97,12 +202,14 @@ static void _perror(uint8_t t, char *f, ...)
     vfprintf(stderr, f, va_m);
     va_end(va_m);
     fprintf(stderr, "\n");
+    funlockfile(stderr);
 }
 
 void dump_hex(const char *name, unsigned char *data, size_t s)
 {
     int n = 0;
 
+    flockfile(stdout);
     printf("%s:\n\t", name);
     while (s-->0) {
         n++;
@@ -114,20 +221,20 @@ void dump_hex(const char *name, unsigned char *data, size_t s)
         data++;
     }
     printf("\n");
+    funlockfile(stdout);
 }
 
-static bool is_valid(const char *path)
+/* randgps_options.entry of -v */
+static void dump_entry(ExifTag tag, const unsigned char *d, unsigned int size,
+        void *arg)
 {
-    int path_fd = open(path, O_RDONLY);
-    if (path_fd == -1) {
-        perror("open");
-        _perror (ERROR, "open(2) returned -1 during file magic check!");
-        return false;
-    }
+    (void)arg;
+    dump_hex(exif_tag_get_name(tag), (unsigned char *)d, size);
+}
 
-    uint8_t data[4], *magic;
-    read(path_fd, &data, 4);
-    close(path_fd);
+static bool is_valid_magic(const uint8_t *data)
+{
+    uint8_t *magic;
 
     magic = &magics;
     while (*(uint32_t*)magic != 0) {
@@ -142,294 +249,1316 @@ static bool is_valid(const char *path)
 
 }
 
-/* randomize timestamp and datetime */
-void randomize_datetime(struct image_gps_exif *g)
+static bool is_valid(const char *path)
 {
-    time_t now = rand() % time(NULL);
-    struct tm *tm_data;
+    uint64_t start = stats_now();
+    int path_fd = open(path, O_RDONLY);
+    if (path_fd == -1) {
+        perror("open");
+        _perror (ERROR, "open(2) returned -1 during file magic check!");
+        stats_add(STATS_ERR_OPEN, 1);
+        return false;
+    }
 
-    tm_data = gmtime(&now);
+    uint8_t data[4] = { 0 };
+    read(path_fd, &data, 4);
+    close(path_fd);
 
-    /* GPSTimeStamp */
-    if (g->timestamp != NULL) {
-        times t;
-        t.data[0] = __bswap_32(tm_data->tm_hour);
-        t.data[2] = __bswap_32(tm_data->tm_min);
-        t.data[4] = __bswap_32(tm_data->tm_sec);
+    stats_time(STATS_MAGIC, start);
+    return is_valid_magic(data);
+}
 
-        t.data[1] = __bswap_32(0x01);
-        t.data[3] = t.data[5] = t.data[1];
-        memcpy(g->timestamp->data, &t, sizeof(t));
-    }
-    
-    /* GPSDateStamp */
-    if (g->datestamp != NULL) {
-        char d[11];
-#define GPS_DATESTAMP_FMT "%Y:%m:%d"
-        strftime(d, 11, GPS_DATESTAMP_FMT, tm_data);
-        memcpy(g->datestamp->data, &d, strlen(d));
+/* path of the copy made by -n: "rand_" in front of the file name */
+static char *new_image_path(const char *path)
+{
+#define NEW_PATH_CONCAT "rand_"
+    const char *name_ptr;
+    char *new_path;
+    int dir_len;
+    size_t size;
+
+    if ((name_ptr = strrchr(path, '/')) == NULL) {
+        name_ptr = path;
+        dir_len = 1;
+        path = ".";
+    } else {
+        name_ptr++;
+        dir_len = name_ptr - path - 1;
     }
+
+    size = dir_len + strlen(NEW_PATH_CONCAT) + strlen(name_ptr) + 2;
+    if ((new_path = malloc(size)) == NULL)
+        return NULL;
+    snprintf(new_path, size, "%.*s/%s%s", dir_len, path, NEW_PATH_CONCAT,
+            name_ptr);
+    return new_path;
 }
 
-/* randomize latitude/longitude values */
-void randomize(struct image_gps_exif *g)
+/* --sync batch: flush the filesystems written to so far */
+static void sync_batch(void)
 {
-    uint8_t la_max = 90;
-    uint8_t lo_max = 180;
-    coords la, lo;
+    unsigned int i;
 
-    /* latitude */
-    la.data[0] = __bswap_32(rand()%la_max);
-    la.data[1] = __bswap_32(1);
-    la.data[2] = __bswap_32(rand()%60);
-    la.data[3] = __bswap_32(1);
-    la.data[4] = __bswap_32(rand()%600);
-    la.data[5] = __bswap_32(10); // 01.f
-    
-    /* longitude */
-    lo.data[0] = __bswap_32(rand()%lo_max);
-    lo.data[1] = __bswap_32(1);
-    lo.data[2] = __bswap_32(rand()%60);
-    lo.data[3] = __bswap_32(1);
-    lo.data[4] = __bswap_32(rand()%600);
-    lo.data[5] = __bswap_32(10); // 01.f
-
-    if (g->latitude != NULL)
-        memcpy(g->latitude->data, &la, sizeof(coords));
-    if (g->longitude != NULL)
-        memcpy(g->longitude->data, &lo, sizeof(coords));
-}
-
-/* randomize latitude/longitude references */
-void randomize_ref(struct image_gps_exif *g)
-{
-    uint8_t la_ref = (uint8_t)rand()%2;
-    uint8_t lo_ref = (la_ref^1);
-
-    if (g->latitude_ref != NULL)
-        switch (la_ref) {
-            case(0): strncpy((char *)g->latitude_ref->data,
-                             LATITUDE_REF_N, 2); break;
-            case(1): strncpy((char *)g->latitude_ref->data,
-                             LATITUDE_REF_S, 2); break;
-        }
+    pthread_mutex_lock(&sync_lock);
+    for (i = 0; i < sync_n_fs; i++)
+        if (syncfs(sync_fs[i].fd) == -1)
+            perror("syncfs");
+    if (sync_everything)
+        sync();
+    sync_pending = 0;
+    pthread_mutex_unlock(&sync_lock);
+}
 
-    if (g->longitude_ref != NULL)
-        switch (lo_ref) {
-            case(0): strncpy((char *)g->longitude_ref->data,
-                             LONGITUDE_REF_E, 2); break;
-            case(1): strncpy((char *)g->longitude_ref->data,
-                             LONGITUDE_REF_W, 2); break;
-        }
+/* a file was written to fd, or replaced at path: make it durable the way
+ * --sync says. the rewrites sync themselves with --sync file. */
+static void sync_written(int fd, const char *path)
+{
+    struct stat st;
+    unsigned int i;
+    bool full;
+
+    if (sync_mode == SYNC_FILE) {
+        if (fd != -1 && fsync(fd) == -1)
+            perror("fsync");
+        return;
+    }
+    if (sync_mode != SYNC_BATCH ||
+            (fd != -1 ? fstat(fd, &st) : stat(path, &st)) == -1)
+        return;
+
+    pthread_mutex_lock(&sync_lock);
+    for (i = 0; i < sync_n_fs; i++)
+        if (sync_fs[i].dev == st.st_dev)
+            break;
+    if (i == sync_n_fs) {
+        /* anything open on the filesystem will do for syncfs(2) */
+        if (sync_n_fs < SYNC_MAX_FS && (sync_fs[i].fd = (fd != -1 ?
+                        dup(fd) : open(path, O_RDONLY))) != -1) {
+            sync_fs[i].dev = st.st_dev;
+            sync_n_fs++;
+        } else
+            sync_everything = true;
+    }
+    full = ++sync_pending >= SYNC_BATCH_FILES;
+    pthread_mutex_unlock(&sync_lock);
+
+    if (full)
+        sync_batch();
 }
 
 /* write new data to new file */
-int write_image(char *path, ExifData *data)
+int write_image(char *path, JPEGData *jpeg_data)
 {
-    JPEGData *jpeg_out;
-    char *new_path = NULL, *dir = NULL, *name_ptr;
+    int ret;
+    char *new_path = NULL;
+    struct stat st;
+    uint64_t start = stats_now();
+
+    /* saved by libexif first, timed apart from the write */
+    if (!jpeg_data_save_exif_data(jpeg_data))
+        return 0;
+    stats_time(STATS_SERIALIZE, start);
 
     if (jpeg_create_new) {
-#define NEW_PATH_CONCAT "rand_"
+        if ((new_path = new_image_path(path)) == NULL)
+            return 0;
+        _perror(INFO, "Creating new jpeg image: %s", new_path);
+    }
+    
+    /* the EXIF data was modified in place, so the sections we already
+     * parsed are written back as they are. */
+    ret = jpeg_data_save_file_sync(jpeg_data,
+            (jpeg_create_new ? new_path : path), sync_mode == SYNC_FILE);
+    if (ret) {
+        sync_written(-1, (jpeg_create_new ? new_path : path));
+        if (stats_enabled && stat(jpeg_create_new ? new_path : path,
+                    &st) != -1)
+            stats_add(STATS_BYTES_WRITTEN, st.st_size);
+    }
 
-        if ((name_ptr = strrchr(path, '/')) == NULL) {
-            name_ptr = path;
-        } else {
-            dir = malloc(4096);
-            strncpy(dir, path, strlen(path) - strlen(name_ptr));
-            name_ptr++;
-        }
+    free(new_path);
+    return ret;
+}
+
+/* copy size bytes of in to out from their current offsets, without
+ * going through userspace when the kernel can do it. returns 0 or -1. */
+static int copy_data(int in, int out, off_t size)
+{
+    char buf[65536];
+    ssize_t n;
+
+#ifdef FICLONE
+    /* same extents, shared until the patched blocks are written */
+    if (ioctl(out, FICLONE, in) == 0)
+        return 0;
+#endif
 
-        new_path = malloc(4096);
-        snprintf(new_path, 4096, "%s/%s%s", (dir?dir:"."), NEW_PATH_CONCAT,
-                name_ptr);
-        if (jpeg_create_new)
-            _perror(INFO, "Creating new jpeg image: %s", new_path);
+    while (size > 0 && (n = copy_file_range(in, NULL, out, NULL, size,
+                    0)) > 0)
+        size -= n;
+    /* copy_file_range(2) can't cross filesystems on older kernels */
+    while (size > 0 && (n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n)
+            return -1;
+        size -= n;
     }
-    
-    jpeg_out = jpeg_data_new_from_file(path);
-    jpeg_data_set_exif_data(jpeg_out, data);
-    jpeg_data_save_file(jpeg_out, (jpeg_create_new ? new_path : path));
+    return size > 0 ? -1 : 0;
+}
 
-    jpeg_data_free(jpeg_out);
+/* copy the whole file to a temporary one t next to path, to be patched
+ * and renamed over path. returns the descriptor of the copy, or -1. t has
+ * to be freed either way. */
+static int copy_image(int fd, const char *path, JPEGDataTemp *t)
+{
+    struct stat st;
 
-    if (new_path)
-        free(new_path);
-    if (dir)
-        free(dir);
+    if (!jpeg_data_temp_open(t, path))
+        return -1;
+    if (fstat(fd, &st) == -1 || lseek(fd, 0, SEEK_SET) == -1 ||
+            copy_data(fd, t->fd, st.st_size) == -1)
+        return -1;
+    stats_add(STATS_BYTES_WRITTEN, st.st_size);
+    return t->fd;
+}
+
+void report_gps_data(char *path, int n_entries)
+{
+    if (n_entries > 0)
+        _perror(INFO, "GPS data present in '%s'.", path);
+    else
+        _perror(INFO, "No GPS data present in '%s'.", path);
+}
+
+/* only tell whether there's GPS data, reading just IFD0 and the GPS IFD.
+ * returns 0 if the EXIF data has to be loaded by libexif instead. */
+static int identify_image(char *path)
+{
+    unsigned char soi[2];
+    int fd, n;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return 0;
+    /* files that aren't JPEG images have nothing to report */
+    if (pread(fd, soi, 2, 0) != 2 || soi[0] != 0xff || soi[1] != 0xd8) {
+        close(fd);
+        if (verbose)
+            _perror(INFO, "'%s' is not a JPEG image.", path);
+        return 1;
+    }
+    n = jpeg_gps_probe(fd);
+    close(fd);
+
+    if (n < 0)
+        return 0;
+    report_gps_data(path, n);
     return 1;
 }
 
-void delete_entry(ExifEntry *e)
+static struct job *job_new(const char *path)
 {
-    exif_content_remove_entry(e->parent, e);
+    struct job *j = calloc(1, sizeof(struct job));
+
+    if (j == NULL)
+        return NULL;
+    if ((j->path = strdup(path)) == NULL) {
+        free(j);
+        return NULL;
+    }
+    j->fd = -1;
+    if ((j->arena = arena_new()) == NULL) {
+        free(j->path);
+        free(j);
+        return NULL;
+    }
+    /* the read stage starts it again, time spent queued before it
+     * doesn't count */
+    j->start = stats_now();
+    return j;
 }
 
-void delete_gps_entries(struct image_gps_exif *g)
+static void job_free(struct job *j)
 {
-    if (g->latitude != NULL)
-        delete_entry(g->latitude);
-    if (g->latitude_ref != NULL)
-        delete_entry(g->latitude_ref);
-    if (g->longitude != NULL)
-        delete_entry(g->longitude);
-    if (g->longitude_ref != NULL)
-        delete_entry(g->longitude_ref);
-    if (g->timestamp != NULL)
-        delete_entry(g->timestamp);
-    if (g->datestamp != NULL)
-        delete_entry(g->datestamp);
+    stats_time(STATS_FILE, j->start);
+    stats_add(STATS_FILES, 1);
+    free(j->app1);
+    if (j->fd != -1)
+        close(j->fd);
+    arena_enter(j->arena);
+    if (j->exif_data)
+        exif_data_unref(j->exif_data);
+    if (j->jpeg_data)
+        jpeg_data_unref(j->jpeg_data);
+    arena_release(j->arena);
+    arena_enter(NULL);
+    free(j->path);
+    free(j);
 }
 
-ExifEntry *get_gps_content(ExifData *d, ExifTag t) {
-    ExifEntry *e = exif_content_get_entry(d->ifd[EXIF_IFD_GPS], t);
+/* count an error of the job, the first one is what it failed with */
+static void job_error(struct job *j, enum stats_counter c)
+{
+    stats_add(c, 1);
+    if (j->error == 0)
+        j->error = c;
+}
 
-    if (e != NULL && verbose) {
-        dump_hex(exif_tag_get_name(t), (void *)e->data, e->size);
+/* read and parse the file once; the APP1 section already holds the
+ * EXIF tree we are going to modify and write back. */
+static bool load_exif(struct job *j)
+{
+    uint64_t start = stats_now();
+    struct stat st;
+
+    if (!(j->jpeg_data = jpeg_data_new_mem(arena_exif_mem(j->arena)))) {
+        _perror(ERROR, "Couldn't allocate JPEG data for '%s'", j->path);
+        job_error(j, STATS_ERR_ALLOC);
+        return false;
     }
-    return (e);
+    jpeg_data_load_file(j->jpeg_data, j->path);
+    if (stats_enabled && stat(j->path, &st) != -1)
+        stats_add(STATS_BYTES_READ, st.st_size);
+    if (!(j->exif_data = jpeg_data_get_exif_data(j->jpeg_data))) {
+        if (verbose)
+            _perror(INFO, "Couldn't load exif data from '%s'. "\
+                    "No IFD GPS data or not even an image?", j->path);
+        if (j->jpeg_data->count == 0)
+            job_error(j, STATS_ERR_PARSE);
+        return false;
+    }
+    stats_time(STATS_PARSE, start);
+    return true;
 }
 
-void process_file(char *path)
+/* the cache only knows about files changed in place */
+static bool use_cache(void)
 {
-    struct image_gps_exif gps;
-    gps.n_entries = 0;
+    return cache != NULL && !jpeg_create_new && !identify_gps_data;
+}
 
+/* whether the state a file was left in leaves nothing to do this time */
+static bool cache_done(const struct cache_entry *e)
+{
+    return e->state == CACHE_CLEAN ||
+        (e->state == CACHE_RANDOMIZED && !delete_gps_data);
+}
+
+/* skip files unchanged since they were processed, without opening them */
+static bool job_cached(struct job *j)
+{
+    struct cache_entry e;
+    struct stat st;
+
+    if (!use_cache() || stat(j->path, &st) == -1 ||
+            !cache_get(cache, &st, &e) || !cache_fresh(&e, &st) ||
+            !cache_done(&e))
+        return false;
+    stats_add(STATS_SKIPPED, 1);
     if (verbose)
-        printf("=== %s ===\n", path);
+        _perror(INFO, "'%s' unchanged since it was processed.", j->path);
+    return true;
+}
+
+/* same, once its APP1 segment is read, for files that were touched
+ * without changing their EXIF data */
+static bool job_cached_app1(struct job *j)
+{
+    struct cache_entry e;
+    struct stat st;
+
+    if (!use_cache() || fstat(j->fd, &st) == -1 ||
+            !cache_get(cache, &st, &e) || e.hash == 0 || !cache_done(&e) ||
+            cache_hash(j->app1, j->app1_size) != e.hash)
+        return false;
+    cache_put(cache, &st, e.hash, e.state);
+    stats_add(STATS_SKIPPED, 1);
+    if (verbose)
+        _perror(INFO, "EXIF data of '%s' unchanged since it was processed.",
+                j->path);
+    return true;
+}
+
+/* record the state a file was left in */
+static void record_job(struct job *j, enum cache_state state)
+{
+    struct stat st;
+
+    if (!use_cache())
+        return;
+    if ((j->fd != -1 ? fstat(j->fd, &st) : stat(j->path, &st)) == -1)
+        return;
+    /* the APP1 bytes are only known when they were patched in place */
+    cache_put(cache, &st, (j->fd != -1 && j->app1 != NULL) ?
+            cache_hash(j->app1, j->app1_size) : 0, state);
+}
+
+/* what the read stage does, timed by read_file */
+static void read_headers(struct job *j)
+{
+    if (verbose)
+        printf("=== %s ===\n", j->path);
+
+    if (job_cached(j))
+        return;
 
     /* check file magic? */
     if (test_file_magic)
-        if (!is_valid(path))
+        if (!is_valid(j->path))
             return;
 
-    ExifData *exif_data;
-    if (!(exif_data = exif_data_new_from_file(path))) {
-        if (verbose)
-            _perror(INFO, "Couldn't load exif data from '%s'. "\
-                    "No IFD GPS data or not even an image?", path);
+    if (identify_gps_data && identify_image(j->path))
         return;
+
+    /* neither randomizing nor deleting changes the layout of the file,
+     * -n patches a copy of it */
+    if (!identify_gps_data) {
+        if ((j->fd = open(j->path, jpeg_create_new ? O_RDONLY : O_RDWR)) ==
+                -1)
+            job_error(j, STATS_ERR_OPEN);
+        else if (jpeg_gps_read_app1(j->fd, &j->app1, &j->app1_size,
+                    &j->app1_offset)) {
+            stats_add(STATS_BYTES_READ, j->app1_size);
+            if (!job_cached_app1(j))
+                j->action = JOB_PATCH;
+            return;
+        }
+        if (j->fd != -1) {
+            close(j->fd);
+            j->fd = -1;
+        }
     }
 
-    if (verbose) _perror(INFO, "Getting GPS content: ");
-    /* check existence of latitude tag */
-    gps.latitude = get_gps_content(exif_data, EXIF_TAG_GPS_LATITUDE);
-    if (gps.latitude == NULL && verbose)
-        _perror(INFO, "No latitude data.");
-    else
-        gps.n_entries++;
+    if (load_exif(j))
+        j->action = JOB_REWRITE;
+    else if (j->jpeg_data != NULL)
+        /* read fine, but no EXIF data in there */
+        record_job(j, CACHE_CLEAN);
+}
 
-    /* check existence of latitude ref tag */
-    gps.latitude_ref = get_gps_content(exif_data,
-            EXIF_TAG_GPS_LATITUDE_REF);
-    if (gps.latitude_ref == NULL && verbose)
-        _perror(INFO, "No latitude reference data.");
-    else
-        gps.n_entries++;
-    
-    /* check existence of longitude tag */
-    gps.longitude = get_gps_content(exif_data, EXIF_TAG_GPS_LONGITUDE);
-    if (gps.longitude == NULL && verbose)
-        _perror(INFO, "No longitude data.");
-    else
-        gps.n_entries++;
-    
-    /* check existence of longitude ref tag */
-    gps.longitude_ref = get_gps_content(exif_data,
-            EXIF_TAG_GPS_LONGITUDE_REF);
-    if (gps.longitude_ref == NULL && verbose)
-        _perror(INFO, "No longitude reference data.");
-    else
-        gps.n_entries++;
-    
-    /* check existence of timestamp tag */
-    gps.timestamp = get_gps_content(exif_data,
-            EXIF_TAG_GPS_TIME_STAMP);
-    if (gps.timestamp == NULL && verbose)
-        _perror(INFO, "No timestamp data.");
-    else
-        gps.n_entries++;
-    
-    /* check existence of datestamp tag */
-    gps.datestamp = get_gps_content(exif_data,
-            EXIF_TAG_GPS_DATE_STAMP);
-    if (gps.datestamp == NULL && verbose)
-        _perror(INFO, "No datestamp data.");
-    else
-        gps.n_entries++;
+/* read stage: only what the next stages need */
+static void read_file(struct job *j, struct worker *w)
+{
+    uint64_t start = stats_now();
+    struct arena *prev = arena_enter(j->arena);
 
-    if (delete_gps_data) {
-        delete_gps_entries(&gps);
-    } else if (identify_gps_data) {
-        /* this will just check if theres any GPS data. */
-        if (gps.n_entries > 0)
-            goto goaway;
-        else
+    (void)w;
+    j->start = start;
+    j->action = JOB_DONE;
+    read_headers(j);
+    arena_enter(prev);
+    stats_time(STATS_READ, start);
+}
+
+/* randomize or delete the GPS entries rewriting only their bytes, every
+ * other byte of the file stays as it is. returns 0 if the file has to go
+ * through libexif instead. */
+static int patch_gps(struct job *j, struct worker *w)
+{
+    struct randgps_range changed[RANDGPS_MAX_RANGES];
+    JPEGGpsInfo info;
+    unsigned int i, n;
+    uint64_t start = stats_now();
+    int r;
+
+    (void)w;
+    if (verbose && !delete_gps_data)
+        _perror(INFO, "Getting GPS content: ");
+    if (!randgps_app1_parse(j->app1, j->app1_size, &info))
+        return 0;
+    stats_time(STATS_PARSE, start);
+    start = stats_now();
+    r = randgps_app1_apply(&options, j->app1, j->app1_size, &info,
+            randgps_stream(j->path), changed, &n);
+    stats_time(STATS_RANDOMIZE, start);
+    if (r == -2 && verbose)
+        _perror(INFO, "Unexpected GPS entry layout, rewriting '%s'.",
+                j->path);
+    if (r < 0)
+        return 0;
+
+    if (r == 0) {
+        if (verbose)
             _perror(INFO, "No GPS data present.");
-    } else {
-        randomize(&gps);
-        randomize_ref(&gps);
-        randomize_datetime(&gps);
+        record_job(j, CACHE_CLEAN);
+        /* -n still makes its copy, with nothing to patch in it */
+        if (!jpeg_create_new)
+            j->action = JOB_DONE;
+        else
+            memset(j->views, 0, sizeof(j->views));
+        return 1;
     }
+    if (verbose && delete_gps_data)
+        _perror(INFO, "Deleting %d GPS entries.", r);
 
-    if (!write_image(path, exif_data))
-            _perror(ERROR, "Couldn't write new image file");
+    /* what the write stage writes back */
+    memset(j->views, 0, sizeof(j->views));
+    for (i = 0; i < n; i++) {
+        j->views[i].data = j->app1 + changed[i].offset;
+        j->views[i].size = changed[i].size;
+    }
+    return 1;
+}
+
+/* randomize or delete the GPS entries, timed by transform_file */
+static void transform_gps(struct job *j, struct worker *w)
+{
+    uint32_t found, dropped;
+    ExifContent *c;
+    unsigned int i, n, t;
+    uint64_t start;
+
+    if (j->action == JOB_PATCH) {
+        if (patch_gps(j, w))
+            return;
+
+        /* the layout has to change, go through libexif */
+        free(j->app1);
+        j->app1 = NULL;
+        close(j->fd);
+        j->fd = -1;
+        j->action = JOB_DONE;
+        if (!load_exif(j))
+            return;
+        j->action = JOB_REWRITE;
+    }
+
+    if (identify_gps_data) {
+        /* this will just check if theres any GPS data. */
+        c = j->exif_data->ifd[EXIF_IFD_GPS];
+        for (i = n = 0; c != NULL && i < c->count; i++)
+            if (c->entries[i]->tag != EXIF_TAG_GPS_VERSION_ID)
+                n++;
+        report_gps_data(j->path, n);
+        j->action = JOB_DONE;
+        return;
+    }
+
+    if (verbose) _perror(INFO, "Getting GPS content: ");
+    start = stats_now();
+    found = randgps_exif(&options, j->exif_data, randgps_stream(j->path),
+            &dropped);
+    stats_time(STATS_RANDOMIZE, start);
+    if (verbose)
+        for (t = 0; t < JPEG_GPS_MAX_ENTRIES; t++) {
+            if (randgps_tag_name(t) == NULL)
+                continue;
+            if (!(found & RANDGPS_TAG_BIT(t)))
+                _perror(INFO, "No %s data.", randgps_tag_name(t));
+            else if (dropped & RANDGPS_TAG_BIT(t))
+                _perror(INFO, "Unexpected %s entry, deleting it.",
+                        randgps_tag_name(t));
+        }
 
 #ifdef DEBUG
-    exif_data_dump(exif_data);
+    exif_data_dump(j->exif_data);
 #endif
-goaway:
-    /* to the next one or bail out */
-    exif_data_unref(exif_data);
 }
 
-void process_dir(char *path)
+/* transform stage */
+static void transform_file(struct job *j, struct worker *w)
 {
-    DIR *dir;
-    struct dirent *dirlist;
-    
-    if ((dir = opendir(path)) == NULL) {
-        _perror(ERROR, "Can't open directory '%s'", path);
+    uint64_t start = stats_now();
+    struct arena *prev = arena_enter(j->arena);
+
+    transform_gps(j, w);
+    arena_enter(prev);
+    stats_time(STATS_TRANSFORM, start);
+}
+
+/* the changed values, or the whole file, timed by write_file */
+static void write_gps(struct job *j)
+{
+    JPEGDataTemp t;
+    ExifEntry *e;
+    char *new_path = NULL;
+    const char *path = j->path;
+    int i, fd = j->fd;
+    /* -n patches a copy. so does -d, renamed over the file once done:
+     * packing the GPS IFD takes several writes, which a crash could cut
+     * in the middle. randomizing only rewrites values where they are. */
+    bool aside = jpeg_create_new || delete_gps_data;
+
+    if (j->action == JOB_REWRITE) {
+        if (!write_image(j->path, j->jpeg_data)) {
+            _perror(ERROR, "Couldn't write new image file");
+            job_error(j, STATS_ERR_WRITE);
+        } else
+            record_job(j, delete_gps_data ? CACHE_CLEAN : CACHE_RANDOMIZED);
+        return;
+    }
+
+    if (jpeg_create_new) {
+        if ((path = new_path = new_image_path(j->path)) == NULL) {
+            _perror(ERROR, "Couldn't write new image file");
+            job_error(j, STATS_ERR_WRITE);
+            return;
+        }
+        _perror(INFO, "Creating new jpeg image: %s", new_path);
+    }
+    if (aside && (fd = copy_image(j->fd, path, &t)) == -1) {
+        perror("copy");
+        _perror(ERROR, "Couldn't write '%s'", path);
+        job_error(j, STATS_ERR_WRITE);
+        jpeg_data_temp_free(&t);
+        free(new_path);
         return;
     }
 
-    while ((dirlist = readdir(dir)) != NULL) {
-        if ((strcmp(dirlist->d_name, ".") == 0) ||
-                (strcmp(dirlist->d_name, "..") == 0))
+    /* the layout didn't change, write back just the values */
+    for (i = 0; i < JPEG_GPS_MAX_ENTRIES; i++) {
+        e = &j->views[i];
+        if (e->data == NULL)
             continue;
+        if (pwrite(fd, e->data, e->size,
+                    j->app1_offset + (e->data - j->app1)) !=
+                (ssize_t)e->size) {
+            perror("pwrite");
+            _perror(ERROR, "Couldn't write GPS data to '%s'", j->path);
+            job_error(j, STATS_ERR_WRITE);
+            break;
+        }
+        stats_add(STATS_BYTES_WRITTEN, e->size);
+    }
+    if (i < JPEG_GPS_MAX_ENTRIES)
+        goto out;
+
+    if (!aside) {
+        sync_written(fd, NULL);
+        record_job(j, CACHE_RANDOMIZED);
+        return;
+    }
+    /* the copy is fsync'ed before the rename with --sync file */
+    if (!jpeg_data_temp_commit(&t, path, sync_mode == SYNC_FILE)) {
+        perror("rename");
+        _perror(ERROR, "Couldn't write '%s'", path);
+        job_error(j, STATS_ERR_WRITE);
+        goto out;
+    }
+    sync_written(-1, path);
+    if (!jpeg_create_new) {
+        /* the file is the copy now, that's what the cache keeps */
+        close(j->fd);
+        j->fd = t.fd;
+        t.fd = -1;
+        record_job(j, CACHE_CLEAN);
+    }
+out:
+    /* removes the copy if it didn't make it */
+    if (aside)
+        jpeg_data_temp_free(&t);
+    free(new_path);
+}
 
-        char next_path[1024];
-        snprintf((char *)&next_path, sizeof(next_path), "%s/%s",
-                path, dirlist->d_name);
+/* write stage */
+static void write_file(struct job *j, struct worker *w)
+{
+    uint64_t start = stats_now();
+    struct arena *prev = arena_enter(j->arena);
 
-        struct stat st;
-        if ((stat(next_path, &st)) == -1) {
-            _perror (ERROR, "stat(2) returned -1.");
+    (void)w;
+    write_gps(j);
+    arena_enter(prev);
+    stats_time(STATS_WRITE, start);
+}
+
+/* go through the blocking path from the start */
+static void read_file_again(struct job *j, struct worker *w)
+{
+    free(j->app1);
+    j->app1 = NULL;
+    if (j->fd != -1)
+        close(j->fd);
+    j->fd = -1;
+    read_file(j, w);
+}
+
+/* a batch takes as long for each of its jobs, charge them an equal share.
+ * the NULL ones were timed on their own. */
+static void record_batch(enum stats_timer t, struct job **js, unsigned int n,
+        uint64_t start)
+{
+    uint64_t share;
+    unsigned int i;
+
+    if (!stats_enabled || n == 0)
+        return;
+    share = (stats_now() - start) / n;
+    for (i = 0; i < n; i++)
+        if (js[i] != NULL)
+            stats_record(t, share);
+}
+
+/* read stage through io_uring: open all the files, then read their first
+ * bytes, which usually hold the whole EXIF APP1 segment. */
+static void read_files_uring(struct job **jobs, unsigned int n,
+        struct worker *w)
+{
+    struct job *js[URING_BATCH], *j;
+    int res[URING_BATCH];
+    unsigned int i, o, len;
+    uint64_t start = stats_now();
+
+    /* the jobs handled here, NULL once they're done with */
+    memcpy(js, jobs, n * sizeof(struct job *));
+    for (i = 0; i < n; i++) {
+        j = js[i];
+        j->start = start;
+        j->action = JOB_DONE;
+        /* identifying only reads the headers it needs by itself */
+        if (identify_gps_data) {
+            read_file(j, w);
+            js[i] = NULL;
+            continue;
+        }
+        if (verbose)
+            printf("=== %s ===\n", j->path);
+        if (job_cached(j)) {
+            js[i] = NULL;
             continue;
         }
+        uring_openat(w->ring, j->path, jpeg_create_new ? O_RDONLY : O_RDWR,
+                &j->fd);
+    }
+    if (uring_run(w->ring) == -1)
+        goto broken;
 
-        if ((st.st_mode & S_IFMT) == S_IFDIR) {
-            process_dir(next_path);
-        } else {
-            process_file(next_path);
+    for (i = 0; i < n; i++) {
+        if ((j = js[i]) == NULL)
+            continue;
+        if (j->fd < 0 || (j->app1 = malloc(URING_HEAD_SIZE)) == NULL) {
+            j->fd = (j->fd < 0 ? -1 : j->fd);
+            res[i] = -1;
+            continue;
+        }
+        uring_read(w->ring, j->fd, j->app1, URING_HEAD_SIZE, 0, &res[i]);
+    }
+    if (uring_run(w->ring) == -1)
+        goto broken;
+
+    for (i = 0; i < n; i++) {
+        if ((j = js[i]) == NULL)
+            continue;
+        if (res[i] < 4) {
+            read_file_again(j, w);
+            js[i] = NULL;
+            continue;
+        }
+        if (test_file_magic && !is_valid_magic(j->app1))
+            continue;
+
+        switch (jpeg_gps_find_app1_data(j->app1, res[i], &o, &len)) {
+            case 1:
+                memmove(j->app1, j->app1 + o, len);
+                j->app1_size = len;
+                j->app1_offset = o;
+                stats_add(STATS_BYTES_READ, res[i]);
+                if (!job_cached_app1(j))
+                    j->action = JOB_PATCH;
+                break;
+            case -1:
+                /* a bigger segment, read it on its own */
+                free(j->app1);
+                j->app1 = NULL;
+                if (jpeg_gps_read_app1(j->fd, &j->app1, &j->app1_size,
+                            &j->app1_offset)) {
+                    stats_add(STATS_BYTES_READ, j->app1_size);
+                    if (!job_cached_app1(j))
+                        j->action = JOB_PATCH;
+                    break;
+                }
+                /* fallthrough */
+            default:
+                read_file_again(j, w);
+                js[i] = NULL;
+                break;
+        }
+    }
+    /* the others timed themselves in read_file() */
+    record_batch(STATS_READ, js, n, start);
+    return;
+
+broken:
+    /* the ring can't be trusted anymore, stop using it */
+    _perror(WARN, "io_uring failed, going back to blocking I/O");
+    uring_free(w->ring);
+    w->ring = NULL;
+    for (i = 0; i < n; i++)
+        if (js[i] != NULL)
+            read_file_again(js[i], w);
+}
+
+/* write stage through io_uring: all the patched values at once */
+static void write_files_uring(struct job **js, unsigned int n,
+        struct worker *w)
+{
+    int res[URING_BATCH][JPEG_GPS_MAX_ENTRIES];
+    struct job *patched[URING_BATCH] = { NULL }, *j;
+    unsigned int i, k;
+    ExifEntry *e;
+    uint64_t start = stats_now();
+
+    /* -n and -d patch a copy of the file, that's done in write_file() */
+    if (jpeg_create_new || delete_gps_data) {
+        for (i = 0; i < n; i++)
+            write_file(js[i], w);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        j = js[i];
+        if (j->action != JOB_PATCH) {
+            write_file(j, w);
+            continue;
+        }
+        patched[i] = j;
+        for (k = 0; k < JPEG_GPS_MAX_ENTRIES; k++) {
+            e = &j->views[k];
+            if (e->data != NULL)
+                uring_write(w->ring, j->fd, e->data, e->size,
+                        j->app1_offset + (e->data - j->app1), &res[i][k]);
+        }
+    }
+    if (uring_run(w->ring) == -1) {
+        _perror(WARN, "io_uring failed, going back to blocking I/O");
+        uring_free(w->ring);
+        w->ring = NULL;
+        for (i = 0; i < n; i++)
+            if (js[i]->action == JOB_PATCH)
+                write_file(js[i], w);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        j = js[i];
+        if (j->action != JOB_PATCH)
+            continue;
+        for (k = 0; k < JPEG_GPS_MAX_ENTRIES; k++) {
+            e = &j->views[k];
+            if (e->data != NULL && res[i][k] != (int)e->size) {
+                if (res[i][k] < 0)
+                    _perror(ERROR, "write: %s", strerror(-res[i][k]));
+                _perror(ERROR, "Couldn't write GPS data to '%s'", j->path);
+                job_error(j, STATS_ERR_WRITE);
+                break;
+            }
+            if (e->data != NULL)
+                stats_add(STATS_BYTES_WRITTEN, e->size);
+        }
+        if (k == JPEG_GPS_MAX_ENTRIES) {
+            sync_written(j->fd, NULL);
+            record_job(j, CACHE_RANDOMIZED);
+        }
+    }
+    record_batch(STATS_WRITE, patched, n, start);
+}
+
+static struct stage stages[STAGE_COUNT] = {
+    [STAGE_READ] = { .run = read_file, .run_batch = read_files_uring },
+    [STAGE_TRANSFORM] = { .run = transform_file },
+    [STAGE_WRITE] = { .run = write_file, .run_batch = write_files_uring },
+};
+
+/* every stage, one after the other in this thread */
+static void run_job(struct job *j, struct worker *w)
+{
+    int i;
+
+    for (i = 0; i < STAGE_COUNT && (i == 0 || j->action != JOB_DONE); i++)
+        stages[i].run(j, w);
+}
+
+void process_file(char *path, struct worker *w)
+{
+    struct job *j;
+
+    if ((j = job_new(path)) == NULL) {
+        _perror(ERROR, "Couldn't allocate a job for '%s'", path);
+        stats_add(STATS_ERR_ALLOC, 1);
+        return;
+    }
+    run_job(j, w);
+    job_free(j);
+}
+
+/* randomize or delete the GPS data of the APP1 payload read in j, in
+ * place if its layout allows it. *d is set to the payload to write: j's,
+ * or one saved by libexif to be freed with the arena's exif_mem_free().
+ * false on failure */
+static bool scrub_app1(struct job *j, struct worker *w, unsigned char **d,
+        unsigned int *ds)
+{
+    JPEGGpsInfo info;
+    unsigned int i, n;
+    uint64_t start;
+
+    *d = j->app1;
+    *ds = j->app1_size;
+    j->action = JOB_PATCH;
+    if (identify_gps_data && jpeg_gps_parse(&info, j->app1, j->app1_size)) {
+        for (i = n = 0; i < info.count; i++)
+            if (info.entries[i].tag != EXIF_TAG_GPS_VERSION_ID)
+                n++;
+        report_gps_data(j->path, n);
+    } else if (identify_gps_data ||
+            !patch_gps(j, w)) {
+        /* libexif, but only on this segment */
+        if ((j->exif_data = exif_data_new_mem(arena_exif_mem(j->arena))) ==
+                NULL) {
+            _perror(ERROR, "Couldn't allocate EXIF data for '%s'", j->path);
+            job_error(j, STATS_ERR_ALLOC);
+            return false;
+        }
+        start = stats_now();
+        exif_data_load_data(j->exif_data, j->app1, j->app1_size);
+        stats_time(STATS_PARSE, start);
+        j->action = JOB_REWRITE;
+        transform_file(j, w);
+        if (j->action == JOB_REWRITE) {
+            start = stats_now();
+            exif_data_save_data(j->exif_data, d, ds);
+            stats_time(STATS_SERIALIZE, start);
+            if (*d == NULL) {
+                _perror(ERROR, "Couldn't save EXIF data for '%s'", j->path);
+                job_error(j, STATS_ERR_PARSE);
+                return false;
+            }
         }
     }
+    return true;
+}
+
+/* "-": the image read from in is written to out as it goes, holding no
+ * more than its EXIF segment in memory */
+static bool filter_stream(int in, int out, struct worker *w)
+{
+    struct job *j;
+    unsigned char *d = NULL;
+    unsigned int ds = 0;
+    bool ok = false;
+    int r;
+
+    if ((j = job_new("-")) == NULL) {
+        _perror(ERROR, "Couldn't allocate a job for '-'");
+        stats_add(STATS_ERR_ALLOC, 1);
+        return false;
+    }
+    arena_enter(j->arena);
+
+    if ((r = jpeg_gps_stream_app1(in, out, &j->app1, &j->app1_size)) == -1) {
+        _perror(ERROR, "Couldn't read a JPEG image from stdin");
+        goto out;
+    }
+    if (r == 0) {
+        if (identify_gps_data)
+            report_gps_data(j->path, 0);
+        else if (verbose)
+            _perror(INFO, "No EXIF data present.");
+        goto write;
+    }
+
+    if (!scrub_app1(j, w, &d, &ds))
+        goto out;
+
+write:
+    ok = jpeg_gps_stream_rest(in, out, d, ds);
+    if (d != j->app1)
+        exif_mem_free(arena_exif_mem(j->arena), d);
+    if (!ok)
+        _perror(ERROR, "Couldn't write the JPEG image to stdout");
+out:
+    job_free(j);
+    return ok;
+}
+
+/* --tar: the first bytes of a member, rewritten by librandgps if it's a
+ * JPEG image. what's past them is copied as it is, so its EXIF segment
+ * must be in there. arg counts the images left as they were */
+static bool tar_member(const struct tar_member *m, const unsigned char *head,
+        size_t size, unsigned char *out, size_t *out_size, void *arg)
+{
+    struct randgps_input in = { .data = head, .size = size, .name = m->name };
+    struct randgps_output o = {
+        .data = out, .capacity = TAR_HEAD_MAX + TAR_HEAD_GROW
+    };
+    uint64_t start = stats_now();
+    unsigned int *failed = arg, off, len;
+
+    if (size < 2 || head[0] != 0xff || head[1] != 0xd8)
+        return false;
+    stats_add(STATS_BYTES_READ, m->size);
+    switch (jpeg_gps_find_app1_data(head, size, &off, &len)) {
+        case 0:
+            if (verbose)
+                _perror(INFO, "No EXIF data in '%s'.", m->name);
+            stats_add(STATS_BYTES_WRITTEN, m->size);
+            return false;
+        case -1:
+            _perror(ERROR, "Couldn't find the EXIF data of '%s' in its "
+                    "first %d bytes, leaving it as it is", m->name,
+                    TAR_HEAD_MAX);
+            stats_add(STATS_ERR_PARSE, 1);
+            (*failed)++;
+            return false;
+    }
+
+    if (randgps_scrub(&options, &in, &o, 1) != 1) {
+        _perror(ERROR, "Couldn't rewrite the EXIF data of '%s', leaving "
+                "it as it is", m->name);
+        stats_add(o.status == RANDGPS_ERR_ALLOC ? STATS_ERR_ALLOC :
+                STATS_ERR_PARSE, 1);
+        (*failed)++;
+        return false;
+    }
+    *out_size = o.size;
+    stats_add(STATS_BYTES_WRITTEN, m->size - size + o.size);
+    stats_time(STATS_TRANSFORM, start);
+    return true;
+}
+
+/* --tar: the archive at path, or stdin, written to out in a single pass */
+static bool filter_tar(const char *path, int out)
+{
+    unsigned int failed = 0;
+    struct tar_ops ops = { tar_member, &failed };
+    int in = STDIN_FILENO, r;
+
+    if (strcmp(path, "-") != 0 &&
+            (in = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        _perror(ERROR, "Couldn't open '%s': %s", path, strerror(errno));
+        stats_add(STATS_ERR_OPEN, 1);
+        return false;
+    }
+    /* read once, front to back */
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    r = tar_filter(in, out, &ops);
+    if (r == -1)
+        _perror(ERROR, "Couldn't copy the tar archive '%s': %s", path,
+                errno == EINVAL ? "not a valid tar archive" :
+                strerror(errno));
+    if (in != STDIN_FILENO)
+        close(in);
+    return r == 0 && failed == 0;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct stage *s = w->stage;
+    struct job *js[URING_BATCH];
+    unsigned int i, n;
+
+    if (use_uring && s->run_batch != NULL &&
+            (w->ring = uring_new(URING_ENTRIES)) == NULL && verbose)
+        _perror(INFO, "io_uring not available, using blocking I/O");
+
+    while ((js[0] = queue_pop(s->in)) != NULL) {
+        /* take whatever else is waiting and submit it all together */
+        n = 1;
+        if (w->ring != NULL)
+            while (n < URING_BATCH && queue_try_pop(s->in, (void **)&js[n]))
+                n++;
+
+        if (w->ring != NULL)
+            s->run_batch(js, n, w);
+        else
+            s->run(js[0], w);
+
+        for (i = 0; i < n; i++)
+            if (s->out != NULL && js[i]->action != JOB_DONE)
+                queue_push(s->out, js[i]);
+            else
+                job_free(js[i]);
+    }
+
+    uring_free(w->ring);
+    if (atomic_fetch_sub(&s->running, 1) == 1 && s->out != NULL)
+        queue_close(s->out);
+    return NULL;
+}
+
+/* hand a file over to the workers, or process it right away */
+void dispatch_file(char *path, struct worker *w)
+{
+    struct job *j;
+
+    if (queue == NULL) {
+        process_file(path, w);
+        return;
+    }
+    if ((j = job_new(path)) == NULL) {
+        _perror(ERROR, "Couldn't allocate a job for '%s'", path);
+        stats_add(STATS_ERR_ALLOC, 1);
+        return;
+    }
+    queue_push(queue, j);
+}
+
+static void walk_file(const char *path, void *arg)
+{
+    dispatch_file((char *)path, arg);
+}
+
+static void walk_error(const char *path, int err, void *arg)
+{
+    (void)arg;
+    _perror(ERROR, "Can't open '%s': %s", path, strerror(err));
+    stats_add(STATS_ERR_OPEN, 1);
+}
+
+/* the files written here, temporary ones and -n copies, aren't new */
+static void watch_file(const char *path, void *arg)
+{
+    const char *name = strrchr(path, '/');
+    size_t len = strlen(path), suffix = strlen(JPEG_DATA_TMP_SUFFIX);
+
+    name = (name != NULL ? name + 1 : path);
+    if (len >= suffix &&
+            strcmp(path + len - suffix, JPEG_DATA_TMP_SUFFIX) == 0)
+        return;
+    if (jpeg_create_new &&
+            strncmp(name, NEW_PATH_CONCAT, strlen(NEW_PATH_CONCAT)) == 0)
+        return;
+    dispatch_file((char *)path, arg);
+}
+
+void process_dir(char *path, struct worker *w)
+{
+    struct walk_ops ops = { walk_file, walk_error, w };
+    uint64_t start = stats_now();
+
+    /* with a single job everything happens in this thread */
+    if (walk_tree(path, jobs[STAGE_READ], &ops) == -1)
+        _perror(ERROR, "Can't walk directory '%s'", path);
+    stats_time(STATS_WALK, start);
+}
+
+static enum proto_status job_status(const struct job *j)
+{
+    switch (j->error) {
+        case STATS_ERR_OPEN:
+            return PROTO_ERR_OPEN;
+        case STATS_ERR_PARSE:
+            return PROTO_ERR_IMAGE;
+        case STATS_ERR_WRITE:
+            return PROTO_ERR_WRITE;
+        case STATS_ERR_ALLOC:
+            return PROTO_ERR_ALLOC;
+        default:
+            return PROTO_OK;
+    }
+}
+
+/* a file processed in place, as if given on the command line */
+static void serve_path(struct server_request *r, struct worker *w)
+{
+    struct job *j;
+
+    if (r->h.length == 0 || memchr(r->payload, '\0', r->h.length) != NULL) {
+        r->status = PROTO_ERR_REQUEST;
+        return;
+    }
+    if ((j = job_new((char *)r->payload)) == NULL) {
+        stats_add(STATS_ERR_ALLOC, 1);
+        r->status = PROTO_ERR_ALLOC;
+        return;
+    }
+    run_job(j, w);
+    r->status = job_status(j);
+    job_free(j);
+}
+
+/* an image rewritten in the buffer it came in. the reply points into it,
+ * and to the APP1 payload saved by libexif if the layout changed. */
+static void serve_image(struct server_request *r, struct worker *w)
+{
+    unsigned char *img = r->payload, *d;
+    unsigned int size = r->h.length, off, len, ds;
+    struct job *j;
+    char name[32];
+
+    r->iov[0].iov_base = img;
+    r->iov[0].iov_len = size;
+    r->n_iov = 1;
+    if (size < 2 || img[0] != 0xff || img[1] != 0xd8) {
+        stats_add(STATS_ERR_PARSE, 1);
+        r->status = PROTO_ERR_IMAGE;
+        r->n_iov = 0;
+        return;
+    }
+
+    snprintf(name, sizeof(name), "-:%lu", atomic_fetch_add(&images_served, 1));
+    if ((j = job_new(name)) == NULL) {
+        stats_add(STATS_ERR_ALLOC, 1);
+        r->status = PROTO_ERR_ALLOC;
+        r->n_iov = 0;
+        return;
+    }
+    r->priv = j;
+    arena_enter(j->arena);
+    stats_add(STATS_BYTES_READ, size);
+
+    switch (jpeg_gps_find_app1_data(img, size, &off, &len)) {
+        case 0:
+            if (verbose)
+                _perror(INFO, "No EXIF data present.");
+            return;
+        case -1:
+            job_error(j, STATS_ERR_PARSE);
+            r->status = PROTO_ERR_IMAGE;
+            r->n_iov = 0;
+            return;
+    }
+    j->app1 = img + off;
+    j->app1_size = len;
+    if (!scrub_app1(j, w, &d, &ds)) {
+        r->status = job_status(j);
+        r->n_iov = 0;
+        return;
+    }
+    if (d == j->app1)
+        return;
+
+    if (ds + 2 > 0xffff) {
+        exif_mem_free(arena_exif_mem(j->arena), d);
+        job_error(j, STATS_ERR_PARSE);
+        r->status = PROTO_ERR_IMAGE;
+        r->n_iov = 0;
+        return;
+    }
+    /* a new segment length, in front of the saved payload */
+    img[off - 2] = (ds + 2) >> 8;
+    img[off - 1] = (ds + 2) & 0xff;
+    r->iov[0].iov_len = off;
+    r->iov[1].iov_base = d;
+    r->iov[1].iov_len = ds;
+    r->iov[2].iov_base = img + off + len;
+    r->iov[2].iov_len = size - off - len;
+    r->n_iov = 3;
+}
+
+static void serve_requests(struct server_request **rs, unsigned int n,
+        void *arg)
+{
+    struct worker w;
+    unsigned int i;
+
+    (void)arg;
+    memset(&w, 0, sizeof(w));
+    for (i = 0; i < n; i++) {
+        if (rs[i]->h.type == PROTO_PATH)
+            serve_path(rs[i], &w);
+        else if (rs[i]->h.type == PROTO_IMAGE)
+            serve_image(rs[i], &w);
+        else
+            rs[i]->status = PROTO_ERR_REQUEST;
+        /* left until the reply is sent, entered again then */
+        arena_enter(NULL);
+    }
+}
+
+static void serve_release(struct server_request *r, void *arg)
+{
+    struct job *j = r->priv;
+
+    (void)arg;
+    if (j == NULL)
+        return;
+    arena_enter(j->arena);
+    /* the image is sent, and the payload saved by libexif */
+    if (j->app1 != NULL && r->n_iov == 3)
+        exif_mem_free(arena_exif_mem(j->arena), r->iov[1].iov_base);
+    j->app1 = NULL;
+    job_free(j);
+}
+
+/* -j N or -j READ:TRANSFORM:WRITE */
+static bool parse_jobs(const char *arg)
+{
+    char *end;
+    long n;
+    int i;
+
+    for (i = 0; i < STAGE_COUNT; i++) {
+        n = strtol(arg, &end, 10);
+        if (end == arg || n <= 0 || n > 1024)
+            return false;
+        jobs[i] = n;
+        if (*end == '\0')
+            break;
+        if (*end != ':' || i == STAGE_COUNT - 1)
+            return false;
+        arg = end + 1;
+    }
+    /* a single number is used for every stage */
+    if (i == 0)
+        jobs[STAGE_TRANSFORM] = jobs[STAGE_WRITE] = jobs[STAGE_READ];
+    return i == 0 || i == STAGE_COUNT - 1;
+}
+
+/* start the threads of every stage, connected by bounded queues.
+ * returns the workers, NULL on failure */
+static struct worker *start_pipeline(struct queue *queues,
+        unsigned int n_workers)
+{
+    struct worker *workers = calloc(n_workers, sizeof(struct worker));
+    unsigned int i, k, n = 0;
+
+    if (workers == NULL)
+        return NULL;
+
+    for (i = 0; i < STAGE_COUNT; i++) {
+        /* enough room to keep every thread of the stage busy */
+        if (queue_init(&queues[i], 4 * jobs[i]) == -1)
+            return NULL;
+        stages[i].in = &queues[i];
+        stages[i].out = (i + 1 < STAGE_COUNT ? &queues[i + 1] : NULL);
+        atomic_init(&stages[i].running, jobs[i]);
+    }
+
+    for (i = 0; i < STAGE_COUNT; i++)
+        for (k = 0; k < jobs[i]; k++, n++) {
+            workers[n].stage = &stages[i];
+            if (pthread_create(&workers[n].thread, NULL, worker_main,
+                        &workers[n]) != 0) {
+                _perror(ERROR, "Couldn't start worker %u", n);
+                exit(1);
+            }
+        }
 
-    closedir(dir);
+    queue = &queues[STAGE_READ];
+    return workers;
 }
 
 void usage(const char *p)
 {
     (void)fprintf(stderr,
-            "usage: %s [-vhR] [-n] [-d] [-i] [file|dir ...]\n" \
+            "usage: %s [-vhRu] [-n] [-d] [-i] [-j jobs] [-s seed] [--cache file] " \
+            "[--sync mode] [--stats[=json]] [--watch dir] " \
+            "[--listen socket] [--tar archive] [file|dir ...|-]\n" \
             "\t-v\tVerbose (default: false)\n" \
             "\t-n\tCreate new JPEG file (default: false)\n" \
             "\t-d\tDelete GPS data\n" \
             "\t-i\tIdentify GPS data\n" \
             "\t-R\tRecursive if dir specified (default: false)\n" \
             "\t-f\tOnly test files identified by file magic\n" \
+            "\t-j\tWorkers per stage, N or READ:TRANSFORM:WRITE " \
+            "(default: 1)\n" \
+            "\t-u\tBatch reads and writes through io_uring if available\n" \
+            "\t-s, --seed N\tReproducible values, dates before 2020\n" \
+            "\t--cache FILE\tSkip files unchanged since they were " \
+            "processed, as recorded in FILE\n" \
+            "\t--sync MODE\tnone, file (fsync every file) or batch " \
+            "(syncfs every %d files, default: none)\n" \
+            "\t--stats[=json]\tTime every stage and print a report to " \
+            "stderr at the end\n" \
+            "\t--watch DIR\tProcess the files of DIR, then the new ones " \
+            "as they land, until SIGINT or SIGTERM\n" \
+            "\t--listen SOCKET\tAnswer requests on a Unix socket with " \
+            "-j workers, until SIGINT or SIGTERM\n" \
+            "\t--tar ARCHIVE\tFilter the JPEG images of a tar archive " \
+            "(- for stdin) to stdout\n" \
+            "\t-\tFilter a JPEG image from stdin to stdout\n" \
             "\n",
-            p);
+            p, SYNC_BATCH_FILES);
     exit(1);
 }
 
@@ -438,8 +1567,23 @@ int main(int argc, char *argv[])
     if (argc <= 1)
         usage(argv[0]);
 
+    static const struct option longopts[] = {
+        { "seed", required_argument, NULL, 's' },
+        { "cache", required_argument, NULL, 'c' },
+        { "sync", required_argument, NULL, 'S' },
+        { "stats", optional_argument, NULL, 'T' },
+        { "watch", required_argument, NULL, 'W' },
+        { "listen", required_argument, NULL, 'L' },
+        { "tar", required_argument, NULL, 'A' },
+        { NULL, 0, NULL, 0 }
+    };
+    bool seeded = false, stats_json = false;
+    uint64_t seed = 0;
+    char *end, *cache_path = NULL;
+
     int ch = 0;
-    while ((ch = getopt(argc, argv, "vhndiRf")) != -1) {
+    while ((ch = getopt_long(argc, argv, "vhndiRfj:us:", longopts,
+                    NULL)) != -1) {
         switch (ch) {
             case 'v':
                 verbose = true;
@@ -459,6 +1603,48 @@ int main(int argc, char *argv[])
             case 'f':
                 test_file_magic = true;
                 break;
+            case 'j':
+                if (!parse_jobs(optarg))
+                    usage(argv[0]);
+                break;
+            case 'u':
+                use_uring = true;
+                break;
+            case 's':
+                seed = strtoull(optarg, &end, 0);
+                if (end == optarg || *end != '\0')
+                    usage(argv[0]);
+                seeded = true;
+                break;
+            case 'c':
+                cache_path = optarg;
+                break;
+            case 'S':
+                if (strcmp(optarg, "none") == 0)
+                    sync_mode = SYNC_NONE;
+                else if (strcmp(optarg, "file") == 0)
+                    sync_mode = SYNC_FILE;
+                else if (strcmp(optarg, "batch") == 0)
+                    sync_mode = SYNC_BATCH;
+                else
+                    usage(argv[0]);
+                break;
+            case 'T':
+                if (optarg != NULL && strcmp(optarg, "json") == 0)
+                    stats_json = true;
+                else if (optarg != NULL && strcmp(optarg, "table") != 0)
+                    usage(argv[0]);
+                stats_enabled = true;
+                break;
+            case 'W':
+                watch_dir = optarg;
+                break;
+            case 'L':
+                listen_path = optarg;
+                break;
+            case 'A':
+                tar_path = optarg;
+                break;
             case 'h':
             default:
                 usage(argv[0]);
@@ -467,6 +1653,19 @@ int main(int argc, char *argv[])
     
     argc-=optind;
     argv+=optind; 
+
+    /* filtering stdin or an archive: the image goes to stdout, everything
+     * else that would be printed there goes to stderr */
+    int out_fd = -1;
+    if ((argc == 1 && strcmp(argv[0], "-") == 0 && watch_dir == NULL &&
+            listen_path == NULL) || tar_path != NULL) {
+        fflush(stdout);
+        if ((out_fd = dup(STDOUT_FILENO)) == -1 ||
+                dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+            perror("dup");
+            return 1;
+        }
+    }
     
     if (jpeg_create_new &&
             ( delete_gps_data || identify_gps_data ))
@@ -477,14 +1676,98 @@ int main(int argc, char *argv[])
         usage(argv[0]);
     }
     
-    if (argc == 0)
+    if (listen_path != NULL && (identify_gps_data || watch_dir != NULL)) {
+        printf("--listen can't be used with -i or --watch.\n");
+        usage(argv[0]);
+    }
+
+    if (tar_path != NULL && (identify_gps_data || jpeg_create_new ||
+                watch_dir != NULL || listen_path != NULL || argc > 0)) {
+        printf("--tar can't be used with -i, -n, --watch, --listen or "
+                "files.\n");
+        usage(argv[0]);
+    }
+
+    if (argc == 0 && watch_dir == NULL && listen_path == NULL &&
+            tar_path == NULL)
         usage(argv[0]);
 
     /* start */
-    srand(time(NULL));
-    
+    randgps_options_init(&options);
+    options.delete_gps = delete_gps_data;
+    if (seeded) {
+        options.seed = seed;
+        options.time_max = SEEDED_TIME_MAX;
+    }
+    if (verbose)
+        options.entry = dump_entry;
+
+    if (cache_path != NULL && out_fd == -1 &&
+            (cache = cache_open(cache_path)) == NULL) {
+        _perror(ERROR, "Couldn't load the cache '%s': %s", cache_path,
+                strerror(errno));
+        return 1;
+    }
+    /* the files written while watching get events too, they're told
+     * apart by what was recorded of them */
+    if (watch_dir != NULL && cache == NULL &&
+            (cache = cache_open(NULL)) == NULL) {
+        _perror(ERROR, "Couldn't allocate the cache");
+        return 1;
+    }
+
+    if (out_fd != -1) {
+        struct worker filter_worker;
+        bool ok;
+
+        memset(&filter_worker, 0, sizeof(filter_worker));
+        if (tar_path != NULL)
+            ok = filter_tar(tar_path, out_fd);
+        else
+            ok = filter_stream(STDIN_FILENO, out_fd, &filter_worker);
+        if (stats_enabled)
+            stats_print(stderr, stats_json);
+        return ok ? 0 : 1;
+    }
+
+    unsigned int n_workers = jobs[STAGE_READ] + jobs[STAGE_TRANSFORM] +
+        jobs[STAGE_WRITE];
+    struct queue queues[STAGE_COUNT];
+    struct worker *workers = NULL, main_worker;
+    struct walk_ops watch_ops = { watch_file, walk_error, &main_worker };
+    struct server_ops server_ops = { serve_requests, serve_release, NULL };
+    struct watch *watch = NULL;
+    struct server *server = NULL;
+
+    memset(&main_worker, 0, sizeof(main_worker));
+    /* before the workers start, they mustn't take the signals */
+    if (watch_dir != NULL &&
+            (watch = watch_new(watch_dir, WATCH_DELAY_MS, &watch_ops)) ==
+            NULL) {
+        _perror(ERROR, "Can't watch '%s': %s", watch_dir, strerror(errno));
+        return 1;
+    }
+    if (listen_path != NULL &&
+            (server = server_new(listen_path, &server_ops)) == NULL) {
+        _perror(ERROR, "Can't listen on '%s': %s", listen_path,
+                strerror(errno));
+        return 1;
+    }
+    /* batching needs the pipeline, even with a worker per stage. the
+     * server has workers of its own, files given along with --listen are
+     * done in this thread before it starts */
+    if ((n_workers > STAGE_COUNT || use_uring) && server == NULL &&
+            (workers = start_pipeline(queues, n_workers)) == NULL) {
+        _perror(ERROR, "Couldn't allocate %u workers", n_workers);
+        return 1;
+    }
+
     for (int i = 0; i < argc; i++) {
         struct stat st;
+        if (strcmp(argv[i], "-") == 0) {
+            _perror(ERROR, "'-' can't be given along with other files.");
+            continue;
+        }
         if ((stat(argv[i], &st)) == -1) {
             _perror (ERROR, "stat(2) returned -1.");
             continue;
@@ -493,16 +1776,52 @@ int main(int argc, char *argv[])
         if ((st.st_mode & S_IFMT) == S_IFDIR) {
             /* argv is a dir */
             if (recursive)
-                process_dir(argv[i]);
+                process_dir(argv[i], &main_worker);
             else 
                 _perror(INFO,
                         "Not processing %s because -R was not specified.",
                         argv[i]);
         } else {
             /* argv is a file */
-            process_file(argv[i]);
+            dispatch_file(argv[i], &main_worker);
         }
     }
 
+    if (watch != NULL) {
+        if (watch_run(watch) == -1)
+            _perror(ERROR, "Watching '%s' failed: %s", watch_dir,
+                    strerror(errno));
+        watch_free(watch);
+    }
+
+    if (server != NULL) {
+        if (server_run(server, jobs[STAGE_READ]) == -1)
+            _perror(ERROR, "Serving on '%s' failed: %s", listen_path,
+                    strerror(errno));
+        server_free(server);
+    }
+
+    if (workers != NULL) {
+        queue_close(queue);
+        for (unsigned int i = 0; i < n_workers; i++)
+            pthread_join(workers[i].thread, NULL);
+        for (int i = 0; i < STAGE_COUNT; i++)
+            queue_destroy(&queues[i]);
+        free(workers);
+    }
+
+    if (sync_mode == SYNC_BATCH)
+        sync_batch();
+
+    if (cache != NULL) {
+        if (cache_save(cache) == -1)
+            _perror(ERROR, "Couldn't save the cache '%s': %s", cache_path,
+                    strerror(errno));
+        cache_free(cache);
+    }
+
+    if (stats_enabled)
+        stats_print(stderr, stats_json);
+
     return 0;
 }
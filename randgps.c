@@ -0,0 +1,566 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <libexif/exif-data.h>
+
+#include "libjpeg/jpeg-gps.h"
+
+#include "randgps.h"
+#include "rng.h"
+
+/* the GPS entries of an image found in the schema, by tag */
+struct image_gps_exif {
+    ExifEntry *entries[JPEG_GPS_MAX_ENTRIES];
+    /* too small or of the wrong format to be randomized in place */
+    uint32_t bad;
+    /* of the TIFF header, the values are written in it */
+    ExifByteOrder order;
+};
+
+/* what randomizing does to a GPS entry. -d removes all but GPS_IGNORE */
+enum gps_policy {
+    /* not in the schema */
+    GPS_IGNORE = 0,
+    /* left as it is, e.g. the unit of a value */
+    GPS_KEEP,
+    /* a new random value of the same type */
+    GPS_RANDOMIZE,
+    /* free text that can name the place, zeroed */
+    GPS_BLANK
+};
+
+struct gps_tag {
+    const char *name;
+    /* 0 for any */
+    ExifFormat format;
+    /* bytes written by the randomizer */
+    unsigned int size;
+    enum gps_policy policy;
+};
+
+/* every GPS tag handled, indexed by tag, so that the GPS IFD is walked
+ * once whatever the number of tags in here */
+static const struct gps_tag gps_schema[JPEG_GPS_MAX_ENTRIES] = {
+    [EXIF_TAG_GPS_LATITUDE_REF] =
+        { "latitude reference", EXIF_FORMAT_ASCII, 2, GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_LATITUDE] =
+        { "latitude", EXIF_FORMAT_RATIONAL, 24, GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_LONGITUDE_REF] =
+        { "longitude reference", EXIF_FORMAT_ASCII, 2, GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_LONGITUDE] =
+        { "longitude", EXIF_FORMAT_RATIONAL, 24, GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_ALTITUDE_REF] =
+        { "altitude reference", EXIF_FORMAT_BYTE, 1, GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_ALTITUDE] =
+        { "altitude", EXIF_FORMAT_RATIONAL, 8, GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_TIME_STAMP] =
+        { "timestamp", EXIF_FORMAT_RATIONAL, 24, GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_SPEED_REF] = { "speed reference", 0, 0, GPS_KEEP },
+    [EXIF_TAG_GPS_SPEED] =
+        { "speed", EXIF_FORMAT_RATIONAL, 8, GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_TRACK_REF] = { "track reference", 0, 0, GPS_KEEP },
+    [EXIF_TAG_GPS_TRACK] =
+        { "track", EXIF_FORMAT_RATIONAL, 8, GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_IMG_DIRECTION_REF] =
+        { "image direction reference", 0, 0, GPS_KEEP },
+    [EXIF_TAG_GPS_IMG_DIRECTION] =
+        { "image direction", EXIF_FORMAT_RATIONAL, 8, GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_DEST_LATITUDE_REF] =
+        { "destination latitude reference", EXIF_FORMAT_ASCII, 2,
+            GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_DEST_LATITUDE] =
+        { "destination latitude", EXIF_FORMAT_RATIONAL, 24, GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_DEST_LONGITUDE_REF] =
+        { "destination longitude reference", EXIF_FORMAT_ASCII, 2,
+            GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_DEST_LONGITUDE] =
+        { "destination longitude", EXIF_FORMAT_RATIONAL, 24,
+            GPS_RANDOMIZE },
+    [EXIF_TAG_GPS_PROCESSING_METHOD] =
+        { "processing method", 0, 0, GPS_BLANK },
+    [EXIF_TAG_GPS_AREA_INFORMATION] =
+        { "area information", 0, 0, GPS_BLANK },
+    [EXIF_TAG_GPS_DATE_STAMP] =
+        { "datestamp", EXIF_FORMAT_ASCII, 10, GPS_RANDOMIZE },
+};
+
+/* the schema entry of t, NULL if it's not in there */
+static inline const struct gps_tag *gps_tag_of(ExifTag t)
+{
+    if ((unsigned int)t >= JPEG_GPS_MAX_ENTRIES ||
+            gps_schema[t].policy == GPS_IGNORE)
+        return NULL;
+    return &gps_schema[t];
+}
+
+/* images whose values are drawn at once by randgps_scrub() */
+#define RANDGPS_BATCH 64
+
+/* Latitude references */
+#define LATITUDE_REF_N "N"
+#define LATITUDE_REF_S "S"
+/* Longitude references */
+#define LONGITUDE_REF_E "E"
+#define LONGITUDE_REF_W "W"
+
+/* write the n rationals r[0]/r[1], r[2]/r[3]... to d. there's one copy
+ * per byte order, picked once per file, so no value is tested for it. */
+#define DEFINE_PUT_RATIONALS(name, b0, b1, b2, b3)                      \
+static inline void name(unsigned char *d, const uint32_t *r,            \
+        unsigned int n)                                                 \
+{                                                                       \
+    unsigned int i;                                                     \
+                                                                        \
+    for (i = 0; i < 2 * n; i++, d += 4) {                               \
+        d[b0] = r[i] >> 24;                                             \
+        d[b1] = r[i] >> 16;                                             \
+        d[b2] = r[i] >> 8;                                              \
+        d[b3] = r[i];                                                   \
+    }                                                                   \
+}
+
+DEFINE_PUT_RATIONALS(put_rationals_mm, 0, 1, 2, 3)
+DEFINE_PUT_RATIONALS(put_rationals_ii, 3, 2, 1, 0)
+
+typedef void (*put_rationals_fn)(unsigned char *, const uint32_t *,
+        unsigned int);
+
+/* a new value for the entry of tag t */
+static inline void randomize_entry(ExifTag t, ExifEntry *e,
+        const struct gps_values *v, const struct tm *tm, put_rationals_fn put)
+{
+    /* degrees, minutes and tenths of second */
+    const uint32_t la[6] = {
+        v->latitude[0], 1, v->latitude[1], 1, v->latitude[2], 10
+    };
+    const uint32_t lo[6] = {
+        v->longitude[0], 1, v->longitude[1], 1, v->longitude[2], 10
+    };
+    const uint32_t dla[6] = {
+        v->dest_latitude[0], 1, v->dest_latitude[1], 1,
+        v->dest_latitude[2], 10
+    };
+    const uint32_t dlo[6] = {
+        v->dest_longitude[0], 1, v->dest_longitude[1], 1,
+        v->dest_longitude[2], 10
+    };
+    const uint32_t ts[6] = { tm->tm_hour, 1, tm->tm_min, 1, tm->tm_sec, 1 };
+    uint32_t r[2];
+    char d[11];
+
+    switch (t) {
+        case EXIF_TAG_GPS_LATITUDE_REF:
+            memcpy(e->data, v->latitude_ref ? LATITUDE_REF_S :
+                    LATITUDE_REF_N, 2);
+            break;
+        case EXIF_TAG_GPS_LATITUDE:
+            put(e->data, la, 3);
+            break;
+        case EXIF_TAG_GPS_LONGITUDE_REF:
+            memcpy(e->data, v->longitude_ref ? LONGITUDE_REF_W :
+                    LONGITUDE_REF_E, 2);
+            break;
+        case EXIF_TAG_GPS_LONGITUDE:
+            put(e->data, lo, 3);
+            break;
+        case EXIF_TAG_GPS_ALTITUDE_REF:
+            /* above sea level */
+            e->data[0] = 0;
+            break;
+        case EXIF_TAG_GPS_ALTITUDE:
+            r[0] = v->altitude;
+            r[1] = 1;
+            put(e->data, r, 1);
+            break;
+        case EXIF_TAG_GPS_TIME_STAMP:
+            put(e->data, ts, 3);
+            break;
+        case EXIF_TAG_GPS_SPEED:
+            r[0] = v->speed;
+            r[1] = 10;
+            put(e->data, r, 1);
+            break;
+        case EXIF_TAG_GPS_TRACK:
+            r[0] = v->track;
+            r[1] = 100;
+            put(e->data, r, 1);
+            break;
+        case EXIF_TAG_GPS_IMG_DIRECTION:
+            r[0] = v->img_direction;
+            r[1] = 100;
+            put(e->data, r, 1);
+            break;
+        case EXIF_TAG_GPS_DEST_LATITUDE_REF:
+            memcpy(e->data, v->dest_latitude_ref ? LATITUDE_REF_S :
+                    LATITUDE_REF_N, 2);
+            break;
+        case EXIF_TAG_GPS_DEST_LATITUDE:
+            put(e->data, dla, 3);
+            break;
+        case EXIF_TAG_GPS_DEST_LONGITUDE_REF:
+            memcpy(e->data, v->dest_longitude_ref ? LONGITUDE_REF_W :
+                    LONGITUDE_REF_E, 2);
+            break;
+        case EXIF_TAG_GPS_DEST_LONGITUDE:
+            put(e->data, dlo, 3);
+            break;
+        case EXIF_TAG_GPS_DATE_STAMP:
+#define GPS_DATESTAMP_FMT "%Y:%m:%d"
+            strftime(d, sizeof(d), GPS_DATESTAMP_FMT, tm);
+            memcpy(e->data, d, strlen(d));
+            break;
+        default:
+            if (gps_schema[t].policy == GPS_BLANK)
+                memset(e->data, 0, e->size);
+            break;
+    }
+}
+
+/* randomize every entry found, except the ones left as they are */
+static inline void randomize_entries(struct image_gps_exif *g,
+        const struct gps_values *v, const struct tm *tm, put_rationals_fn put)
+{
+    unsigned int t;
+
+    for (t = 0; t < JPEG_GPS_MAX_ENTRIES; t++)
+        if (g->entries[t] != NULL && gps_schema[t].policy != GPS_KEEP &&
+                !(g->bad & JPEG_GPS_TAG_BIT(t)))
+            randomize_entry(t, g->entries[t], v, tm, put);
+}
+
+/* randomize everything with the values drawn for the image */
+static void randomize_all(const struct randgps_options *o,
+        struct image_gps_exif *g, const struct gps_values *v)
+{
+    struct tm tm;
+    unsigned int t;
+
+    if (o->entry != NULL)
+        for (t = 0; t < JPEG_GPS_MAX_ENTRIES; t++)
+            if (g->entries[t] != NULL)
+                o->entry(t, g->entries[t]->data, g->entries[t]->size,
+                        o->arg);
+
+    gmtime_r(&v->time, &tm);
+    /* each call gets its own copy of the encoder inlined */
+    if (g->order == EXIF_BYTE_ORDER_MOTOROLA)
+        randomize_entries(g, v, &tm, put_rationals_mm);
+    else
+        randomize_entries(g, v, &tm, put_rationals_ii);
+}
+
+static void draw_values(const struct randgps_options *o,
+        struct gps_values *v, uint64_t stream)
+{
+    gps_values_fill(v, &stream, 1, o->seed, o->time_max);
+}
+
+/* the GPS entries of the schema, in a single pass over the GPS IFD */
+static void get_gps_entries(struct image_gps_exif *g, ExifContent *c)
+{
+    const struct gps_tag *s;
+    unsigned int i;
+    ExifEntry *e;
+
+    memset(g->entries, 0, sizeof(g->entries));
+    g->bad = 0;
+    for (i = 0; c != NULL && i < c->count; i++) {
+        e = c->entries[i];
+        if ((s = gps_tag_of(e->tag)) == NULL)
+            continue;
+        g->entries[e->tag] = e;
+        if (s->format != 0 && (e->format != s->format || e->size < s->size))
+            g->bad |= JPEG_GPS_TAG_BIT(e->tag);
+    }
+}
+
+/* views of the values of the GPS entries of the schema inside the APP1
+ * bytes, in a single pass over the GPS IFD. returns false if one of them
+ * is too small or of the wrong format for what the randomizers write. */
+static bool get_gps_views(struct image_gps_exif *g, ExifEntry *views,
+        JPEGGpsInfo *info, unsigned char *app1)
+{
+    const struct gps_tag *s;
+    JPEGGpsEntry *e;
+    ExifEntry *view;
+    unsigned int i;
+
+    memset(g->entries, 0, sizeof(g->entries));
+    g->bad = 0;
+    g->order = info->order;
+    for (i = 0; i < info->count; i++) {
+        e = &info->entries[i];
+        if ((s = gps_tag_of(e->tag)) == NULL || s->policy == GPS_KEEP)
+            continue;
+        if (s->format != 0 && (e->format != s->format || e->size < s->size))
+            return false;
+
+        view = &views[e->tag];
+        memset(view, 0, sizeof(ExifEntry));
+        view->tag = e->tag;
+        view->format = e->format;
+        view->components = e->components;
+        view->data = app1 + e->offset;
+        view->size = e->size;
+        g->entries[e->tag] = view;
+    }
+    return true;
+}
+
+static int app1_scrub(const struct randgps_options *o, unsigned char *app1,
+        unsigned int size, JPEGGpsInfo *info, const struct gps_values *v,
+        struct randgps_range *changed, unsigned int *n_changed)
+{
+    ExifEntry views[JPEG_GPS_MAX_ENTRIES];
+    struct image_gps_exif g;
+    unsigned int start, end, t;
+    uint32_t tags = 0;
+    int n = 0;
+
+    *n_changed = 0;
+    if (info->count == 0)
+        return 0;
+
+    if (o->delete_gps) {
+        for (t = 0; t < JPEG_GPS_MAX_ENTRIES; t++)
+            if (gps_tag_of(t) != NULL)
+                tags |= JPEG_GPS_TAG_BIT(t);
+        if ((n = jpeg_gps_remove(info, app1, size, tags, &start,
+                        &end)) == -1)
+            return -2;
+        /* a single range covers the GPS IFD and the values zeroed */
+        if (n > 0) {
+            changed[0].offset = start;
+            changed[0].size = end - start;
+            *n_changed = 1;
+        }
+        return n;
+    }
+
+    if (!get_gps_views(&g, views, info, app1))
+        return -2;
+    randomize_all(o, &g, v);
+    for (t = 0; t < JPEG_GPS_MAX_ENTRIES; t++)
+        if (g.entries[t] != NULL) {
+            changed[n].offset = g.entries[t]->data - app1;
+            changed[n++].size = g.entries[t]->size;
+        }
+    *n_changed = n;
+    return n;
+}
+
+static uint32_t exif_scrub(const struct randgps_options *o, ExifData *d,
+        const struct gps_values *v, uint32_t *dropped)
+{
+    struct image_gps_exif g;
+    uint32_t found = 0;
+    unsigned int t;
+
+    get_gps_entries(&g, d->ifd[EXIF_IFD_GPS]);
+    g.order = exif_data_get_byte_order(d);
+    for (t = 0; t < JPEG_GPS_MAX_ENTRIES; t++)
+        if (g.entries[t] != NULL)
+            found |= JPEG_GPS_TAG_BIT(t);
+    if (dropped != NULL)
+        *dropped = 0;
+
+    if (o->delete_gps) {
+        for (t = 0; t < JPEG_GPS_MAX_ENTRIES; t++)
+            if (g.entries[t] != NULL)
+                exif_content_remove_entry(g.entries[t]->parent,
+                        g.entries[t]);
+        return found;
+    }
+
+    randomize_all(o, &g, v);
+    /* what can't be randomized doesn't stay either */
+    for (t = 0; t < JPEG_GPS_MAX_ENTRIES; t++)
+        if (g.bad & JPEG_GPS_TAG_BIT(t)) {
+            exif_content_remove_entry(g.entries[t]->parent, g.entries[t]);
+            if (dropped != NULL)
+                *dropped |= JPEG_GPS_TAG_BIT(t);
+        }
+    return found;
+}
+
+/* the APP1 payload of out, at off for len bytes, saved by libexif */
+static enum randgps_status exif_rewrite(const struct randgps_options *o,
+        struct randgps_output *out, unsigned int off, unsigned int len,
+        const struct gps_values *v)
+{
+    enum randgps_status status = RANDGPS_OK;
+    ExifMem *mem;
+    ExifData *ed;
+    unsigned char *d = NULL;
+    unsigned int ds = 0;
+    size_t size;
+
+    if ((mem = exif_mem_new_default()) == NULL)
+        return RANDGPS_ERR_ALLOC;
+    if ((ed = exif_data_new_mem(mem)) == NULL) {
+        exif_mem_unref(mem);
+        return RANDGPS_ERR_ALLOC;
+    }
+    exif_data_load_data(ed, out->data + off, len);
+    exif_scrub(o, ed, v, NULL);
+    exif_data_save_data(ed, &d, &ds);
+    exif_data_unref(ed);
+
+    size = out->size - len + ds;
+    if (d == NULL || ds + 2 > 0xffff)
+        status = RANDGPS_ERR_IMAGE;
+    else if (size > out->capacity) {
+        status = RANDGPS_ERR_SPACE;
+        out->size = size;
+    } else {
+        memmove(out->data + off + ds, out->data + off + len,
+                out->size - off - len);
+        memcpy(out->data + off, d, ds);
+        /* the segment length, in front of the payload */
+        out->data[off - 2] = (ds + 2) >> 8;
+        out->data[off - 1] = (ds + 2) & 0xff;
+        out->size = size;
+    }
+    exif_mem_free(mem, d);
+    exif_mem_unref(mem);
+    return status;
+}
+
+void randgps_options_init(struct randgps_options *o)
+{
+    struct timespec ts;
+
+    memset(o, 0, sizeof(*o));
+    clock_gettime(CLOCK_REALTIME, &ts);
+    o->time_max = ts.tv_sec;
+    o->seed = ((uint64_t)ts.tv_sec << 32) ^ ((uint64_t)getpid() << 16) ^
+        (uint64_t)ts.tv_nsec ^ (uint64_t)clock();
+}
+
+size_t randgps_scrub(const struct randgps_options *o,
+        const struct randgps_input *in, struct randgps_output *out, size_t n)
+{
+    struct gps_values v[RANDGPS_BATCH];
+    uint64_t streams[RANDGPS_BATCH];
+    unsigned int off[RANDGPS_BATCH], len[RANDGPS_BATCH];
+    struct randgps_range changed[RANDGPS_MAX_RANGES];
+    unsigned int k, m, n_changed;
+    JPEGGpsInfo info;
+    size_t i, done = 0;
+    int r;
+
+    for (i = 0; i < n; i += m) {
+        m = (n - i < RANDGPS_BATCH ? n - i : RANDGPS_BATCH);
+
+        /* where the EXIF data is, and the stream of every image */
+        for (k = 0; k < m; k++) {
+            const struct randgps_input *src = &in[i + k];
+            struct randgps_output *dst = &out[i + k];
+
+            len[k] = 0;
+            streams[k] = 0;
+            dst->status = RANDGPS_OK;
+            dst->size = src->size;
+            if (src->size < 2 || src->data[0] != 0xff ||
+                    src->data[1] != 0xd8 || src->size > UINT32_MAX) {
+                dst->status = RANDGPS_ERR_IMAGE;
+                continue;
+            }
+            if (dst->capacity < src->size) {
+                dst->status = RANDGPS_ERR_SPACE;
+                continue;
+            }
+            if (dst->data != src->data)
+                memcpy(dst->data, src->data, src->size);
+
+            r = jpeg_gps_find_app1_data(dst->data, dst->size, &off[k],
+                    &len[k]);
+            if (r == -1)
+                dst->status = RANDGPS_ERR_IMAGE;
+            if (r != 1) {
+                len[k] = 0;
+                continue;
+            }
+            streams[k] = src->name != NULL ? rng_hash(src->name) :
+                rng_hash_data(dst->data + off[k], len[k]);
+        }
+
+        /* the values of the whole batch at once */
+        if (!o->delete_gps)
+            gps_values_fill(v, streams, m, o->seed, o->time_max);
+
+        for (k = 0; k < m; k++) {
+            struct randgps_output *dst = &out[i + k];
+
+            if (len[k] == 0) {
+                done += dst->status == RANDGPS_OK;
+                continue;
+            }
+            r = -1;
+            if (jpeg_gps_parse(&info, dst->data + off[k], len[k]))
+                r = app1_scrub(o, dst->data + off[k], len[k], &info, &v[k],
+                        changed, &n_changed);
+            /* the layout has to change, go through libexif */
+            if (r < 0)
+                dst->status = exif_rewrite(o, dst, off[k], len[k], &v[k]);
+            done += dst->status == RANDGPS_OK;
+        }
+    }
+    return done;
+}
+
+int randgps_app1(const struct randgps_options *o, unsigned char *app1,
+        unsigned int size, uint64_t stream, struct randgps_range *changed,
+        unsigned int *n_changed)
+{
+    JPEGGpsInfo info;
+
+    *n_changed = 0;
+    if (!randgps_app1_parse(app1, size, &info))
+        return -1;
+    return randgps_app1_apply(o, app1, size, &info, stream, changed,
+            n_changed);
+}
+
+bool randgps_app1_parse(const unsigned char *app1, unsigned int size,
+        JPEGGpsInfo *info)
+{
+    return jpeg_gps_parse(info, app1, size);
+}
+
+int randgps_app1_apply(const struct randgps_options *o, unsigned char *app1,
+        unsigned int size, JPEGGpsInfo *info, uint64_t stream,
+        struct randgps_range *changed, unsigned int *n_changed)
+{
+    struct gps_values v;
+
+    /* deleting draws nothing */
+    if (!o->delete_gps)
+        draw_values(o, &v, stream);
+    return app1_scrub(o, app1, size, info, &v, changed, n_changed);
+}
+
+uint32_t randgps_exif(const struct randgps_options *o, ExifData *d,
+        uint64_t stream, uint32_t *dropped)
+{
+    struct gps_values v;
+
+    if (!o->delete_gps)
+        draw_values(o, &v, stream);
+    return exif_scrub(o, d, &v, dropped);
+}
+
+uint64_t randgps_stream(const char *s)
+{
+    return rng_hash(s);
+}
+
+const char *randgps_tag_name(ExifTag t)
+{
+    const struct gps_tag *s = gps_tag_of(t);
+
+    return (s != NULL && s->policy == GPS_RANDOMIZE) ? s->name : NULL;
+}
@@ -0,0 +1,119 @@
+#ifndef __RANDGPS_H__
+#define __RANDGPS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <libexif/exif-data.h>
+
+#include "libjpeg/jpeg-gps.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* librandgps: the GPS data of JPEG images randomized or removed in memory
+ *
+ * nothing in here touches the filesystem or keeps any state between
+ * calls, what a call does only depends on its options and arguments, so
+ * any number of threads can use it at once. the values written into an
+ * image are drawn from a stream of random numbers of its own, named by
+ * the caller (rand_gps_exif uses the path) or derived from its EXIF data.
+ */
+
+struct randgps_options {
+    /* remove the GPS entries instead of randomizing them */
+    bool delete_gps;
+    uint64_t seed;
+    /* dates are drawn from [1970, time_max) */
+    time_t time_max;
+    /* called with every GPS entry before it's randomized, can be NULL */
+    void (*entry)(ExifTag tag, const unsigned char *d, unsigned int size,
+            void *arg);
+    void *arg;
+};
+
+/* randomizing, dates up to now, and a seed different every call */
+void randgps_options_init(struct randgps_options *o);
+
+enum randgps_status {
+    RANDGPS_OK = 0,
+    /* not a JPEG image, or EXIF data that couldn't be parsed or saved */
+    RANDGPS_ERR_IMAGE,
+    /* the output is too small, its size says how much is needed */
+    RANDGPS_ERR_SPACE,
+    RANDGPS_ERR_ALLOC
+};
+
+struct randgps_input {
+    const unsigned char *data;
+    size_t size;
+    /* of the stream of values, NULL to derive it from the EXIF data */
+    const char *name;
+};
+
+struct randgps_output {
+    /* can be the data of the input, rewritten in place then */
+    unsigned char *data;
+    size_t capacity;
+    /* set by randgps_scrub() */
+    size_t size;
+    enum randgps_status status;
+};
+
+/* rewrite in[i] into out[i], for n images, and tell how many were. an
+ * output as large as its input is enough, unless the layout of the EXIF
+ * data doesn't allow changing it in place and libexif saves it larger.
+ * images without EXIF or GPS data are copied as they are. */
+size_t randgps_scrub(const struct randgps_options *o,
+        const struct randgps_input *in, struct randgps_output *out, size_t n);
+
+/* the same on the EXIF APP1 payload of an image ("Exif\0\0" on), for
+ * callers doing their own I/O */
+
+/* bytes of the payload changed by randgps_app1() */
+struct randgps_range {
+    unsigned int offset;
+    unsigned int size;
+};
+#define RANDGPS_MAX_RANGES 32
+
+/* randomize or remove the GPS entries without moving anything else in
+ * the payload, and set changed[*n_changed] to the ranges of bytes that
+ * were. returns the number of entries randomized or removed, -1 if the
+ * payload can't be parsed, and -2 if its layout needs randgps_exif() */
+int randgps_app1(const struct randgps_options *o, unsigned char *app1,
+        unsigned int size, uint64_t stream, struct randgps_range *changed,
+        unsigned int *n_changed);
+
+/* randgps_app1() in two steps, for callers timing them apart: the GPS
+ * IFD of the payload parsed into *info, false if it can't be, then its
+ * entries randomized or removed, which returns what randgps_app1() does
+ * past the parsing */
+bool randgps_app1_parse(const unsigned char *app1, unsigned int size,
+        JPEGGpsInfo *info);
+int randgps_app1_apply(const struct randgps_options *o, unsigned char *app1,
+        unsigned int size, JPEGGpsInfo *info, uint64_t stream,
+        struct randgps_range *changed, unsigned int *n_changed);
+
+/* bit of a GPS tag in the sets below */
+#define RANDGPS_TAG_BIT(t) ((uint32_t) 1 << (t))
+
+/* same on libexif's tree. entries that can't be randomized are removed,
+ * and go to *dropped unless it's NULL. returns the set of the GPS tags
+ * handled that were found */
+uint32_t randgps_exif(const struct randgps_options *o, ExifData *d,
+        uint64_t stream, uint32_t *dropped);
+
+/* the stream of values named s */
+uint64_t randgps_stream(const char *s);
+/* name of a tag that is randomized, NULL for the others */
+const char *randgps_tag_name(ExifTag t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
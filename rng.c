@@ -0,0 +1,137 @@
+#include "rng.h"
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+static uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static void philox4x32_10(const uint32_t ctr[4], const uint32_t key[2],
+        uint32_t out[4])
+{
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    uint64_t p0, p1;
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        p0 = (uint64_t)PHILOX_M0 * c0;
+        p1 = (uint64_t)PHILOX_M1 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+void rng_init(struct rng *r, uint64_t seed, uint64_t stream)
+{
+    uint64_t k = splitmix64(seed ^ splitmix64(stream));
+
+    r->key[0] = (uint32_t)k;
+    r->key[1] = (uint32_t)(k >> 32);
+    r->ctr[0] = r->ctr[1] = r->ctr[2] = r->ctr[3] = 0;
+    r->left = 0;
+}
+
+uint32_t rng_next(struct rng *r)
+{
+    if (r->left == 0) {
+        philox4x32_10(r->ctr, r->key, r->out);
+        if (++r->ctr[0] == 0)
+            ++r->ctr[1];
+        r->left = 4;
+    }
+    return r->out[--r->left];
+}
+
+uint32_t rng_uniform(struct rng *r, uint32_t n)
+{
+    /* Lemire's multiply and reject */
+    uint64_t m = (uint64_t)rng_next(r) * n;
+    uint32_t low = (uint32_t)m, t;
+
+    if (low < n) {
+        t = -n % n;
+        while (low < t) {
+            m = (uint64_t)rng_next(r) * n;
+            low = (uint32_t)m;
+        }
+    }
+    return (uint32_t)(m >> 32);
+}
+
+uint64_t rng_hash(const char *s)
+{
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+uint64_t rng_hash_data(const unsigned char *d, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    while (size-- > 0) {
+        h ^= *d++;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+void gps_values_fill(struct gps_values *v, const uint64_t *streams,
+        size_t n, uint64_t seed, time_t time_max)
+{
+    struct rng r;
+    uint64_t t;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        rng_init(&r, seed, streams[i]);
+
+        v[i].latitude[0] = rng_uniform(&r, 90);
+        v[i].latitude[1] = rng_uniform(&r, 60);
+        v[i].latitude[2] = rng_uniform(&r, 600);
+        v[i].longitude[0] = rng_uniform(&r, 180);
+        v[i].longitude[1] = rng_uniform(&r, 60);
+        v[i].longitude[2] = rng_uniform(&r, 600);
+        v[i].latitude_ref = rng_uniform(&r, 2);
+        v[i].longitude_ref = v[i].latitude_ref ^ 1;
+
+        /* 64 bits so the whole range of time_t is reachable */
+        t = ((uint64_t)rng_next(&r) << 32) | rng_next(&r);
+        v[i].time = time_max > 0 ? (time_t)(t % (uint64_t)time_max) : 0;
+
+        /* drawn after the above, which stay the same for a given seed */
+        v[i].altitude = rng_uniform(&r, 4000);
+        v[i].speed = rng_uniform(&r, 1200);
+        v[i].track = rng_uniform(&r, 36000);
+        v[i].img_direction = rng_uniform(&r, 36000);
+        v[i].dest_latitude[0] = rng_uniform(&r, 90);
+        v[i].dest_latitude[1] = rng_uniform(&r, 60);
+        v[i].dest_latitude[2] = rng_uniform(&r, 600);
+        v[i].dest_longitude[0] = rng_uniform(&r, 180);
+        v[i].dest_longitude[1] = rng_uniform(&r, 60);
+        v[i].dest_longitude[2] = rng_uniform(&r, 600);
+        v[i].dest_latitude_ref = rng_uniform(&r, 2);
+        v[i].dest_longitude_ref = rng_uniform(&r, 2);
+    }
+}
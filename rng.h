@@ -0,0 +1,54 @@
+#ifndef __RNG_H__
+#define __RNG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* counter based random numbers (Philox4x32-10)
+ *
+ * the n-th output of a stream is a pure function of (key, n), so a file
+ * gets the same values whatever thread or order it's processed in, as
+ * long as its stream is derived from something stable like its path.
+ */
+
+struct rng {
+    uint32_t key[2];
+    uint32_t ctr[4];
+    uint32_t out[4];
+    unsigned int left;
+};
+
+void     rng_init(struct rng *r, uint64_t seed, uint64_t stream);
+uint32_t rng_next(struct rng *r);
+/* uniform in [0, n) without modulo bias */
+uint32_t rng_uniform(struct rng *r, uint32_t n);
+
+/* stream id of a string, e.g. a path */
+uint64_t rng_hash(const char *s);
+/* same of size bytes */
+uint64_t rng_hash_data(const unsigned char *d, size_t size);
+
+/* everything the randomizers write into a file */
+struct gps_values {
+    uint32_t latitude[3];       /* degrees, minutes, tenths of second */
+    uint32_t longitude[3];
+    uint8_t latitude_ref;       /* 0 N, 1 S */
+    uint8_t longitude_ref;      /* 0 E, 1 W */
+    time_t time;                /* GPSTimeStamp and GPSDateStamp */
+    uint32_t altitude;          /* meters above sea level */
+    uint32_t speed;             /* tenths, in the unit of GPSSpeedRef */
+    uint32_t track;             /* hundredths of degree */
+    uint32_t img_direction;     /* hundredths of degree */
+    uint32_t dest_latitude[3];  /* GPSDestLatitude... as the above */
+    uint32_t dest_longitude[3];
+    uint8_t dest_latitude_ref;
+    uint8_t dest_longitude_ref;
+};
+
+/* draw the values of n files at once, file i from stream streams[i].
+ * times are drawn from [0, time_max). */
+void gps_values_fill(struct gps_values *v, const uint64_t *streams,
+        size_t n, uint64_t seed, time_t time_max);
+
+#endif
@@ -0,0 +1,363 @@
+/* accept4(2) */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+
+#include "queue.h"
+#include "server.h"
+
+/* requests taken at once by a worker */
+#define SERVER_BATCH 32
+/* read and not handled yet, readers wait beyond that */
+#define SERVER_QUEUE 256
+/* a client that doesn't read its replies is dropped after that long */
+#define SERVER_SEND_TIMEOUT 10
+
+struct server_conn {
+    int fd;
+    struct server *server;
+    /* replies sent by different workers don't interleave */
+    pthread_mutex_t send_lock;
+    /* a reply couldn't be sent, the others are dropped */
+    bool broken;
+    /* the reader, and every request of it not answered yet */
+    atomic_uint refs;
+    /* connections being read */
+    struct server_conn *prev;
+    struct server_conn *next;
+};
+
+struct server {
+    int fd;
+    int sig;
+    sigset_t old_mask;
+    char *path;
+    const struct server_ops *ops;
+    struct queue queue;
+
+    pthread_mutex_t lock;
+    pthread_cond_t readers_done;
+    struct server_conn *conns;
+    unsigned int n_readers;
+};
+
+static void conn_put(struct server_conn *c)
+{
+    if (atomic_fetch_sub(&c->refs, 1) != 1)
+        return;
+    close(c->fd);
+    pthread_mutex_destroy(&c->send_lock);
+    free(c);
+}
+
+/* queue the requests of a connection until it's closed, or the server
+ * stops reading */
+static void *reader_main(void *arg)
+{
+    struct server_conn *c = arg;
+    struct server *s = c->server;
+    struct server_request *r;
+
+    for (;;) {
+        if ((r = calloc(1, sizeof(struct server_request))) == NULL)
+            break;
+        /* a bad frame leaves no way to find the next one */
+        if (proto_read(c->fd, &r->h, &r->payload) != 1) {
+            free(r);
+            break;
+        }
+        r->conn = c;
+        atomic_fetch_add(&c->refs, 1);
+        queue_push(&s->queue, r);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        s->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    if (--s->n_readers == 0)
+        pthread_cond_signal(&s->readers_done);
+    pthread_mutex_unlock(&s->lock);
+    /* closed once the replies are out */
+    conn_put(c);
+    return NULL;
+}
+
+/* one sendmsg(2) per connection for the replies of a batch */
+static void send_replies(struct server_request **rs, unsigned int n)
+{
+    struct iovec iov[SERVER_BATCH * (SERVER_REPLY_IOV + 1)];
+    struct proto_header hdrs[SERVER_BATCH];
+    bool sent[SERVER_BATCH] = { false };
+    struct server_conn *c;
+    struct server_request *r;
+    unsigned int i, k;
+    int m, v;
+
+    for (i = 0; i < n; i++) {
+        if (sent[i])
+            continue;
+        c = rs[i]->conn;
+        for (k = i, m = 0; k < n; k++) {
+            r = rs[k];
+            if (sent[k] || r->conn != c)
+                continue;
+            hdrs[k].magic = PROTO_MAGIC;
+            hdrs[k].version = PROTO_VERSION;
+            hdrs[k].type = r->status;
+            hdrs[k].id = r->h.id;
+            hdrs[k].length = 0;
+            iov[m].iov_base = &hdrs[k];
+            iov[m++].iov_len = sizeof(struct proto_header);
+            for (v = 0; v < r->n_iov; v++) {
+                hdrs[k].length += r->iov[v].iov_len;
+                iov[m++] = r->iov[v];
+            }
+            sent[k] = true;
+        }
+
+        pthread_mutex_lock(&c->send_lock);
+        if (!c->broken && proto_send(c->fd, iov, m) == -1) {
+            /* stops the reader as well */
+            c->broken = true;
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&c->send_lock);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct server *s = arg;
+    struct server_request *rs[SERVER_BATCH];
+    struct server_conn *c;
+    unsigned int i, n;
+
+    while ((rs[0] = queue_pop(&s->queue)) != NULL) {
+        /* take whatever else is waiting and answer it all together */
+        n = 1;
+        while (n < SERVER_BATCH && queue_try_pop(&s->queue, (void **)&rs[n]))
+            n++;
+
+        s->ops->handle(rs, n, s->ops->arg);
+        send_replies(rs, n);
+
+        for (i = 0; i < n; i++) {
+            if (s->ops->release != NULL)
+                s->ops->release(rs[i], s->ops->arg);
+            c = rs[i]->conn;
+            free(rs[i]->payload);
+            free(rs[i]);
+            conn_put(c);
+        }
+    }
+    return NULL;
+}
+
+static void accept_conn(struct server *s)
+{
+    struct timeval tv = { SERVER_SEND_TIMEOUT, 0 };
+    struct server_conn *c;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int fd;
+
+    if ((fd = accept4(s->fd, NULL, NULL, SOCK_CLOEXEC)) == -1)
+        return;
+    if ((c = calloc(1, sizeof(struct server_conn))) == NULL) {
+        close(fd);
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    c->fd = fd;
+    c->server = s;
+    pthread_mutex_init(&c->send_lock, NULL);
+    atomic_init(&c->refs, 1);
+
+    pthread_mutex_lock(&s->lock);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, reader_main, c) != 0) {
+        pthread_mutex_unlock(&s->lock);
+        pthread_attr_destroy(&attr);
+        conn_put(c);
+        return;
+    }
+    pthread_attr_destroy(&attr);
+    c->next = s->conns;
+    if (s->conns)
+        s->conns->prev = c;
+    s->conns = c;
+    s->n_readers++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* bind to path, replacing the socket of a server that's gone */
+static int bind_path(int fd, const char *path)
+{
+    struct sockaddr_un addr;
+    int probe;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        return 0;
+    if (errno != EADDRINUSE)
+        return -1;
+
+    if ((probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    if (connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0 ||
+            errno != ECONNREFUSED) {
+        close(probe);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    close(probe);
+    if (unlink(path) == -1)
+        return -1;
+    return bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+struct server *server_new(const char *path, const struct server_ops *ops)
+{
+    struct server *s;
+    sigset_t set;
+
+    if ((s = calloc(1, sizeof(struct server))) == NULL)
+        return NULL;
+    s->sig = -1;
+    s->ops = ops;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->readers_done, NULL);
+    if ((s->path = strdup(path)) == NULL)
+        goto fail;
+    if ((s->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        goto fail;
+    if (bind_path(s->fd, path) == -1)
+        goto fail_fd;
+    /* connecting takes a listening socket, nobody got in before that */
+    if (chmod(path, S_IRUSR | S_IWUSR) == -1 ||
+            listen(s->fd, SOMAXCONN) == -1)
+        goto fail_unlink;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &set, &s->old_mask) != 0)
+        goto fail_unlink;
+    if ((s->sig = signalfd(-1, &set, SFD_CLOEXEC)) == -1) {
+        pthread_sigmask(SIG_SETMASK, &s->old_mask, NULL);
+        goto fail_unlink;
+    }
+    return s;
+
+fail_unlink:
+    unlink(path);
+fail_fd:
+    close(s->fd);
+fail:
+    free(s->path);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->readers_done);
+    free(s);
+    return NULL;
+}
+
+int server_run(struct server *s, unsigned int workers)
+{
+    struct signalfd_siginfo si;
+    struct pollfd fds[2];
+    struct server_conn *c;
+    pthread_t *threads;
+    unsigned int i, n;
+    int ret = 0;
+
+    if (queue_init(&s->queue, SERVER_QUEUE) == -1)
+        return -1;
+    if ((threads = calloc(workers, sizeof(pthread_t))) == NULL) {
+        queue_destroy(&s->queue);
+        return -1;
+    }
+    for (n = 0; n < workers; n++)
+        if (pthread_create(&threads[n], NULL, worker_main, s) != 0)
+            break;
+    if (n == 0) {
+        ret = -1;
+        goto out;
+    }
+
+    fds[0].fd = s->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = s->sig;
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            ret = -1;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            /* consumed, or it'd be delivered once unblocked */
+            if (read(s->sig, &si, sizeof(si)) != sizeof(si))
+                ret = -1;
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+            accept_conn(s);
+    }
+
+    /* no more requests, answer the ones read */
+    pthread_mutex_lock(&s->lock);
+    for (c = s->conns; c != NULL; c = c->next)
+        shutdown(c->fd, SHUT_RD);
+    while (s->n_readers > 0)
+        pthread_cond_wait(&s->readers_done, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+
+out:
+    queue_close(&s->queue);
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    queue_destroy(&s->queue);
+    return ret;
+}
+
+void server_free(struct server *s)
+{
+    if (s == NULL)
+        return;
+    close(s->fd);
+    close(s->sig);
+    unlink(s->path);
+    pthread_sigmask(SIG_SETMASK, &s->old_mask, NULL);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->readers_done);
+    free(s->path);
+    free(s);
+}
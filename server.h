@@ -0,0 +1,57 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <sys/uio.h>
+
+#include "proto.h"
+
+/* requests on a Unix domain socket (--listen)
+ *
+ * a thread per connection reads its frames and queues them, a pool of
+ * workers takes whatever is waiting at once, has it handled, then sends
+ * the replies of the batch that go to the same connection together.
+ *
+ * SIGINT and SIGTERM stop it once the requests read are answered. they're
+ * blocked from server_new() on, so it must be called before any other
+ * thread is started.
+ */
+
+/* iovecs a reply can point to, besides its header */
+#define SERVER_REPLY_IOV 4
+
+struct server_conn;
+
+struct server_request {
+    struct server_conn *conn;
+    struct proto_header h;
+    /* h.length bytes, NUL terminated, can be rewritten by the handler */
+    unsigned char *payload;
+
+    /* the reply, PROTO_OK and no payload unless the handler says else */
+    enum proto_status status;
+    struct iovec iov[SERVER_REPLY_IOV];
+    int n_iov;
+    /* for the handler, given back to release() once the reply is sent */
+    void *priv;
+};
+
+struct server_ops {
+    /* fill in the replies of a batch of requests, from a worker thread */
+    void (*handle)(struct server_request **rs, unsigned int n, void *arg);
+    /* called for every handled request once its reply is sent, can be NULL */
+    void (*release)(struct server_request *r, void *arg);
+    void *arg;
+};
+
+struct server;
+
+/* listen on a new socket at path, only its owner can connect to it. NULL
+ * on failure, with errno set */
+struct server *server_new(const char *path, const struct server_ops *ops);
+/* answer requests with that many workers until a signal comes. -1 on
+ * failure */
+int  server_run(struct server *s, unsigned int workers);
+/* also removes the socket */
+void server_free(struct server *s);
+
+#endif
@@ -0,0 +1,178 @@
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "stats.h"
+
+/* 16 linear buckets, then 4 per power of two up to 2^64 ns */
+#define STATS_LINEAR 16
+#define STATS_BUCKETS (STATS_LINEAR + 60 * 4)
+
+struct stats_histogram {
+    atomic_uint_fast64_t buckets[STATS_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+};
+
+bool stats_enabled = false;
+
+static struct stats_histogram timers[STATS_TIMERS];
+static atomic_uint_fast64_t counters[STATS_COUNTERS];
+
+static const char *timer_names[STATS_TIMERS] = {
+    [STATS_WALK] = "walk",
+    [STATS_MAGIC] = "magic",
+    [STATS_READ] = "read",
+    [STATS_PARSE] = "parse",
+    [STATS_RANDOMIZE] = "randomize",
+    [STATS_TRANSFORM] = "transform",
+    [STATS_SERIALIZE] = "serialize",
+    [STATS_WRITE] = "write",
+    [STATS_FILE] = "file",
+};
+
+static const char *counter_names[STATS_COUNTERS] = {
+    [STATS_FILES] = "files",
+    [STATS_SKIPPED] = "skipped",
+    [STATS_BYTES_READ] = "bytes_read",
+    [STATS_BYTES_WRITTEN] = "bytes_written",
+    [STATS_ERR_OPEN] = "errors_open",
+    [STATS_ERR_PARSE] = "errors_parse",
+    [STATS_ERR_WRITE] = "errors_write",
+    [STATS_ERR_ALLOC] = "errors_alloc",
+};
+
+static unsigned int bucket_of(uint64_t ns)
+{
+    unsigned int e;
+
+    if (ns < STATS_LINEAR)
+        return ns;
+    e = 63 - __builtin_clzll(ns);
+    return STATS_LINEAR + (e - 4) * 4 + ((ns >> (e - 2)) & 3);
+}
+
+/* middle of the range of a bucket */
+static uint64_t bucket_value(unsigned int b)
+{
+    unsigned int e;
+    uint64_t width;
+
+    if (b < STATS_LINEAR)
+        return b;
+    e = (b - STATS_LINEAR) / 4 + 4;
+    width = (uint64_t)1 << (e - 2);
+    return ((uint64_t)1 << e) + ((b - STATS_LINEAR) % 4) * width + width / 2;
+}
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    if (!stats_enabled)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_record(enum stats_timer t, uint64_t ns)
+{
+    struct stats_histogram *h = &timers[t];
+    uint_fast64_t max;
+
+    atomic_fetch_add_explicit(&h->buckets[bucket_of(ns)], 1,
+            memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+    max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&h->max, &max,
+                ns, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+void stats_time(enum stats_timer t, uint64_t start)
+{
+    if (!stats_enabled || start == 0)
+        return;
+    stats_record(t, stats_now() - start);
+}
+
+void stats_add(enum stats_counter c, uint64_t n)
+{
+    if (stats_enabled)
+        atomic_fetch_add_explicit(&counters[c], n, memory_order_relaxed);
+}
+
+/* the p-th percentile, from the histogram */
+static uint64_t percentile(struct stats_histogram *h, uint64_t count,
+        unsigned int p)
+{
+    uint64_t rank = (count * p + 99) / 100, seen = 0;
+    unsigned int b;
+
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        seen += atomic_load(&h->buckets[b]);
+        if (seen >= rank && seen > 0)
+            return bucket_value(b);
+    }
+    return 0;
+}
+
+static void print_duration(FILE *f, uint64_t ns)
+{
+    if (ns < 1000)
+        fprintf(f, " %8lluns", (unsigned long long)ns);
+    else if (ns < 1000000)
+        fprintf(f, " %8.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        fprintf(f, " %8.2fms", ns / 1e6);
+    else
+        fprintf(f, " %8.2fs ", ns / 1e9);
+}
+
+void stats_print(FILE *f, bool json)
+{
+    static const unsigned int ps[] = { 50, 95, 99 };
+    struct stats_histogram *h;
+    uint64_t count, v[5];
+    unsigned int i, k;
+
+    fprintf(f, json ? "{\"timers\": {" :
+            "stage         count       mean        p50        p95        p99"
+            "        max\n");
+    for (i = 0; i < STATS_TIMERS; i++) {
+        h = &timers[i];
+        count = atomic_load(&h->count);
+        v[0] = count ? atomic_load(&h->sum) / count : 0;
+        v[4] = atomic_load(&h->max);
+        /* the middle of the last bucket can be past the largest value */
+        for (k = 0; k < 3; k++)
+            if ((v[k + 1] = percentile(h, count, ps[k])) > v[4])
+                v[k + 1] = v[4];
+
+        if (json) {
+            fprintf(f, "%s\"%s\": {\"count\": %llu, \"mean_ns\": %llu, "
+                    "\"p50_ns\": %llu, \"p95_ns\": %llu, \"p99_ns\": %llu, "
+                    "\"max_ns\": %llu}", i ? ", " : "", timer_names[i],
+                    (unsigned long long)count, (unsigned long long)v[0],
+                    (unsigned long long)v[1], (unsigned long long)v[2],
+                    (unsigned long long)v[3], (unsigned long long)v[4]);
+            continue;
+        }
+        if (count == 0)
+            continue;
+        fprintf(f, "%-10s %8llu  ", timer_names[i], (unsigned long long)count);
+        for (k = 0; k < 5; k++)
+            print_duration(f, v[k]);
+        fprintf(f, "\n");
+    }
+
+    fprintf(f, json ? "}, \"counters\": {" : "\n");
+    for (i = 0; i < STATS_COUNTERS; i++)
+        fprintf(f, json ? "%s\"%s\": %llu" : "%s%-14s %llu\n",
+                (json && i) ? ", " : "", counter_names[i],
+                (unsigned long long)atomic_load(&counters[i]));
+    if (json)
+        fprintf(f, "}}\n");
+}
@@ -0,0 +1,65 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* timers and counters for --stats
+ *
+ * durations go into log-linear histograms (four buckets per power of two
+ * of nanoseconds, so within 25%) updated with relaxed atomics, cheap
+ * enough to be taken around every file from any thread. nothing is
+ * measured unless stats_enabled is set.
+ */
+
+enum stats_timer {
+    /* a whole directory tree */
+    STATS_WALK = 0,
+    /* -f file magic check */
+    STATS_MAGIC,
+    /* pipeline stages, per file */
+    STATS_READ,
+    /* parsing the GPS IFD, or the EXIF data by libexif, within read or
+     * transform */
+    STATS_PARSE,
+    /* drawing and writing the new values, within transform */
+    STATS_RANDOMIZE,
+    STATS_TRANSFORM,
+    /* saving the EXIF data by libexif, within write or transform */
+    STATS_SERIALIZE,
+    STATS_WRITE,
+    /* from the start of the read stage (or of the request, for images sent
+     * whole) to the end of the last one, not counting the wait before */
+    STATS_FILE,
+    STATS_TIMERS
+};
+
+enum stats_counter {
+    STATS_FILES = 0,
+    /* unchanged since the last run (--cache) */
+    STATS_SKIPPED,
+    STATS_BYTES_READ,
+    STATS_BYTES_WRITTEN,
+    /* errors */
+    STATS_ERR_OPEN,
+    STATS_ERR_PARSE,
+    STATS_ERR_WRITE,
+    STATS_ERR_ALLOC,
+    STATS_COUNTERS
+};
+
+extern bool stats_enabled;
+
+/* monotonic nanoseconds, 0 if stats are disabled */
+uint64_t stats_now(void);
+/* record the time elapsed since start, taken from stats_now() */
+void     stats_time(enum stats_timer t, uint64_t start);
+/* record a duration measured otherwise, e.g. a share of a batch */
+void     stats_record(enum stats_timer t, uint64_t ns);
+void     stats_add(enum stats_counter c, uint64_t n);
+
+/* human readable table, or a JSON object */
+void     stats_print(FILE *f, bool json);
+
+#endif
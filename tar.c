@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "tar.h"
+
+#define TAR_BLOCK 512
+/* reads and writes, members are copied through it */
+#define TAR_BUF (1024 * 1024)
+/* GNU and pax headers in front of a member, and their size */
+#define TAR_EXT_MAX 8
+#define TAR_EXT_SIZE (1024 * 1024)
+#define TAR_NAME_MAX 4096
+
+/* ustar header fields */
+#define TAR_NAME 0
+#define TAR_SIZE 124
+#define TAR_CHKSUM 148
+#define TAR_TYPE 156
+#define TAR_MAGIC 257
+#define TAR_PREFIX 345
+
+struct tar_ext {
+    unsigned char h[TAR_BLOCK];
+    unsigned char *d;
+    size_t size;
+};
+
+struct tar {
+    int in;
+    int out;
+    unsigned char *ib;
+    size_t i_off;
+    size_t i_len;
+    unsigned char *ob;
+    size_t o_len;
+
+    /* the headers of the next member */
+    struct tar_ext ext[TAR_EXT_MAX];
+    unsigned int n_ext;
+    /* its pax header with a size record, or -1, and that size */
+    int pax_size;
+    uint64_t size;
+    char name[TAR_NAME_MAX];
+};
+
+static ssize_t fill(struct tar *t)
+{
+    ssize_t r;
+
+    do
+        r = read(t->in, t->ib, TAR_BUF);
+    while (r == -1 && errno == EINTR);
+    t->i_off = 0;
+    t->i_len = r > 0 ? r : 0;
+    return r;
+}
+
+/* false on errors, or if the archive ends first */
+static bool get(struct tar *t, unsigned char *d, size_t n)
+{
+    ssize_t r;
+    size_t l;
+
+    while (n > 0) {
+        if (t->i_off == t->i_len && (r = fill(t)) <= 0) {
+            if (r == 0)
+                errno = EINVAL;
+            return false;
+        }
+        l = t->i_len - t->i_off < n ? t->i_len - t->i_off : n;
+        if (d != NULL) {
+            memcpy(d, t->ib + t->i_off, l);
+            d += l;
+        }
+        t->i_off += l;
+        n -= l;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const unsigned char *d, size_t n)
+{
+    ssize_t r;
+
+    while (n > 0) {
+        r = write(fd, d, n);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        d += r;
+        n -= r;
+    }
+    return true;
+}
+
+static bool flush(struct tar *t)
+{
+    bool ok = write_full(t->out, t->ob, t->o_len);
+
+    t->o_len = 0;
+    return ok;
+}
+
+/* large chunks go out directly, the headers and small members are
+ * gathered */
+static bool put(struct tar *t, const unsigned char *d, size_t n)
+{
+    if (t->o_len > 0 && t->o_len + n > TAR_BUF && !flush(t))
+        return false;
+    if (t->o_len == 0 && n >= TAR_BUF / 2)
+        return write_full(t->out, d, n);
+    memcpy(t->ob + t->o_len, d, n);
+    t->o_len += n;
+    return true;
+}
+
+static bool put_zeroes(struct tar *t, size_t n)
+{
+    static const unsigned char zero[TAR_BLOCK];
+
+    return put(t, zero, n);
+}
+
+/* n bytes of the input, or all of it up to the end with n == SIZE_MAX */
+static bool copy(struct tar *t, size_t n)
+{
+    ssize_t r;
+    size_t l;
+
+    while (n > 0) {
+        if (t->i_off == t->i_len && (r = fill(t)) <= 0) {
+            if (r == 0 && n == SIZE_MAX)
+                break;
+            if (r == 0)
+                errno = EINVAL;
+            return false;
+        }
+        l = t->i_len - t->i_off < n ? t->i_len - t->i_off : n;
+        if (!put(t, t->ib + t->i_off, l))
+            return false;
+        t->i_off += l;
+        if (n != SIZE_MAX)
+            n -= l;
+    }
+    return true;
+}
+
+static size_t padding(uint64_t size)
+{
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+/* octal, or base-256 when the first bit is set (GNU) */
+static bool get_number(const unsigned char *f, size_t len, uint64_t *v)
+{
+    size_t i = 0;
+
+    *v = 0;
+    if (f[0] & 0x80) {
+        if (f[0] != 0x80)
+            return false;
+        for (i = 1; i < len; i++) {
+            if (*v >> 56)
+                return false;
+            *v = (*v << 8) | f[i];
+        }
+        return true;
+    }
+    while (i < len && f[i] == ' ')
+        i++;
+    for (; i < len && f[i] >= '0' && f[i] <= '7'; i++) {
+        if (*v >> 61)
+            return false;
+        *v = (*v << 3) | (f[i] - '0');
+    }
+    return i == len || f[i] == '\0' || f[i] == ' ';
+}
+
+static void set_number(unsigned char *f, size_t len, uint64_t v)
+{
+    char s[24];
+    size_t i;
+
+    if (v >> (3 * (len - 1)) == 0) {
+        snprintf(s, sizeof(s), "%0*llo", (int)len - 1,
+                (unsigned long long)v);
+        memcpy(f, s, len);
+        return;
+    }
+    f[0] = 0x80;
+    for (i = len - 1; i > 0; i--, v >>= 8)
+        f[i] = v & 0xff;
+}
+
+static unsigned int checksum(const unsigned char *h, bool sign)
+{
+    unsigned int i, sum = 0;
+
+    for (i = 0; i < TAR_BLOCK; i++) {
+        if (i >= TAR_CHKSUM && i < TAR_CHKSUM + 8)
+            sum += ' ';
+        else
+            sum += sign ? (unsigned int)(signed char)h[i] : h[i];
+    }
+    return sum;
+}
+
+static bool check_header(const unsigned char *h)
+{
+    uint64_t sum;
+
+    if (!get_number(h + TAR_CHKSUM, 8, &sum))
+        return false;
+    /* some old archivers summed signed chars */
+    return sum == checksum(h, false) || sum == checksum(h, true);
+}
+
+static void set_size(unsigned char *h, uint64_t size)
+{
+    char s[8];
+
+    set_number(h + TAR_SIZE, 12, size);
+    snprintf(s, sizeof(s), "%06o", checksum(h, false));
+    memcpy(h + TAR_CHKSUM, s, 7);
+    h[TAR_CHKSUM + 7] = ' ';
+}
+
+/* a "length key=value\n" record of a pax header */
+struct pax_record {
+    const char *d;
+    size_t len;
+    const char *key;
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+};
+
+/* calls f on every record of a pax header, false if they can't be
+ * parsed */
+static bool pax_records(const struct tar_ext *e,
+        void (*f)(const struct pax_record *r, void *arg), void *arg)
+{
+    const char *d = (const char *)e->d, *eq;
+    struct pax_record r;
+    size_t o = 0;
+    char *end;
+
+    while (o < e->size) {
+        r.d = d + o;
+        r.len = strtoul(r.d, &end, 10);
+        if (end == r.d || *end != ' ' || r.len <= (size_t)(end + 1 - r.d) ||
+                r.len > e->size - o || r.d[r.len - 1] != '\n')
+            return false;
+        r.key = end + 1;
+        if ((eq = memchr(r.key, '=', r.d + r.len - r.key)) == NULL)
+            return false;
+        r.key_len = eq - r.key;
+        r.value = eq + 1;
+        r.value_len = r.d + r.len - 1 - r.value;
+        f(&r, arg);
+        o += r.len;
+    }
+    return true;
+}
+
+static bool is_key(const struct pax_record *r, const char *key)
+{
+    return r->key_len == strlen(key) &&
+        memcmp(r->key, key, r->key_len) == 0;
+}
+
+struct pax_member {
+    char *name;
+    bool has_size;
+    uint64_t size;
+};
+
+static void pax_member(const struct pax_record *r, void *arg)
+{
+    struct pax_member *p = arg;
+    char s[24];
+    size_t n;
+
+    if (is_key(r, "path")) {
+        n = r->value_len < TAR_NAME_MAX ? r->value_len : TAR_NAME_MAX - 1;
+        memcpy(p->name, r->value, n);
+        p->name[n] = '\0';
+    } else if (is_key(r, "size") && r->value_len < sizeof(s)) {
+        memcpy(s, r->value, r->value_len);
+        s[r->value_len] = '\0';
+        p->size = strtoull(s, NULL, 10);
+        p->has_size = true;
+    }
+}
+
+struct pax_rewrite {
+    unsigned char *d;
+    size_t size;
+};
+
+static void pax_copy(const struct pax_record *r, void *arg)
+{
+    struct pax_rewrite *p = arg;
+
+    if (is_key(r, "size"))
+        return;
+    memcpy(p->d + p->size, r->d, r->len);
+    p->size += r->len;
+}
+
+/* the size record of a pax header set to size, it's moved to the end */
+static bool pax_set_size(struct tar_ext *e, uint64_t size)
+{
+    struct pax_rewrite p;
+    char rec[48];
+    size_t body, len;
+
+    body = snprintf(rec, sizeof(rec), " size=%llu\n",
+            (unsigned long long)size);
+    /* the length counts its own digits */
+    for (len = body + 1; len != body + snprintf(NULL, 0, "%zu", len);)
+        len = body + snprintf(NULL, 0, "%zu", len);
+    if ((p.d = malloc(e->size + len + 1)) == NULL)
+        return false;
+    p.size = 0;
+    pax_records(e, pax_copy, &p);
+    p.size += sprintf((char *)p.d + p.size, "%zu%s", len, rec);
+    free(e->d);
+    e->d = p.d;
+    e->size = p.size;
+    set_size(e->h, e->size);
+    return true;
+}
+
+static void drop_ext(struct tar *t)
+{
+    unsigned int i;
+
+    for (i = 0; i < t->n_ext; i++)
+        free(t->ext[i].d);
+    t->n_ext = 0;
+    t->pax_size = -1;
+    t->name[0] = '\0';
+}
+
+/* GNU long names and pax headers are held until their member comes */
+static bool read_ext(struct tar *t, const unsigned char *h, uint64_t size)
+{
+    struct tar_ext *e = &t->ext[t->n_ext];
+    struct pax_member p = { t->name, false, 0 };
+
+    if (t->n_ext == TAR_EXT_MAX || size > TAR_EXT_SIZE) {
+        errno = EINVAL;
+        return false;
+    }
+    memcpy(e->h, h, TAR_BLOCK);
+    if ((e->d = malloc(size + 1)) == NULL)
+        return false;
+    e->size = size;
+    t->n_ext++;
+    if (!get(t, e->d, size) || !get(t, NULL, padding(size)))
+        return false;
+    e->d[size] = '\0';
+
+    if (h[TAR_TYPE] == 'L') {
+        snprintf(t->name, TAR_NAME_MAX, "%s", (char *)e->d);
+    } else if (h[TAR_TYPE] == 'x') {
+        if (!pax_records(e, pax_member, &p)) {
+            errno = EINVAL;
+            return false;
+        }
+        if (p.has_size) {
+            t->pax_size = t->n_ext - 1;
+            t->size = p.size;
+        }
+    }
+    return true;
+}
+
+static bool put_ext(struct tar *t)
+{
+    struct tar_ext *e;
+    unsigned int i;
+
+    for (i = 0; i < t->n_ext; i++) {
+        e = &t->ext[i];
+        if (!put(t, e->h, TAR_BLOCK) || !put(t, e->d, e->size) ||
+                !put_zeroes(t, padding(e->size)))
+            return false;
+    }
+    return true;
+}
+
+/* the name from the ustar header, unless an extended one came before */
+static void member_name(struct tar *t, const unsigned char *h)
+{
+    int n = 0;
+
+    if (t->name[0] != '\0')
+        return;
+    if (memcmp(h + TAR_MAGIC, "ustar", 5) == 0 && h[TAR_PREFIX] != '\0')
+        n = snprintf(t->name, TAR_NAME_MAX, "%.155s/", h + TAR_PREFIX);
+    snprintf(t->name + n, TAR_NAME_MAX - n, "%.100s", h + TAR_NAME);
+}
+
+static bool filter_member(struct tar *t, unsigned char *h, uint64_t size,
+        unsigned char *head, unsigned char *out, const struct tar_ops *ops)
+{
+    struct tar_member m = { t->name, size };
+    size_t n = size < TAR_HEAD_MAX ? size : TAR_HEAD_MAX, out_size;
+    uint64_t new_size = size;
+    const unsigned char *d = head;
+
+    if (!get(t, head, n))
+        return false;
+    if (ops->member(&m, head, n, out, &out_size, ops->arg)) {
+        d = out;
+        new_size = size - n + out_size;
+        n = out_size;
+    }
+    if (new_size != size) {
+        if (t->pax_size != -1) {
+            if (!pax_set_size(&t->ext[t->pax_size], new_size))
+                return false;
+        }
+        set_size(h, new_size);
+    }
+
+    return put_ext(t) && put(t, h, TAR_BLOCK) && put(t, d, n) &&
+        copy(t, new_size - n) && get(t, NULL, padding(size)) &&
+        put_zeroes(t, padding(new_size));
+}
+
+static int run(struct tar *t, const struct tar_ops *ops,
+        unsigned char *head, unsigned char *out)
+{
+    unsigned char h[TAR_BLOCK];
+    uint64_t size;
+    ssize_t r;
+
+    for (;;) {
+        /* an archive cut right after a member ends there */
+        if (t->i_off == t->i_len && (r = fill(t)) <= 0) {
+            if (r == 0 && t->n_ext == 0)
+                return 0;
+            if (r == 0)
+                errno = EINVAL;
+            return -1;
+        }
+        if (!get(t, h, TAR_BLOCK))
+            return -1;
+
+        /* the end, the blocks after it go as they are */
+        if (h[0] == '\0' && memcmp(h, h + 1, TAR_BLOCK - 1) == 0)
+            return put(t, h, TAR_BLOCK) && copy(t, SIZE_MAX) ? 0 : -1;
+
+        if (!check_header(h) || !get_number(h + TAR_SIZE, 12, &size)) {
+            errno = EINVAL;
+            return -1;
+        }
+        switch (h[TAR_TYPE]) {
+            case 'L':
+            case 'K':
+            case 'x':
+                if (!read_ext(t, h, size))
+                    return -1;
+                continue;
+        }
+
+        /* the size of the pax header is the one that counts */
+        if (t->pax_size != -1)
+            size = t->size;
+        member_name(t, h);
+
+        switch (h[TAR_TYPE]) {
+            case '0':
+            case '\0':
+            case '7':
+                if (!filter_member(t, h, size, head, out, ops))
+                    return -1;
+                break;
+            default:
+                if (!put_ext(t) || !put(t, h, TAR_BLOCK) ||
+                        !copy(t, size + padding(size)))
+                    return -1;
+        }
+        drop_ext(t);
+    }
+}
+
+int tar_filter(int in, int out, const struct tar_ops *ops)
+{
+    unsigned char *head, *head_out;
+    struct tar t;
+    int ret = -1, err;
+
+    memset(&t, 0, sizeof(t));
+    t.in = in;
+    t.out = out;
+    t.pax_size = -1;
+    t.ib = malloc(TAR_BUF);
+    t.ob = malloc(TAR_BUF);
+    head = malloc(TAR_HEAD_MAX);
+    head_out = malloc(TAR_HEAD_MAX + TAR_HEAD_GROW);
+    if (t.ib != NULL && t.ob != NULL && head != NULL && head_out != NULL)
+        ret = run(&t, ops, head, head_out);
+    if (!flush(&t))
+        ret = -1;
+
+    err = errno;
+    drop_ext(&t);
+    free(t.ib);
+    free(t.ob);
+    free(head);
+    free(head_out);
+    errno = err;
+    return ret;
+}
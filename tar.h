@@ -0,0 +1,43 @@
+#ifndef __TAR_H__
+#define __TAR_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* a tar archive copied from a stream to another in a single pass
+ *
+ * ustar, with the GNU long names and pax extended headers. members go
+ * through one after the other. the first bytes of every regular file are
+ * handed over to a callback, which can replace them with more or fewer
+ * bytes. the size in the member's header is then fixed up along with its
+ * checksum, and the rest of the member is copied as it is. nothing else
+ * than these first bytes and the headers is held in memory.
+ */
+
+/* first bytes of a member handed over, and how much they can grow */
+#define TAR_HEAD_MAX (256 * 1024)
+#define TAR_HEAD_GROW (64 * 1024)
+
+struct tar_member {
+    /* full name, from the extended headers if there are some */
+    const char *name;
+    uint64_t size;
+};
+
+struct tar_ops {
+    /* called with the first min(size, TAR_HEAD_MAX) bytes of every
+     * regular file. returns true with the bytes to write instead in out,
+     * *out_size of them up to TAR_HEAD_MAX + TAR_HEAD_GROW, and false to
+     * keep them as they are */
+    bool (*member)(const struct tar_member *m, const unsigned char *head,
+            size_t size, unsigned char *out, size_t *out_size, void *arg);
+    void *arg;
+};
+
+/* copy the archive read from in to out, up to the end of in. returns 0
+ * on success, -1 on failure with errno set, EINVAL if in isn't a tar
+ * archive that can be handled */
+int tar_filter(int in, int out, const struct tar_ops *ops);
+
+#endif
@@ -0,0 +1,69 @@
+#!/bin/sh
+# --listen under load: every reply rand_gps_client -l gets must be PROTO_OK
+# and an image whose position changed, or is gone with -d, a file sent by
+# path must be rewritten in place, and the server must still stop cleanly
+#
+# usage: listen.sh rand_gps_exif rand_gps_client bench_corpus
+set -e
+
+exif=$1
+client=$2
+corpus=$3
+dir=$(mktemp -d "${TMPDIR:-/tmp}/rand_gps_exif-test.XXXXXX")
+pid=
+
+cleanup() {
+    [ -n "$pid" ] && kill "$pid" 2>/dev/null
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+# rand_gps_exif --listen $dir/sock with the options given
+start() {
+    rm -f "$dir/sock"
+    "$exif" -j 4 "$@" --listen "$dir/sock" &
+    pid=$!
+    i=0
+    while [ ! -S "$dir/sock" ]; do
+        if [ $i -ge 50 ] || ! kill -0 "$pid" 2>/dev/null; then
+            echo "rand_gps_exif --listen didn't start" >&2
+            exit 1
+        fi
+        i=$((i + 1))
+        sleep 0.1
+    done
+}
+
+stop() {
+    kill -TERM "$pid"
+    status=0
+    wait "$pid" || status=$?
+    pid=
+    if [ $status -ne 0 ]; then
+        echo "rand_gps_exif --listen exited with $status" >&2
+        exit 1
+    fi
+}
+
+"$corpus" -n 16 -s 32K "$dir/img" > /dev/null
+"$corpus" -n 1 -g 100 -s 32K -S 7 "$dir/path" > /dev/null
+cp "$dir"/path/*.jpg "$dir/orig.jpg"
+
+start
+# exits with 1 on any reply that isn't PROTO_OK or a rewritten image, or
+# a broken connection
+"$client" -S "$dir/sock" -l 2000 -c 4 -w 16 "$dir"/img/*.jpg
+
+# by path the file itself is patched, at the same size
+"$client" -S "$dir/sock" "$dir"/path/*.jpg
+if cmp -s "$dir/orig.jpg" "$dir"/path/*.jpg ||
+        [ "$(wc -c < "$dir/orig.jpg")" -ne \
+            "$(wc -c < "$dir"/path/*.jpg)" ]; then
+    echo "rand_gps_exif --listen didn't rewrite the file sent by path" >&2
+    exit 1
+fi
+stop
+
+start -d
+"$client" -S "$dir/sock" -l 200 -c 2 -w 8 -d "$dir"/img/*.jpg
+stop
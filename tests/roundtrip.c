@@ -0,0 +1,226 @@
+/* librandgps from the outside: synthetic images in both byte orders go
+ * through randgps_scrub() and randgps_app1(), and the GPS entries parsed
+ * back must hold the values drawn for their stream */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <libexif/exif-utils.h>
+
+#include "libjpeg/jpeg-gps.h"
+#include "randgps.h"
+#include "rng.h"
+#include "bench/synth.h"
+
+#define SEED 42
+#define TIME_MAX 1893456000     /* 2030 */
+
+static unsigned int failed;
+
+static void fail(const char *what, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+
+static void fail(const char *what, const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s: ", what);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    failed++;
+}
+
+static void image(struct buf *b, bool mm)
+{
+    struct layout l = {
+        .mm = mm, .gps = true, .makernote = 256, .thumbnail = 1024,
+        .segments = 1, .size = 16384,
+    };
+    struct rng r;
+
+    memset(b, 0, sizeof(*b));
+    b->mm = mm;
+    rng_init(&r, SEED, mm);
+    synth_jpeg(b, &l, &r);
+}
+
+static void options(struct randgps_options *o, bool delete_gps)
+{
+    randgps_options_init(o);
+    o->delete_gps = delete_gps;
+    o->seed = SEED;
+    o->time_max = TIME_MAX;
+}
+
+/* the n rationals of tag must be r */
+static void check_rationals(const char *what, const unsigned char *app1,
+        JPEGGpsInfo *info, ExifTag tag, const uint32_t *r, unsigned int n)
+{
+    JPEGGpsEntry *e = jpeg_gps_get_entry(info, tag);
+    ExifRational x;
+    unsigned int i;
+
+    if (!e || e->format != EXIF_FORMAT_RATIONAL || e->components != n) {
+        fail(what, "tag 0x%x isn't %u rationals", tag, n);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        x = exif_get_rational(app1 + e->offset + 8 * i, info->order);
+        if (x.numerator != r[2 * i] || x.denominator != r[2 * i + 1])
+            fail(what, "tag 0x%x rational %u is %u/%u, not %u/%u", tag, i,
+                    x.numerator, x.denominator, r[2 * i], r[2 * i + 1]);
+    }
+}
+
+/* the ASCII ref of tag must be c */
+static void check_ref(const char *what, const unsigned char *app1,
+        JPEGGpsInfo *info, ExifTag tag, char c)
+{
+    JPEGGpsEntry *e = jpeg_gps_get_entry(info, tag);
+
+    if (!e || e->format != EXIF_FORMAT_ASCII)
+        fail(what, "tag 0x%x isn't ASCII", tag);
+    else if (app1[e->offset] != c)
+        fail(what, "tag 0x%x is '%c', not '%c'", tag, app1[e->offset], c);
+}
+
+/* the GPS entries of the payload against the values of stream */
+static void check_app1(const char *what, const unsigned char *app1,
+        unsigned int size, ExifByteOrder order, uint64_t stream,
+        bool delete_gps)
+{
+    struct gps_values v;
+    JPEGGpsInfo info;
+    struct tm tm;
+
+    if (!jpeg_gps_parse(&info, app1, size)) {
+        fail(what, "GPS IFD not parsed back");
+        return;
+    }
+    if (info.order != order)
+        fail(what, "byte order changed");
+    if (delete_gps) {
+        if (jpeg_gps_get_entry(&info, EXIF_TAG_GPS_LATITUDE) ||
+                jpeg_gps_get_entry(&info, EXIF_TAG_GPS_LONGITUDE) ||
+                jpeg_gps_get_entry(&info, EXIF_TAG_GPS_TIME_STAMP))
+            fail(what, "GPS entries left");
+        return;
+    }
+
+    gps_values_fill(&v, &stream, 1, SEED, TIME_MAX);
+    gmtime_r(&v.time, &tm);
+    {
+        const uint32_t lat[] = {
+            v.latitude[0], 1, v.latitude[1], 1, v.latitude[2], 10,
+        };
+        const uint32_t lon[] = {
+            v.longitude[0], 1, v.longitude[1], 1, v.longitude[2], 10,
+        };
+        const uint32_t ts[] = {
+            (uint32_t)tm.tm_hour, 1, (uint32_t)tm.tm_min, 1,
+            (uint32_t)tm.tm_sec, 1,
+        };
+
+        check_rationals(what, app1, &info, EXIF_TAG_GPS_LATITUDE, lat, 3);
+        check_rationals(what, app1, &info, EXIF_TAG_GPS_LONGITUDE, lon, 3);
+        check_rationals(what, app1, &info, EXIF_TAG_GPS_TIME_STAMP, ts, 3);
+    }
+    check_ref(what, app1, &info, EXIF_TAG_GPS_LATITUDE_REF,
+            v.latitude_ref ? 'S' : 'N');
+    check_ref(what, app1, &info, EXIF_TAG_GPS_LONGITUDE_REF,
+            v.longitude_ref ? 'W' : 'E');
+}
+
+/* the whole image through randgps_scrub(), named so the stream is known */
+static void test_scrub(const char *what, bool mm, bool delete_gps)
+{
+    struct randgps_options o;
+    struct randgps_input in;
+    struct randgps_output out;
+    unsigned int off, len;
+    struct buf b;
+
+    image(&b, mm);
+    options(&o, delete_gps);
+    in.data = b.d;
+    in.size = b.len;
+    in.name = what;
+    out.capacity = b.len;
+    out.data = malloc(out.capacity);
+    if (!out.data) {
+        perror("malloc");
+        exit(1);
+    }
+
+    if (randgps_scrub(&o, &in, &out, 1) != 1 || out.status != RANDGPS_OK)
+        fail(what, "not scrubbed, status %d", out.status);
+    else if (out.size != b.len)
+        fail(what, "%zu bytes, not %zu", out.size, b.len);
+    else if (jpeg_gps_find_app1_data(out.data, out.size, &off, &len) != 1)
+        fail(what, "no APP1 left");
+    else
+        check_app1(what, out.data + off, len,
+                mm ? EXIF_BYTE_ORDER_MOTOROLA : EXIF_BYTE_ORDER_INTEL,
+                randgps_stream(what), delete_gps);
+
+    free(out.data);
+    free(b.d);
+}
+
+/* only the APP1 payload through randgps_app1(), nothing else moved */
+static void test_app1(const char *what, bool mm, bool delete_gps)
+{
+    struct randgps_range changed[RANDGPS_MAX_RANGES];
+    struct randgps_options o;
+    unsigned int off, len, n_changed, i;
+    unsigned char *app1;
+    uint64_t stream = randgps_stream(what);
+    struct buf b;
+    int r;
+
+    image(&b, mm);
+    options(&o, delete_gps);
+    if (jpeg_gps_find_app1_data(b.d, b.len, &off, &len) != 1) {
+        fail(what, "no APP1");
+        free(b.d);
+        return;
+    }
+    app1 = b.d + off;
+
+    r = randgps_app1(&o, app1, len, stream, changed, &n_changed);
+    if (r <= 0)
+        fail(what, "randgps_app1() returned %d", r);
+    else {
+        for (i = 0; i < n_changed; i++)
+            if (changed[i].offset + changed[i].size > len)
+                fail(what, "range %u past the payload", i);
+        check_app1(what, app1, len,
+                mm ? EXIF_BYTE_ORDER_MOTOROLA : EXIF_BYTE_ORDER_INTEL,
+                stream, delete_gps);
+    }
+    free(b.d);
+}
+
+int main(void)
+{
+    test_scrub("scrub MM", true, false);
+    test_scrub("scrub II", false, false);
+    test_scrub("scrub MM -d", true, true);
+    test_scrub("scrub II -d", false, true);
+    test_app1("app1 MM", true, false);
+    test_app1("app1 II", false, false);
+    test_app1("app1 MM -d", true, true);
+    test_app1("app1 II -d", false, true);
+
+    if (failed) {
+        fprintf(stderr, "%u failures\n", failed);
+        return 1;
+    }
+    printf("roundtrip: ok\n");
+    return 0;
+}
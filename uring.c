@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && \
+    __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+
+#ifdef HAVE_IO_URING
+
+struct uring {
+    int fd;
+
+    /* submission ring */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int sq_entries;
+
+    /* completion ring, mapped along with the submission one if the
+     * kernel supports it */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* queued but not submitted, and submitted but not completed */
+    unsigned int queued;
+    unsigned int inflight;
+};
+
+#define URING_LOAD(p) \
+    atomic_load_explicit((_Atomic unsigned int *)(p), memory_order_acquire)
+#define URING_STORE(p, v) \
+    atomic_store_explicit((_Atomic unsigned int *)(p), (v), \
+            memory_order_release)
+
+struct uring *uring_new(unsigned int entries)
+{
+    struct io_uring_params p;
+    struct uring *r;
+
+    if ((r = calloc(1, sizeof(struct uring))) == NULL)
+        return NULL;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = 0;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED)
+        goto fail;
+    if (r->cq_ring_size) {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED)
+            goto fail;
+    } else {
+        r->cq_ring = r->sq_ring;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    r->sq_head = (unsigned int *)((char *)r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned int *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)((char *)r->sq_ring + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned int *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned int *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+    return r;
+
+fail:
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring_size && r->cq_ring && r->cq_ring != MAP_FAILED)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring && r->sq_ring != MAP_FAILED)
+        munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    free(r);
+    return NULL;
+}
+
+void uring_free(struct uring *r)
+{
+    if (r == NULL)
+        return;
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring_size)
+        munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    free(r);
+}
+
+/* next free submission entry, running the batch if the ring is full */
+static struct io_uring_sqe *uring_sqe(struct uring *r, int *res)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail;
+
+    if (r->queued + r->inflight >= r->sq_entries && uring_run(r) == -1) {
+        *res = -EIO;
+        return NULL;
+    }
+
+    tail = *r->sq_tail + r->queued;
+    sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    sqe->user_data = (unsigned long)res;
+    r->queued++;
+    *res = -ECANCELED;
+    return sqe;
+}
+
+void uring_openat(struct uring *r, const char *path, int flags, int *res)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r, res);
+
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)path;
+    sqe->open_flags = flags | O_CLOEXEC;
+}
+
+void uring_read(struct uring *r, int fd, void *buf, unsigned int len,
+        off_t off, int *res)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r, res);
+
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = off;
+}
+
+void uring_write(struct uring *r, int fd, const void *buf, unsigned int len,
+        off_t off, int *res)
+{
+    struct io_uring_sqe *sqe = uring_sqe(r, res);
+
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = off;
+}
+
+int uring_run(struct uring *r)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head, tail;
+    int ret;
+
+    /* publish the queued entries */
+    URING_STORE(r->sq_tail, *r->sq_tail + r->queued);
+    r->inflight += r->queued;
+
+    while (r->inflight) {
+        ret = syscall(__NR_io_uring_enter, r->fd, r->queued, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            return -1;
+        }
+        r->queued -= (unsigned int)ret < r->queued ? (unsigned int)ret :
+            r->queued;
+
+        head = *r->cq_head;
+        tail = URING_LOAD(r->cq_tail);
+        for (; head != tail; head++) {
+            cqe = &r->cqes[head & *r->cq_mask];
+            *(int *)(unsigned long)cqe->user_data = cqe->res;
+            r->inflight--;
+        }
+        URING_STORE(r->cq_head, head);
+    }
+    r->queued = 0;
+    return 0;
+}
+
+#else /* !HAVE_IO_URING */
+
+struct uring *uring_new(unsigned int entries)
+{
+    (void)entries;
+    return NULL;
+}
+
+void uring_free(struct uring *r) { (void)r; }
+
+void uring_openat(struct uring *r, const char *path, int flags, int *res)
+{
+    (void)r; (void)path; (void)flags;
+    *res = -ENOSYS;
+}
+
+void uring_read(struct uring *r, int fd, void *buf, unsigned int len,
+        off_t off, int *res)
+{
+    (void)r; (void)fd; (void)buf; (void)len; (void)off;
+    *res = -ENOSYS;
+}
+
+void uring_write(struct uring *r, int fd, const void *buf, unsigned int len,
+        off_t off, int *res)
+{
+    (void)r; (void)fd; (void)buf; (void)len; (void)off;
+    *res = -ENOSYS;
+}
+
+int uring_run(struct uring *r)
+{
+    (void)r;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* batched I/O through io_uring
+ *
+ * operations are queued with uring_openat/read/write and submitted all at
+ * once by uring_run, which waits for every one of them. the result of each
+ * one (what the syscall would return, or -errno) is stored in *res.
+ * operations of the same batch run in no particular order.
+ *
+ * uring_new returns NULL when io_uring isn't available (old kernel,
+ * seccomp, not Linux...), callers then use plain blocking syscalls.
+ */
+
+struct uring;
+
+struct uring *uring_new(unsigned int entries);
+void uring_free(struct uring *r);
+
+void uring_openat(struct uring *r, const char *path, int flags, int *res);
+void uring_read(struct uring *r, int fd, void *buf, unsigned int len,
+        off_t off, int *res);
+void uring_write(struct uring *r, int fd, const void *buf, unsigned int len,
+        off_t off, int *res);
+
+/* submit what's queued and wait for it. returns -1 if the ring broke */
+int uring_run(struct uring *r);
+
+#endif
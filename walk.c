@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "walk.h"
+
+/* a directory to scan. it keeps its parent open until it's opened
+ * itself, and is kept open while there are children to open. */
+struct walk_node {
+    struct walk_node *parent;
+    DIR *dir;
+    atomic_uint refs;
+    size_t path_len;
+    char path[];
+};
+
+/* pending directories of a thread. the owner works on the newest ones
+ * (depth first), thieves take the oldest ones, usually bigger subtrees. */
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_node **nodes;
+    size_t head;
+    size_t tail;
+    size_t size;
+};
+
+struct walk;
+
+struct walk_thread {
+    pthread_t thread;
+    struct walk *walk;
+    unsigned int id;
+    struct walk_deque deque;
+    /* file paths are built here */
+    char *buf;
+    size_t buf_size;
+};
+
+struct walk {
+    const struct walk_ops *ops;
+    struct walk_thread *threads;
+    unsigned int n_threads;
+    /* directories queued or being scanned */
+    atomic_size_t pending;
+};
+
+static struct walk_node *walk_node_new(struct walk_node *parent,
+        const char *name)
+{
+    size_t len = strlen(name);
+    size_t plen = parent ? parent->path_len + 1 : 0;
+    struct walk_node *n = malloc(sizeof(struct walk_node) + plen + len + 1);
+
+    if (n == NULL)
+        return NULL;
+    n->parent = parent;
+    n->dir = NULL;
+    atomic_init(&n->refs, 1);
+    if (parent) {
+        memcpy(n->path, parent->path, parent->path_len);
+        n->path[parent->path_len] = '/';
+        atomic_fetch_add(&parent->refs, 1);
+    }
+    memcpy(n->path + plen, name, len + 1);
+    n->path_len = plen + len;
+    return n;
+}
+
+static void walk_node_put(struct walk_node *n)
+{
+    if (atomic_fetch_sub(&n->refs, 1) != 1)
+        return;
+    if (n->dir)
+        closedir(n->dir);
+    if (n->parent)
+        walk_node_put(n->parent);
+    free(n);
+}
+
+static bool walk_deque_push(struct walk_deque *d, struct walk_node *n)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->size) {
+        /* slide down what was stolen before growing */
+        if (d->head > 0) {
+            memmove(d->nodes, d->nodes + d->head,
+                    (d->tail - d->head) * sizeof(struct walk_node *));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            size_t size = d->size ? d->size * 2 : 64;
+            struct walk_node **nodes = realloc(d->nodes,
+                    size * sizeof(struct walk_node *));
+            if (nodes == NULL) {
+                pthread_mutex_unlock(&d->lock);
+                return false;
+            }
+            d->nodes = nodes;
+            d->size = size;
+        }
+    }
+    d->nodes[d->tail++] = n;
+    pthread_mutex_unlock(&d->lock);
+    return true;
+}
+
+static struct walk_node *walk_deque_pop(struct walk_deque *d, bool steal)
+{
+    struct walk_node *n = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail)
+        n = steal ? d->nodes[d->head++] : d->nodes[--d->tail];
+    if (d->head == d->tail)
+        d->head = d->tail = 0;
+    pthread_mutex_unlock(&d->lock);
+    return n;
+}
+
+static const char *walk_path(struct walk_thread *t, struct walk_node *n,
+        const char *name)
+{
+    size_t size = n->path_len + strlen(name) + 2;
+
+    if (size > t->buf_size) {
+        char *buf = realloc(t->buf, size);
+        if (buf == NULL)
+            return NULL;
+        t->buf = buf;
+        t->buf_size = size;
+    }
+    snprintf(t->buf, size, "%s/%s", n->path, name);
+    return t->buf;
+}
+
+static void walk_scan(struct walk_thread *t, struct walk_node *n)
+{
+    const struct walk_ops *ops = t->walk->ops;
+    struct walk_node *child;
+    struct dirent *e;
+    struct stat st;
+    const char *path;
+    unsigned char type;
+    int fd;
+
+    if (n->parent) {
+        fd = openat(dirfd(n->parent->dir), n->path + n->parent->path_len + 1,
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        /* the parent can be closed once all its children are open */
+        walk_node_put(n->parent);
+        n->parent = NULL;
+    } else {
+        fd = open(n->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd == -1 || (n->dir = fdopendir(fd)) == NULL) {
+        ops->error(n->path, errno, ops->arg);
+        if (fd != -1)
+            close(fd);
+        walk_node_put(n);
+        return;
+    }
+
+    while ((e = readdir(n->dir)) != NULL) {
+        if ((strcmp(e->d_name, ".") == 0) ||
+                (strcmp(e->d_name, "..") == 0))
+            continue;
+
+        type = e->d_type;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dirfd(n->dir), e->d_name, &st,
+                        AT_SYMLINK_NOFOLLOW) == -1) {
+                if ((path = walk_path(t, n, e->d_name)) != NULL)
+                    ops->error(path, errno, ops->arg);
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR :
+                S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+        }
+        /* links to files are followed, like stat(2) would. links to
+         * directories aren't, they could lead back up the tree and every
+         * directory is opened one component at a time, so nothing would
+         * end the loop */
+        if (type == DT_LNK) {
+            if (fstatat(dirfd(n->dir), e->d_name, &st, 0) == -1) {
+                if ((path = walk_path(t, n, e->d_name)) != NULL)
+                    ops->error(path, errno, ops->arg);
+                continue;
+            }
+            if (S_ISDIR(st.st_mode))
+                continue;
+            type = DT_REG;
+        }
+
+        if (type == DT_DIR) {
+            child = walk_node_new(n, e->d_name);
+            if (child == NULL) {
+                ops->error(n->path, ENOMEM, ops->arg);
+                continue;
+            }
+            atomic_fetch_add(&t->walk->pending, 1);
+            if (!walk_deque_push(&t->deque, child)) {
+                ops->error(child->path, ENOMEM, ops->arg);
+                atomic_fetch_sub(&t->walk->pending, 1);
+                walk_node_put(child);
+            }
+        } else if ((path = walk_path(t, n, e->d_name)) != NULL) {
+            ops->file(path, ops->arg);
+        } else {
+            ops->error(n->path, ENOMEM, ops->arg);
+        }
+    }
+
+    walk_node_put(n);
+}
+
+static void *walk_thread_main(void *arg)
+{
+    struct walk_thread *t = arg;
+    struct walk *w = t->walk;
+    struct timespec idle = { 0, 100000 };
+    struct walk_node *n;
+    unsigned int i;
+
+    for (;;) {
+        n = walk_deque_pop(&t->deque, false);
+        for (i = 1; n == NULL && i < w->n_threads; i++)
+            n = walk_deque_pop(&w->threads[(t->id + i) % w->n_threads].deque,
+                    true);
+
+        if (n != NULL) {
+            walk_scan(t, n);
+            atomic_fetch_sub(&w->pending, 1);
+        } else if (atomic_load(&w->pending) == 0) {
+            break;
+        } else {
+            /* someone is still scanning, there may be more to steal */
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+int walk_tree(const char *root, unsigned int threads,
+        const struct walk_ops *ops)
+{
+    struct walk w;
+    struct walk_node *n;
+    unsigned int i, started;
+
+    if (threads == 0)
+        threads = 1;
+
+    w.ops = ops;
+    w.n_threads = threads;
+    atomic_init(&w.pending, 1);
+    if ((w.threads = calloc(threads, sizeof(struct walk_thread))) == NULL)
+        return -1;
+    for (i = 0; i < threads; i++) {
+        w.threads[i].walk = &w;
+        w.threads[i].id = i;
+        pthread_mutex_init(&w.threads[i].deque.lock, NULL);
+    }
+
+    if ((n = walk_node_new(NULL, root)) == NULL ||
+            !walk_deque_push(&w.threads[0].deque, n)) {
+        free(n);
+        free(w.threads);
+        return -1;
+    }
+
+    for (started = 1; started < threads; started++)
+        if (pthread_create(&w.threads[started].thread, NULL,
+                    walk_thread_main, &w.threads[started]) != 0)
+            break;
+    walk_thread_main(&w.threads[0]);
+
+    for (i = 1; i < started; i++)
+        pthread_join(w.threads[i].thread, NULL);
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&w.threads[i].deque.lock);
+        free(w.threads[i].deque.nodes);
+        free(w.threads[i].buf);
+    }
+    free(w.threads);
+    return 0;
+}
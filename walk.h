@@ -0,0 +1,27 @@
+#ifndef __WALK_H__
+#define __WALK_H__
+
+/* parallel directory traversal
+ *
+ * directories are scanned by a pool of threads, each one with its own
+ * stack of pending directories which the others steal from when they run
+ * out of work. entries are opened relative to their parent directory and
+ * only stat'ed when readdir(3) doesn't tell their type.
+ */
+
+struct walk_ops {
+    /* called for every non directory found, from any walker thread.
+     * path is only valid during the call. */
+    void (*file)(const char *path, void *arg);
+    /* called when path can't be opened or stat'ed */
+    void (*error)(const char *path, int err, void *arg);
+    void *arg;
+};
+
+/* walk the tree under root with the given number of threads, the calling
+ * thread being one of them. returns once the whole tree was walked, 0 on
+ * success and -1 if the walk couldn't be started. */
+int walk_tree(const char *root, unsigned int threads,
+        const struct walk_ops *ops);
+
+#endif
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+#include "watch.h"
+
+/* new directories show up with IN_CREATE, files once they're complete */
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR)
+
+/* a file waiting for its delay to pass without events */
+struct watch_file {
+    struct watch_file *hash_next;
+    struct watch_file *prev;
+    struct watch_file *next;
+    uint64_t deadline;
+    char path[];
+};
+
+struct watch {
+    int fd;
+    int sig;
+    sigset_t old_mask;
+    char *root;
+    uint64_t delay;
+    const struct walk_ops *ops;
+
+    /* path of every watched directory, by watch descriptor */
+    char **dirs;
+    size_t n_dirs;
+
+    /* pending files, by path and by deadline. the delay being the same
+     * for all, a file that gets an event again just goes to the end. */
+    struct watch_file **buckets;
+    size_t n_buckets;
+    size_t n_files;
+    struct watch_file *head;
+    struct watch_file *tail;
+};
+
+/* what's done with the files found scanning a directory */
+enum watch_scan {
+    /* report them now, to catch up */
+    WATCH_REPORT,
+    /* new directory, they might still be written to */
+    WATCH_PEND
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t path_hash(const char *s)
+{
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static void list_remove(struct watch *w, struct watch_file *f)
+{
+    if (f->prev)
+        f->prev->next = f->next;
+    else
+        w->head = f->next;
+    if (f->next)
+        f->next->prev = f->prev;
+    else
+        w->tail = f->prev;
+}
+
+static void list_append(struct watch *w, struct watch_file *f)
+{
+    f->next = NULL;
+    f->prev = w->tail;
+    if (w->tail)
+        w->tail->next = f;
+    else
+        w->head = f;
+    w->tail = f;
+}
+
+static void hash_grow(struct watch *w)
+{
+    struct watch_file **old = w->buckets, *f, *next;
+    size_t i, n = w->n_buckets, size = n ? 2 * n : 256;
+
+    if ((w->buckets = calloc(size, sizeof(struct watch_file *))) == NULL) {
+        w->buckets = old;
+        return;
+    }
+    w->n_buckets = size;
+    for (i = 0; i < n; i++)
+        for (f = old[i]; f != NULL; f = next) {
+            next = f->hash_next;
+            f->hash_next = w->buckets[path_hash(f->path) & (size - 1)];
+            w->buckets[path_hash(f->path) & (size - 1)] = f;
+        }
+    free(old);
+}
+
+/* (re)start the delay of path */
+static void pend(struct watch *w, const char *path)
+{
+    struct watch_file **b, *f;
+    size_t len;
+
+    if (w->n_files >= w->n_buckets)
+        hash_grow(w);
+    if (w->n_buckets == 0)
+        return;
+
+    b = &w->buckets[path_hash(path) & (w->n_buckets - 1)];
+    for (f = *b; f != NULL; f = f->hash_next)
+        if (strcmp(f->path, path) == 0)
+            break;
+    if (f != NULL)
+        list_remove(w, f);
+    else {
+        len = strlen(path);
+        if ((f = malloc(sizeof(struct watch_file) + len + 1)) == NULL)
+            return;
+        memcpy(f->path, path, len + 1);
+        f->hash_next = *b;
+        *b = f;
+        w->n_files++;
+    }
+    f->deadline = now_ns() + w->delay;
+    list_append(w, f);
+}
+
+/* forget the oldest pending file, it's at the head of the list */
+static void unpend_head(struct watch *w)
+{
+    struct watch_file *f = w->head, **b;
+
+    b = &w->buckets[path_hash(f->path) & (w->n_buckets - 1)];
+    while (*b != f)
+        b = &(*b)->hash_next;
+    *b = f->hash_next;
+    list_remove(w, f);
+    w->n_files--;
+    free(f);
+}
+
+/* report the files whose delay passed */
+static void flush(struct watch *w, uint64_t now)
+{
+    while (w->head != NULL && w->head->deadline <= now) {
+        w->ops->file(w->head->path, w->ops->arg);
+        unpend_head(w);
+    }
+}
+
+static char *join(const char *dir, const char *name)
+{
+    size_t dl = strlen(dir), nl = strlen(name);
+    char *p = malloc(dl + nl + 2);
+
+    if (p == NULL)
+        return NULL;
+    memcpy(p, dir, dl);
+    p[dl] = '/';
+    memcpy(p + dl + 1, name, nl + 1);
+    return p;
+}
+
+/* watch path and everything under it, then scan it. the watch comes
+ * first so that nothing landing in between is missed. */
+static void add_dir(struct watch *w, const char *path, enum watch_scan scan)
+{
+    struct dirent *e;
+    struct stat st;
+    char **dirs, *child;
+    bool is_dir;
+    DIR *d;
+    int wd;
+
+    if ((wd = inotify_add_watch(w->fd, path, WATCH_MASK)) == -1) {
+        w->ops->error(path, errno, w->ops->arg);
+        return;
+    }
+    if ((size_t)wd >= w->n_dirs) {
+        if ((dirs = realloc(w->dirs, (wd + 64) * sizeof(char *))) == NULL)
+            return;
+        memset(dirs + w->n_dirs, 0, (wd + 64 - w->n_dirs) * sizeof(char *));
+        w->dirs = dirs;
+        w->n_dirs = wd + 64;
+    }
+    /* the same directory again, e.g. moved, is still the same watch */
+    free(w->dirs[wd]);
+    w->dirs[wd] = strdup(path);
+
+    if ((d = opendir(path)) == NULL) {
+        w->ops->error(path, errno, w->ops->arg);
+        return;
+    }
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        if (e->d_type != DT_UNKNOWN)
+            is_dir = e->d_type == DT_DIR;
+        else if (fstatat(dirfd(d), e->d_name, &st,
+                    AT_SYMLINK_NOFOLLOW) == 0)
+            is_dir = S_ISDIR(st.st_mode);
+        else
+            continue;
+
+        if ((child = join(path, e->d_name)) == NULL)
+            continue;
+        if (is_dir)
+            add_dir(w, child, scan);
+        else if (scan == WATCH_REPORT)
+            w->ops->file(child, w->ops->arg);
+        else
+            pend(w, child);
+        free(child);
+    }
+    closedir(d);
+}
+
+static void handle_event(struct watch *w, const struct inotify_event *ev)
+{
+    char *path;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        /* events were lost, look at everything again */
+        add_dir(w, w->root, WATCH_REPORT);
+        return;
+    }
+    if (ev->wd < 0 || (size_t)ev->wd >= w->n_dirs || w->dirs[ev->wd] == NULL)
+        return;
+    if (ev->mask & IN_IGNORED) {
+        free(w->dirs[ev->wd]);
+        w->dirs[ev->wd] = NULL;
+        return;
+    }
+    if (ev->len == 0 || (path = join(w->dirs[ev->wd], ev->name)) == NULL)
+        return;
+
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+            add_dir(w, path, WATCH_PEND);
+    } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+        pend(w, path);
+    free(path);
+}
+
+static int read_events(struct watch *w)
+{
+    char buf[65536]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+
+    if ((n = read(w->fd, buf, sizeof(buf))) == -1)
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+        ev = (const struct inotify_event *)p;
+        handle_event(w, ev);
+    }
+    return 0;
+}
+
+struct watch *watch_new(const char *root, unsigned int delay_ms,
+        const struct walk_ops *ops)
+{
+    struct watch *w;
+    sigset_t set;
+
+    if ((w = calloc(1, sizeof(struct watch))) == NULL)
+        return NULL;
+    w->fd = w->sig = -1;
+    w->delay = (uint64_t)delay_ms * 1000000;
+    w->ops = ops;
+    if ((w->root = strdup(root)) == NULL)
+        goto fail;
+    if ((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+        goto fail;
+
+    /* taken through a descriptor, between two batches of events */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &set, &w->old_mask) != 0)
+        goto fail;
+    if ((w->sig = signalfd(-1, &set, SFD_CLOEXEC)) == -1) {
+        pthread_sigmask(SIG_SETMASK, &w->old_mask, NULL);
+        goto fail;
+    }
+    return w;
+
+fail:
+    if (w->fd != -1)
+        close(w->fd);
+    free(w->root);
+    free(w);
+    return NULL;
+}
+
+int watch_run(struct watch *w)
+{
+    struct signalfd_siginfo si;
+    struct pollfd fds[2];
+    uint64_t now;
+    int timeout;
+
+    add_dir(w, w->root, WATCH_REPORT);
+
+    fds[0].fd = w->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = w->sig;
+    fds[1].events = POLLIN;
+    for (;;) {
+        timeout = -1;
+        if (w->head != NULL) {
+            now = now_ns();
+            timeout = w->head->deadline <= now ? 0 :
+                (w->head->deadline - now + 999999) / 1000000;
+        }
+        if (poll(fds, 2, timeout) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (fds[1].revents & POLLIN) {
+            /* consumed, or it'd be delivered once unblocked */
+            if (read(w->sig, &si, sizeof(si)) != sizeof(si))
+                return -1;
+            return 0;
+        }
+        if ((fds[0].revents & POLLIN) && read_events(w) == -1)
+            return -1;
+        flush(w, now_ns());
+    }
+}
+
+void watch_free(struct watch *w)
+{
+    size_t i;
+
+    if (w == NULL)
+        return;
+    /* whatever is still pending is left for the next run */
+    while (w->head != NULL)
+        unpend_head(w);
+    for (i = 0; i < w->n_dirs; i++)
+        free(w->dirs[i]);
+    free(w->dirs);
+    free(w->buckets);
+    close(w->fd);
+    close(w->sig);
+    pthread_sigmask(SIG_SETMASK, &w->old_mask, NULL);
+    free(w->root);
+    free(w);
+}
@@ -0,0 +1,30 @@
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+#include "walk.h"
+
+/* new files of a directory tree, as they land (inotify(7))
+ *
+ * every directory of the tree is watched and scanned once to catch up,
+ * then only the files closed after being written, or moved into the tree,
+ * are reported. they're held until nothing happened to them for a while,
+ * so that files still being written aren't. new directories are watched
+ * and scanned as they appear, and if the kernel drops events the whole
+ * tree is scanned again.
+ *
+ * SIGINT and SIGTERM end the watch. they're blocked from watch_new() on,
+ * so it must be called before any other thread is started.
+ */
+
+struct watch;
+
+/* watch the tree under root, files are reported delay_ms after their
+ * last event. NULL on failure, with errno set */
+struct watch *watch_new(const char *root, unsigned int delay_ms,
+        const struct walk_ops *ops);
+/* scan the tree, then report new files until a signal comes. returns 0
+ * then, -1 on failure */
+int  watch_run(struct watch *w);
+void watch_free(struct watch *w);
+
+#endif